@@ -9,6 +9,17 @@
  * adjacent free block coalescing. Also each free block store two pointers to another free blocks
  * thus reducing malloc function search time to O(free blocks), instead of O(all blocks)
  * with implicit list structure.
+ *
+ * Small free blocks are kept in segregated lists, one per power of two size
+ * class, so a block is inserted and removed in O(1) and malloc only searches
+ * the lists of classes that can fit the request. The list heads live at the
+ * start of the heap, before the prologue block.
+ *
+ * Large free blocks are kept in a red-black tree ordered by size, then by
+ * address, so the best fit is found in O(log n) however many large blocks
+ * there are, and of equally sized blocks the lowest one is used. The tree
+ * nodes are the free blocks themselves: the list links are the children,
+ * followed by the parent and the color.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -31,6 +42,13 @@
 
 #define CHUNKSIZE (1 << 12)
 
+/* Number of segregated free lists. List i holds the free blocks of
+ * 2^i up to 2^(i+1) - 1 times MIN_BLOCK_SIZE bytes, the larger blocks
+ * are in the tree. */
+#define FREE_LISTS 7
+#define MIN_BLOCK_SIZE (2 * PTR_SIZE + 2 * SIZE_T_SIZE)
+#define TREE_MIN_SIZE (MIN_BLOCK_SIZE << FREE_LISTS)
+
 #define MAX(x, y) ((x) >= (y) ? (x) : (y))
 
 #define GET(p) (*(size_t *)(p))
@@ -52,6 +70,17 @@
 #define PREV_FREEP(bp) ((char *)(bp))
 #define NEXT_FREEP(bp) ((char *)(bp) + PTR_SIZE)
 
+/* Tree links of a large free block, LEFT and RIGHT are the list links */
+#define LEFT 0
+#define RIGHT 1
+#define CHILDP(bp, dir) ((char *)(bp) + (dir)*PTR_SIZE)
+#define PARENTP(bp) ((char *)(bp) + 2 * PTR_SIZE)
+#define COLORP(bp) ((char *)(bp) + 3 * PTR_SIZE)
+
+#define BLACK 0
+#define RED 1
+#define IS_RED(bp) ((bp) != NULL && GET(COLORP(bp)) == RED)
+
 #define NEXT_BLKP(bp) ((char *)(bp) + GET_SIZE(HDRP(bp)))
 #define PREV_BLKP(bp) ((char *)(bp)-GET_SIZE((char *)(bp)-2 * SIZE_T_SIZE))
 
@@ -59,7 +88,8 @@
 #define PACK_FTR(size) (size)
 
 static void *heap_listp = NULL;
-static void *free_list_head = NULL;
+static void **free_lists = NULL;
+static void *free_tree = NULL;
 
 static void *find_fit(size_t asize);
 static void place(void *bp, size_t asize);
@@ -67,12 +97,26 @@ static void *extend_heap(size_t words);
 static void *coalesce(void *bp);
 static void add_to_free_list(void *bp);
 static void remove_from_free_list(void *bp);
+static int size_class(size_t size);
+static void *tree_fit(size_t asize);
+static int tree_less(void *a, void *b);
+static int key_less(size_t a_size, void *a, size_t b_size, void *b);
+static void *tree_step(void *bp, int dir);
+static void tree_insert(void *bp);
+static void tree_remove(void *bp);
+static int tree_replace(void *old, void *bp, size_t size);
+static void insert_fixup(void *bp);
+static void remove_fixup(void *bp, void *parent);
+static void rotate(void *bp, int dir);
+static void replace_child(void *parent, void *old, void *new);
 
 #ifdef DEBUG
 static void mm_check_heap(char *caller_name);
 static void check_block(void *bp, char *caller_name);
 static void check_placed(void *placed, char *caller_name);
 static void check_free(void *freed, char *caller_name);
+static int check_tree(void *bp, void *low, void *high, int *count, char *caller_name);
+static int in_tree(void *bp);
 #endif
 
 /*
@@ -80,15 +124,24 @@ static void check_free(void *freed, char *caller_name);
  */
 int mm_init(void)
 {
-    if ((heap_listp = mem_sbrk(3 * SIZE_T_SIZE)) == (void *)-1)
+    if ((heap_listp = mem_sbrk(FREE_LISTS * PTR_SIZE + 3 * SIZE_T_SIZE)) == (void *)-1)
     {
         return -1;
     }
 
+    int i;
+    free_lists = heap_listp;
+    for (i = 0; i < FREE_LISTS; i++)
+    {
+        free_lists[i] = NULL;
+    }
+
+    free_tree = NULL;
+
+    heap_listp += FREE_LISTS * PTR_SIZE;
     PUT(heap_listp, PACK_HDR(2 * SIZE_T_SIZE, 1, 1));
     heap_listp += SIZE_T_SIZE;
     PUT(HDRP(NEXT_BLKP(heap_listp)), PACK_HDR(0, 1, 1));
-    free_list_head = NULL;
 #ifdef DEBUG
     mm_check_heap("mm_init");
 #endif
@@ -97,7 +150,7 @@ int mm_init(void)
 }
 
 /*
- * mm_malloc - Allocate a block by searching through the explicit free list,
+ * mm_malloc - Allocate a block by searching through the segregated free lists,
  requesting additional heap memory if no block was found.
  */
 void *mm_malloc(size_t size)
@@ -112,7 +165,7 @@ void *mm_malloc(size_t size)
         mm_init();
     }
 
-    int asize = MAX(ALIGN(size + SIZE_T_SIZE), 2 * PTR_SIZE + 2 * SIZE_T_SIZE);
+    int asize = MAX(ALIGN(size + SIZE_T_SIZE), MIN_BLOCK_SIZE);
     void *bp;
     if ((bp = find_fit(asize)) != NULL)
     {
@@ -179,7 +232,7 @@ void *mm_realloc(void *bp, size_t size)
         return NULL;
     }
 
-    size_t asize = MAX(ALIGN(size + SIZE_T_SIZE), 2 * PTR_SIZE + 2 * SIZE_T_SIZE);
+    size_t asize = MAX(ALIGN(size + SIZE_T_SIZE), MIN_BLOCK_SIZE);
     size_t csize = GET_SIZE(HDRP(bp));
     if (asize > csize)
     {
@@ -202,27 +255,94 @@ void *mm_realloc(void *bp, size_t size)
     return bp;
 }
 
+/*
+ * find_fit - Best fit in the list of the request size class, or the first
+ * larger class that has a block. Every block of a larger class fits, the best
+ * fit there keeps the remainder small. Large requests, and small ones no list
+ * can fit, take the best fit in the tree.
+ */
 static void *find_fit(size_t asize)
 {
-    void *bp;
-    for (bp = free_list_head; bp != NULL; bp = GETP(NEXT_FREEP(bp)))
+    if (asize >= TREE_MIN_SIZE)
+    {
+        return tree_fit(asize);
+    }
+
+    int class;
+    for (class = size_class(asize); class < FREE_LISTS; class++)
     {
-        if (asize <= GET_SIZE(HDRP(bp)))
+        void *bp;
+        void *best = NULL;
+        for (bp = free_lists[class]; bp != NULL; bp = GETP(NEXT_FREEP(bp)))
         {
-            return bp;
+            size_t size = GET_SIZE(HDRP(bp));
+            if (asize <= size && (best == NULL || size < GET_SIZE(HDRP(best))))
+            {
+                best = bp;
+                if (size == asize)
+                {
+                    break;
+                }
+            }
+        }
+
+        if (best != NULL)
+        {
+            return best;
         }
     }
 
-    return NULL;
+    return tree_fit(asize);
+}
+
+/*
+ * tree_fit - Smallest block of the tree of at least asize bytes, the lowest
+ * one of them if there are several
+ */
+static void *tree_fit(size_t asize)
+{
+    void *bp = free_tree;
+    void *best = NULL;
+    while (bp != NULL)
+    {
+        if (GET_SIZE(HDRP(bp)) >= asize)
+        {
+            best = bp;
+            bp = GETP(CHILDP(bp, LEFT));
+        }
+        else
+        {
+            bp = GETP(CHILDP(bp, RIGHT));
+        }
+    }
+
+    return best;
+}
+
+/*
+ * size_class - Index of the highest set bit of the size in MIN_BLOCK_SIZE units
+ */
+static int size_class(size_t size)
+{
+    int class = (int)(8 * sizeof(unsigned long) - 1) - __builtin_clzl((size / MIN_BLOCK_SIZE) | 1);
+    return class < FREE_LISTS ? class : FREE_LISTS - 1;
 }
 
 static void place(void *bp, size_t asize)
 {
     size_t csize = GET_SIZE(HDRP(bp));
-    if (csize >= asize + 2 * SIZE_T_SIZE + 2 * PTR_SIZE)
+    /* A large remainder can usually stay in the tree where bp was */
+    if (csize >= asize + TREE_MIN_SIZE && tree_replace(bp, (char *)bp + asize, csize - asize))
+    {
+        PUT(HDRP(bp), PACK_HDR(asize, 1, 1));
+        return;
+    }
+
+    /* Unlinked while the header still tells its size class */
+    remove_from_free_list(bp);
+    if (csize >= asize + MIN_BLOCK_SIZE)
     {
         PUT(HDRP(bp), PACK_HDR(asize, 1, 1));
-        remove_from_free_list(bp);
         bp = NEXT_BLKP(bp);
         PUT(HDRP(bp), PACK_HDR(csize - asize, 1, 0));
         PUT(FTRP(bp), PACK_FTR(csize - asize));
@@ -232,7 +352,6 @@ static void place(void *bp, size_t asize)
     {
         PUT(HDRP(bp), PACK_HDR(csize, 1, 1));
         SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
-        remove_from_free_list(bp);
     }
 }
 
@@ -254,14 +373,24 @@ static void *extend_heap(size_t size)
 
 static void add_to_free_list(void *bp)
 {
+    if (GET_SIZE(HDRP(bp)) >= TREE_MIN_SIZE)
+    {
+        tree_insert(bp);
+#ifdef DEBUG
+        check_free(bp, "add_to_free_list");
+#endif
+        return;
+    }
+
+    void **head = &free_lists[size_class(GET_SIZE(HDRP(bp)))];
     SETP(PREV_FREEP(bp), NULL);
-    SETP(NEXT_FREEP(bp), free_list_head);
-    if (free_list_head != NULL)
+    SETP(NEXT_FREEP(bp), *head);
+    if (*head != NULL)
     {
-        SETP(PREV_FREEP(free_list_head), bp);
+        SETP(PREV_FREEP(*head), bp);
     }
 
-    free_list_head = bp;
+    *head = bp;
 #ifdef DEBUG
     check_free(bp, "add_to_free_list");
 #endif
@@ -269,6 +398,15 @@ static void add_to_free_list(void *bp)
 
 static void remove_from_free_list(void *bp)
 {
+    if (GET_SIZE(HDRP(bp)) >= TREE_MIN_SIZE)
+    {
+        tree_remove(bp);
+#ifdef DEBUG
+        check_placed(bp, "remove_from_free_list");
+#endif
+        return;
+    }
+
     void *prev = GETP(PREV_FREEP(bp));
     void *next = GETP(NEXT_FREEP(bp));
     if (prev != NULL)
@@ -277,7 +415,7 @@ static void remove_from_free_list(void *bp)
     }
     else
     {
-        free_list_head = next;
+        free_lists[size_class(GET_SIZE(HDRP(bp)))] = next;
     }
 
     if (next != NULL)
@@ -289,38 +427,332 @@ static void remove_from_free_list(void *bp)
 #endif
 }
 
+/*
+ * tree_less - Order of the tree, by size then by address
+ */
+static int tree_less(void *a, void *b)
+{
+    return key_less(GET_SIZE(HDRP(a)), a, GET_SIZE(HDRP(b)), b);
+}
+
+static int key_less(size_t a_size, void *a, size_t b_size, void *b)
+{
+    return a_size < b_size || (a_size == b_size && (char *)a < (char *)b);
+}
+
+static void tree_insert(void *bp)
+{
+    void *parent = NULL;
+    char *link = (char *)&free_tree;
+    while (GETP(link) != NULL)
+    {
+        parent = GETP(link);
+        link = CHILDP(parent, tree_less(bp, parent) ? LEFT : RIGHT);
+    }
+
+    SETP(link, bp);
+    SETP(CHILDP(bp, LEFT), NULL);
+    SETP(CHILDP(bp, RIGHT), NULL);
+    SETP(PARENTP(bp), parent);
+    PUT(COLORP(bp), RED);
+    insert_fixup(bp);
+}
+
+/*
+ * insert_fixup - Recoloring and rotating up from a new red block until no
+ * red block has a red parent
+ */
+static void insert_fixup(void *bp)
+{
+    void *parent;
+    while (IS_RED(parent = GETP(PARENTP(bp))))
+    {
+        /* A red parent is never the root, the grandparent exists */
+        void *grandparent = GETP(PARENTP(parent));
+        int dir = parent == GETP(CHILDP(grandparent, LEFT)) ? RIGHT : LEFT;
+        void *uncle = GETP(CHILDP(grandparent, dir));
+        if (IS_RED(uncle))
+        {
+            PUT(COLORP(parent), BLACK);
+            PUT(COLORP(uncle), BLACK);
+            PUT(COLORP(grandparent), RED);
+            bp = grandparent;
+            continue;
+        }
+
+        if (bp == GETP(CHILDP(parent, dir)))
+        {
+            bp = parent;
+            rotate(bp, !dir);
+            parent = GETP(PARENTP(bp));
+        }
+
+        PUT(COLORP(parent), BLACK);
+        PUT(COLORP(grandparent), RED);
+        rotate(grandparent, dir);
+    }
+
+    PUT(COLORP(free_tree), BLACK);
+}
+
+static void tree_remove(void *bp)
+{
+    void *left = GETP(CHILDP(bp, LEFT));
+    void *right = GETP(CHILDP(bp, RIGHT));
+    void *child;
+    void *parent;
+    size_t color = GET(COLORP(bp));
+    if (left == NULL || right == NULL)
+    {
+        child = left != NULL ? left : right;
+        parent = GETP(PARENTP(bp));
+        replace_child(parent, bp, child);
+        if (child != NULL)
+        {
+            SETP(PARENTP(child), parent);
+        }
+    }
+    else
+    {
+        /* The successor, which has no left child, takes the place of bp */
+        void *next = right;
+        while (GETP(CHILDP(next, LEFT)) != NULL)
+        {
+            next = GETP(CHILDP(next, LEFT));
+        }
+
+        color = GET(COLORP(next));
+        child = GETP(CHILDP(next, RIGHT));
+        if (next == right)
+        {
+            parent = next;
+        }
+        else
+        {
+            parent = GETP(PARENTP(next));
+            SETP(CHILDP(parent, LEFT), child);
+            if (child != NULL)
+            {
+                SETP(PARENTP(child), parent);
+            }
+
+            SETP(CHILDP(next, RIGHT), right);
+            SETP(PARENTP(right), next);
+        }
+
+        replace_child(GETP(PARENTP(bp)), bp, next);
+        SETP(PARENTP(next), GETP(PARENTP(bp)));
+        SETP(CHILDP(next, LEFT), left);
+        SETP(PARENTP(left), next);
+        PUT(COLORP(next), GET(COLORP(bp)));
+    }
+
+    if (color == BLACK)
+    {
+        remove_fixup(child, parent);
+    }
+}
+
+/*
+ * remove_fixup - Restoring the black height after a black block left the
+ * tree. bp, which can be NULL, is short of one black block on the path from
+ * parent.
+ */
+static void remove_fixup(void *bp, void *parent)
+{
+    while (bp != free_tree && !IS_RED(bp))
+    {
+        int dir = bp == GETP(CHILDP(parent, LEFT)) ? RIGHT : LEFT;
+        void *sibling = GETP(CHILDP(parent, dir));
+        if (IS_RED(sibling))
+        {
+            PUT(COLORP(sibling), BLACK);
+            PUT(COLORP(parent), RED);
+            rotate(parent, !dir);
+            sibling = GETP(CHILDP(parent, dir));
+        }
+
+        if (!IS_RED(GETP(CHILDP(sibling, LEFT))) && !IS_RED(GETP(CHILDP(sibling, RIGHT))))
+        {
+            PUT(COLORP(sibling), RED);
+            bp = parent;
+            parent = GETP(PARENTP(bp));
+            continue;
+        }
+
+        if (!IS_RED(GETP(CHILDP(sibling, dir))))
+        {
+            PUT(COLORP(GETP(CHILDP(sibling, !dir))), BLACK);
+            PUT(COLORP(sibling), RED);
+            rotate(sibling, dir);
+            sibling = GETP(CHILDP(parent, dir));
+        }
+
+        PUT(COLORP(sibling), GET(COLORP(parent)));
+        PUT(COLORP(parent), BLACK);
+        PUT(COLORP(GETP(CHILDP(sibling, dir))), BLACK);
+        rotate(parent, !dir);
+        bp = free_tree;
+    }
+
+    if (bp != NULL)
+    {
+        PUT(COLORP(bp), BLACK);
+    }
+}
+
+/*
+ * rotate - Moving bp down to the dir side of its child on the other side
+ */
+static void rotate(void *bp, int dir)
+{
+    void *child = GETP(CHILDP(bp, !dir));
+    void *inner = GETP(CHILDP(child, dir));
+    SETP(CHILDP(bp, !dir), inner);
+    if (inner != NULL)
+    {
+        SETP(PARENTP(inner), bp);
+    }
+
+    SETP(PARENTP(child), GETP(PARENTP(bp)));
+    replace_child(GETP(PARENTP(bp)), bp, child);
+    SETP(CHILDP(child, dir), bp);
+    SETP(PARENTP(bp), child);
+}
+
+static void replace_child(void *parent, void *old, void *new)
+{
+    if (parent == NULL)
+    {
+        free_tree = new;
+    }
+    else if (GETP(CHILDP(parent, LEFT)) == old)
+    {
+        SETP(CHILDP(parent, LEFT), new);
+    }
+    else
+    {
+        SETP(CHILDP(parent, RIGHT), new);
+    }
+}
+
+/*
+ * tree_replace - The free block bp of size bytes, which covers the tree block
+ * old, takes the place of old in the tree without rebalancing, if it sorts
+ * there. Returns 0 and leaves the heap alone otherwise.
+ */
+static int tree_replace(void *old, void *bp, size_t size)
+{
+    void *prev = tree_step(old, LEFT);
+    void *next = tree_step(old, RIGHT);
+    if ((prev != NULL && !key_less(GET_SIZE(HDRP(prev)), prev, size, bp)) ||
+        (next != NULL && !key_less(size, bp, GET_SIZE(HDRP(next)), next)))
+    {
+        return 0;
+    }
+
+    /* The links are read first, the new header can overwrite them */
+    void *left = GETP(CHILDP(old, LEFT));
+    void *right = GETP(CHILDP(old, RIGHT));
+    void *parent = GETP(PARENTP(old));
+    size_t color = GET(COLORP(old));
+    PUT(HDRP(bp), PACK_HDR(size, 1, 0));
+    PUT(FTRP(bp), PACK_FTR(size));
+    SETP(CHILDP(bp, LEFT), left);
+    SETP(CHILDP(bp, RIGHT), right);
+    SETP(PARENTP(bp), parent);
+    PUT(COLORP(bp), color);
+    replace_child(parent, old, bp);
+    if (left != NULL)
+    {
+        SETP(PARENTP(left), bp);
+    }
+
+    if (right != NULL)
+    {
+        SETP(PARENTP(right), bp);
+    }
+#ifdef DEBUG
+    check_free(bp, "tree_replace");
+#endif
+
+    return 1;
+}
+
+/*
+ * tree_step - Next block of the tree after bp in the dir direction
+ */
+static void *tree_step(void *bp, int dir)
+{
+    void *next = GETP(CHILDP(bp, dir));
+    if (next != NULL)
+    {
+        while (GETP(CHILDP(next, !dir)) != NULL)
+        {
+            next = GETP(CHILDP(next, !dir));
+        }
+
+        return next;
+    }
+
+    while ((next = GETP(PARENTP(bp))) != NULL && GETP(CHILDP(next, dir)) == bp)
+    {
+        bp = next;
+    }
+
+    return next;
+}
+
 static void *coalesce(void *bp)
 {
-    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
-    size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(bp)));
+    void *prev = GET_PREV_ALLOC(HDRP(bp)) ? NULL : PREV_BLKP(bp);
+    void *next = GET_ALLOC(HDRP(NEXT_BLKP(bp))) ? NULL : NEXT_BLKP(bp);
     size_t size = GET_SIZE(HDRP(bp));
-    if (prev_alloc && !next_alloc)
+    if (prev != NULL)
+    {
+        size += GET_SIZE(HDRP(prev));
+        bp = prev;
+    }
+
+    if (next != NULL)
+    {
+        size += GET_SIZE(HDRP(next));
+    }
+
+    /* A neighbor in the tree is unlinked last, the merged block may only
+     * have to take its place */
+    void *kept = NULL;
+    if (prev != NULL && GET_SIZE(HDRP(prev)) >= TREE_MIN_SIZE)
+    {
+        kept = prev;
+    }
+    else if (next != NULL && GET_SIZE(HDRP(next)) >= TREE_MIN_SIZE)
+    {
+        kept = next;
+    }
+
+    if (prev != NULL && prev != kept)
     {
-        remove_from_free_list(NEXT_BLKP(bp));
-        size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-        PUT(HDRP(bp), PACK_HDR(size, 1, 0));
-        PUT(FTRP(bp), PACK_FTR(size));
+        remove_from_free_list(prev);
     }
-    else if (!prev_alloc && next_alloc)
+
+    if (next != NULL && next != kept)
     {
-        remove_from_free_list(PREV_BLKP(bp));
-        size += GET_SIZE(HDRP(PREV_BLKP(bp)));
-        PUT(FTRP(bp), PACK_FTR(size));
-        PUT(HDRP(PREV_BLKP(bp)), PACK_HDR(size, 1, 0));
-        bp = PREV_BLKP(bp);
+        remove_from_free_list(next);
     }
-    else if (!prev_alloc && !next_alloc)
+
+    if (kept != NULL)
     {
-        remove_from_free_list(PREV_BLKP(bp));
-        remove_from_free_list(NEXT_BLKP(bp));
-        size += GET_SIZE(HDRP(PREV_BLKP(bp))) +
-                GET_SIZE(HDRP(NEXT_BLKP(bp)));
-        PUT(HDRP(PREV_BLKP(bp)), PACK_HDR(size, 1, 0));
-        PUT(FTRP(NEXT_BLKP(bp)), PACK_FTR(size));
+        if (tree_replace(kept, bp, size))
+        {
+            return bp;
+        }
 
-        bp = PREV_BLKP(bp);
+        remove_from_free_list(kept);
     }
 
+    PUT(HDRP(bp), PACK_HDR(size, 1, 0));
+    PUT(FTRP(bp), PACK_FTR(size));
     add_to_free_list(bp);
 
     return bp;
@@ -344,27 +776,125 @@ static void mm_check_heap(char *caller_name)
     {
         printf("Error %s: Bad epilogue header\n", caller_name);
     }
+
+    /* Every free block is in a list or in the tree */
+    int free_blocks = 0;
+    int indexed = 0;
+    for (bp = heap_listp; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp))
+    {
+        free_blocks += !GET_ALLOC(HDRP(bp));
+    }
+
+    int class;
+    for (class = 0; class < FREE_LISTS; class++)
+    {
+        for (bp = free_lists[class]; bp != NULL; bp = GETP(NEXT_FREEP(bp)))
+        {
+            indexed++;
+        }
+    }
+
+    if (free_tree != NULL && (IS_RED(free_tree) || GETP(PARENTP(free_tree)) != NULL))
+    {
+        printf("Error %s: Bad tree root\n", caller_name);
+    }
+
+    check_tree(free_tree, NULL, NULL, &indexed, caller_name);
+    if (indexed != free_blocks)
+    {
+        printf("Error %s: %d free blocks, %d in the lists and the tree\n", caller_name, free_blocks,
+               indexed);
+    }
+}
+
+/*
+ * check_tree - Checking the subtree of bp, whose blocks must all be ordered
+ * between low and high when they are given. Returns its black height.
+ */
+static int check_tree(void *bp, void *low, void *high, int *count, char *caller_name)
+{
+    if (bp == NULL)
+    {
+        return 1;
+    }
+
+    (*count)++;
+    if (GET_ALLOC(HDRP(bp)) || GET_SIZE(HDRP(bp)) < TREE_MIN_SIZE)
+    {
+        printf("Error %s: allocated or small block in the tree\n", caller_name);
+    }
+
+    if ((low != NULL && !tree_less(low, bp)) || (high != NULL && !tree_less(bp, high)))
+    {
+        printf("Error %s: tree out of order\n", caller_name);
+    }
+
+    void *left = GETP(CHILDP(bp, LEFT));
+    void *right = GETP(CHILDP(bp, RIGHT));
+    if ((left != NULL && GETP(PARENTP(left)) != bp) ||
+        (right != NULL && GETP(PARENTP(right)) != bp))
+    {
+        printf("Error %s: child does not point to its parent\n", caller_name);
+    }
+
+    if (IS_RED(bp) && (IS_RED(left) || IS_RED(right)))
+    {
+        printf("Error %s: red block with a red child\n", caller_name);
+    }
+
+    int left_height = check_tree(left, low, bp, count, caller_name);
+    int right_height = check_tree(right, bp, high, count, caller_name);
+    if (left_height != right_height)
+    {
+        printf("Error %s: black heights differ\n", caller_name);
+    }
+
+    return left_height + !IS_RED(bp);
+}
+
+/*
+ * in_tree - Whether bp is in the tree, found by its size and address
+ */
+static int in_tree(void *bp)
+{
+    void *node = free_tree;
+    while (node != NULL && node != bp)
+    {
+        node = GETP(CHILDP(node, tree_less(bp, node) ? LEFT : RIGHT));
+    }
+
+    return node != NULL;
 }
 
 static void check_free(void *freed, char *caller_name)
 {
     int free_found = 0;
+    int class;
     char *bp;
-    for (bp = free_list_head; bp != NULL; bp = GETP(NEXT_FREEP(bp)))
+    for (class = 0; class < FREE_LISTS; class++)
     {
-        if (!GET_ALLOC(HDRP(bp)))
+        for (bp = free_lists[class]; bp != NULL; bp = GETP(NEXT_FREEP(bp)))
         {
-            if (bp == freed)
+            if (!GET_ALLOC(HDRP(bp)))
             {
-                free_found += 1;
+                if (bp == freed)
+                {
+                    free_found += 1;
+                }
+            }
+            else
+            {
+                printf("Error %s: allocated in free list\n", caller_name);
+            }
+
+            if (size_class(GET_SIZE(HDRP(bp))) != class)
+            {
+                printf("Error %s: free block in the wrong size class\n", caller_name);
             }
-        }
-        else
-        {
-            printf("Error %s: allocated in free list\n", caller_name);
         }
     }
 
+    free_found += in_tree(freed);
     if (free_found != 1)
     {
         printf("Error %s: freed block not added to free list\n", caller_name);
@@ -374,22 +904,27 @@ static void check_free(void *freed, char *caller_name)
 static void check_placed(void *placed, char *caller_name)
 {
     int placed_found = 0;
+    int class;
     char *bp;
-    for (bp = free_list_head; bp != NULL; bp = GETP(NEXT_FREEP(bp)))
+    for (class = 0; class < FREE_LISTS; class++)
     {
-        if (!GET_ALLOC(HDRP(bp)))
+        for (bp = free_lists[class]; bp != NULL; bp = GETP(NEXT_FREEP(bp)))
         {
-            if (bp == placed)
+            if (!GET_ALLOC(HDRP(bp)))
             {
-                placed_found += 1;
+                if (bp == placed)
+                {
+                    placed_found += 1;
+                }
+            }
+            else
+            {
+                printf("Error %s: allocated in free list\n", caller_name);
             }
-        }
-        else
-        {
-            printf("Error %s: allocated in free list\n", caller_name);
         }
     }
 
+    placed_found += in_tree(placed);
     if (placed_found != 0)
     {
         printf("Error %s: placed block in free list\n", caller_name);
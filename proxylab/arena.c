@@ -0,0 +1,147 @@
+#include "arena.h"
+
+#define CHUNK_SIZE(class) ((size_t)1 << (ARENA_MIN_SHIFT + (class)))
+/* Class of the chunk covering the whole arena */
+#define TOP_CLASS(arena) ((arena)->shift - ARENA_MIN_SHIFT)
+/* Index of the 64 B unit a chunk starts at */
+#define UNIT(arena, ptr) ((size_t)((char *)(ptr) - (arena)->base) >> ARENA_MIN_SHIFT)
+#define UNIT_PTR(arena, unit) ((arena)->base + ((unit) << ARENA_MIN_SHIFT))
+/* Free bit of the chunk state, the low bits hold the class */
+#define CHUNK_FREE 0x80
+
+static int size_class(Arena *arena, size_t size);
+static void push_chunk(Arena *arena, void *ptr, int class);
+static void unlink_chunk(Arena *arena, void *ptr, int class);
+
+int arena_init(Arena *arena, int shift)
+{
+    if (shift < ARENA_MIN_SHIFT || shift > ARENA_MAX_SHIFT)
+        return -1;
+
+    size_t size = (size_t)1 << shift;
+    if ((arena->base = Malloc(size)) == NULL)
+        return -1;
+
+    if ((arena->state = Calloc(size >> ARENA_MIN_SHIFT, 1)) == NULL)
+    {
+        free(arena->base);
+        return -1;
+    }
+
+    arena->shift = shift;
+    memset(arena->free_lists, 0, sizeof(arena->free_lists));
+    if (Sem_init(&arena->lock, 0, 1) < 0)
+    {
+        arena_free_all(arena);
+        return -1;
+    }
+
+    /* The whole region starts as one free chunk */
+    push_chunk(arena, arena->base, TOP_CLASS(arena));
+    return 0;
+}
+
+/* Releasing the region, all the chunks must be freed already */
+void arena_free_all(Arena *arena)
+{
+    free(arena->state);
+    free(arena->base);
+    arena->state = NULL;
+    arena->base = NULL;
+}
+
+/* Returns a chunk of at least size bytes or NULL
+ * if there is no free chunk large enough */
+void *arena_alloc(Arena *arena, size_t size)
+{
+    int class;
+    if ((class = size_class(arena, size)) < 0)
+        return NULL;
+
+    if (Sem_wait(&arena->lock) < 0)
+        return NULL;
+
+    /* Taking the smallest free chunk that fits */
+    int current = class;
+    while (current <= TOP_CLASS(arena) && arena->free_lists[current] == NULL)
+        current++;
+
+    if (current > TOP_CLASS(arena))
+    {
+        Sem_post(&arena->lock);
+        return NULL;
+    }
+
+    char *chunk = (char *)arena->free_lists[current];
+    unlink_chunk(arena, chunk, current);
+    /* Splitting it, the upper halves go to the free lists */
+    while (current > class)
+    {
+        current--;
+        push_chunk(arena, chunk + CHUNK_SIZE(current), current);
+    }
+
+    arena->state[UNIT(arena, chunk)] = class;
+    Sem_post(&arena->lock);
+    return chunk;
+}
+
+/* Returning a chunk, merging it with its free buddies */
+void arena_free(Arena *arena, void *ptr)
+{
+    Sem_wait(&arena->lock);
+    size_t unit = UNIT(arena, ptr);
+    int class = arena->state[unit];
+    while (class < TOP_CLASS(arena))
+    {
+        size_t buddy = unit ^ ((size_t)1 << class);
+        if (arena->state[buddy] != (class | CHUNK_FREE))
+            break;
+
+        unlink_chunk(arena, UNIT_PTR(arena, buddy), class);
+        unit &= ~((size_t)1 << class);
+        class++;
+    }
+
+    push_chunk(arena, UNIT_PTR(arena, unit), class);
+    Sem_post(&arena->lock);
+}
+
+/* Index of the smallest class fitting size bytes, -1 if it is too large */
+static int size_class(Arena *arena, size_t size)
+{
+    int class = 0;
+    while (CHUNK_SIZE(class) < size)
+        if (++class > TOP_CLASS(arena))
+            return -1;
+
+    return class;
+}
+
+/* Marking a chunk free and pushing it to the free list of its class */
+static void push_chunk(Arena *arena, void *ptr, int class)
+{
+    ArenaChunk *chunk = ptr;
+    chunk->prev = NULL;
+    chunk->next = arena->free_lists[class];
+    if (chunk->next != NULL)
+        chunk->next->prev = chunk;
+
+    arena->free_lists[class] = chunk;
+    arena->state[UNIT(arena, chunk)] = class | CHUNK_FREE;
+}
+
+/* Removing a free chunk from the free list of its class */
+static void unlink_chunk(Arena *arena, void *ptr, int class)
+{
+    ArenaChunk *chunk = ptr;
+    if (chunk->prev != NULL)
+        chunk->prev->next = chunk->next;
+    else
+        arena->free_lists[class] = chunk->next;
+
+    if (chunk->next != NULL)
+        chunk->next->prev = chunk->prev;
+
+    arena->state[UNIT(arena, chunk)] = class;
+}
@@ -0,0 +1,34 @@
+#include "csapp.h"
+
+/* Chunk size classes: powers of two from 64 B up to the whole arena */
+#define ARENA_MIN_SHIFT 6
+#define ARENA_MAX_SHIFT 24
+#define ARENA_CLASSES (ARENA_MAX_SHIFT - ARENA_MIN_SHIFT + 1)
+
+typedef struct arena Arena;
+typedef struct chunk ArenaChunk;
+
+/* A preallocated power of two region managed as a buddy system.
+ * Every size class has a free list. A chunk is split in halves
+ * when its class is empty, and a freed chunk is merged back with
+ * its buddy whenever the buddy is free too. */
+struct arena
+{
+    char *base;
+    int shift;
+    unsigned char *state; /* Class and free bit of the chunk starting at every 64 B */
+    ArenaChunk *free_lists[ARENA_CLASSES];
+    sem_t lock;
+};
+
+/* Free list links, kept inside the free chunks */
+struct chunk
+{
+    ArenaChunk *prev;
+    ArenaChunk *next;
+};
+
+int arena_init(Arena *arena, int shift);
+void arena_free_all(Arena *arena);
+void *arena_alloc(Arena *arena, size_t size);
+void arena_free(Arena *arena, void *ptr);
\ No newline at end of file
@@ -0,0 +1,307 @@
+/*
+ * cache-bench.c - Microbenchmark for the proxy cache.
+ *     Starts with a sustained eviction workload of objects of mixed sizes
+ *     and reports the insert latency and the resident set size. Then fills
+ *     the cache up to MAX_CACHE_SIZE with small objects and measures
+ *     the average cost of hit and miss lookups. Finally replays a Zipfian
+ *     get-or-add trace with every eviction policy from 1 up to
+ *     <max threads> threads and reports the throughput and the hit rate.
+ *     With -m the entries are allocated with malloc instead of the arenas.
+ *
+ *     usage: ./cache-bench [-m] [-s <object size>] [-n <lookups>] [-t <max threads>]
+ *                          [-a <zipf alpha>] [-k <keys per resident object>]
+ */
+#include <getopt.h>
+#include "cache.h"
+
+#define DEFAULT_OBJECT_SIZE 64
+#define DEFAULT_LOOKUPS 1000000
+#define DEFAULT_MAX_THREADS 32
+#define DEFAULT_ALPHA 0.9
+#define DEFAULT_KEYS_FACTOR 4
+#define MIN_CHURN_SIZE 512
+#define KEY_POOL 65536
+#define KEY_LEN 64
+
+/* Per-thread state of the multi-threaded workload */
+typedef struct worker
+{
+    pthread_t tid;
+    const int *trace;
+    long ops;
+    long hits;
+} Worker;
+
+static Cache cache;
+static char *payload;
+static size_t object_size = DEFAULT_OBJECT_SIZE;
+/* Extra cache_init flags */
+static int cache_flags = 0;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void make_key(char *key, int id)
+{
+    sprintf(key, "localhost80/objects/%d.html", id);
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr, "usage: %s [-m] [-s <object size>] [-n <lookups>] [-t <max threads>] "
+                    "[-a <zipf alpha>] [-k <keys per resident object>]\n",
+            name);
+    exit(1);
+}
+
+/* Returns average ns per cache_get over the given key pool */
+static double time_lookups(char (*keys)[KEY_LEN], long lookups)
+{
+    CacheNode *item;
+    long n;
+    double start = now_ns();
+    for (n = 0; n < lookups; n++)
+        if (cache_get(&cache, keys[n % KEY_POOL], &item) > 0)
+            cache_release(item);
+
+    return (now_ns() - start) / lookups;
+}
+
+/* Resident set size of the process in KB */
+static long rss_kb(void)
+{
+    long pages = 0;
+    FILE *statm;
+    if ((statm = fopen("/proc/self/statm", "r")) != NULL)
+    {
+        if (fscanf(statm, "%*d %ld", &pages) != 1)
+            pages = 0;
+
+        fclose(statm);
+    }
+
+    return pages * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Sustained eviction workload: nearly every insert is a new key, with a
+ * log-uniform size between MIN_CHURN_SIZE and MAX_OBJECT_SIZE */
+static void run_churn(long inserts)
+{
+    if (cache_init(&cache, CACHE_LRU | cache_flags) < 0)
+        exit(1);
+
+    char *buf = Malloc(MAX_OBJECT_SIZE);
+    memset(buf, 'x', MAX_OBJECT_SIZE);
+    char (*keys)[KEY_LEN] = Malloc(KEY_POOL * KEY_LEN);
+    size_t *sizes = Malloc(KEY_POOL * sizeof(size_t));
+    unsigned int seed = 1;
+    int i;
+    for (i = 0; i < KEY_POOL; i++)
+    {
+        make_key(keys[i], i);
+        double u = (double)rand_r(&seed) / RAND_MAX;
+        sizes[i] = MIN_CHURN_SIZE * pow((double)MAX_OBJECT_SIZE / MIN_CHURN_SIZE, u);
+    }
+
+    long n;
+    double start = now_ns();
+    for (n = 0; n < inserts; n++)
+    {
+        i = rand_r(&seed) % KEY_POOL;
+        cache_add(&cache, keys[i], NULL, buf, sizes[i]);
+    }
+
+    double elapsed = now_ns() - start;
+    printf("Churn inserts: %8.1f ns/op, RSS %ld KB (%s)\n", elapsed / inserts, rss_kb(),
+           cache_flags & CACHE_MALLOC ? "malloc" : "arena");
+    free(sizes);
+    free(keys);
+    free(buf);
+    cache_free(&cache);
+}
+
+/* Generates a trace of key ids in [0, nkeys) where the probability
+ * of the id i is proportional to 1 / (i + 1)^alpha */
+static int *make_zipf_trace(long length, int nkeys, double alpha)
+{
+    double *cdf = Malloc(nkeys * sizeof(double));
+    double sum = 0;
+    int i;
+    for (i = 0; i < nkeys; i++)
+    {
+        sum += 1.0 / pow(i + 1, alpha);
+        cdf[i] = sum;
+    }
+
+    int *trace = Malloc(length * sizeof(int));
+    unsigned int seed = 1;
+    long n;
+    for (n = 0; n < length; n++)
+    {
+        /* Binary search of the first id with cdf >= u */
+        double u = (double)rand_r(&seed) / RAND_MAX * sum;
+        int lo = 0, hi = nkeys - 1;
+        while (lo < hi)
+        {
+            int mid = (lo + hi) / 2;
+            if (cdf[mid] < u)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        trace[n] = lo;
+    }
+
+    free(cdf);
+    return trace;
+}
+
+/* Proxy-like workload: a miss fetches the object and adds it to the cache */
+static void *worker_thread(void *vargp)
+{
+    Worker *worker = vargp;
+    char key[KEY_LEN];
+    CacheNode *item;
+    long n;
+    for (n = 0; n < worker->ops; n++)
+    {
+        make_key(key, worker->trace[n]);
+        if (cache_get(&cache, key, &item) > 0)
+        {
+            cache_release(item);
+            worker->hits++;
+        }
+        else
+            cache_add(&cache, key, NULL, payload, object_size);
+    }
+
+    return NULL;
+}
+
+/* Replays the trace on a cold cache, every thread takes an equal slice */
+static void run_workers(int policy, int nthreads, const int *trace, long length)
+{
+    if (cache_init(&cache, policy | cache_flags) < 0)
+        exit(1);
+
+    Worker *workers = Calloc(nthreads, sizeof(Worker));
+    double start = now_ns();
+    int i;
+    for (i = 0; i < nthreads; i++)
+    {
+        workers[i].ops = length / nthreads;
+        workers[i].trace = trace + i * workers[i].ops;
+        Pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i]);
+    }
+
+    long done = 0, hits = 0;
+    for (i = 0; i < nthreads; i++)
+    {
+        Pthread_join(workers[i].tid, NULL);
+        done += workers[i].ops;
+        hits += workers[i].hits;
+    }
+
+    double elapsed = now_ns() - start;
+    printf("%-6s %7d %14.0f %9.1f%%\n", policy == CACHE_CLOCK ? "clock" : "lru",
+           nthreads, done / elapsed * 1e9, 100.0 * hits / done);
+    free(workers);
+    cache_free(&cache);
+}
+
+int main(int argc, char **argv)
+{
+    long lookups = DEFAULT_LOOKUPS;
+    int max_threads = DEFAULT_MAX_THREADS;
+    double alpha = DEFAULT_ALPHA;
+    int keys_factor = DEFAULT_KEYS_FACTOR;
+    int c;
+    while ((c = getopt(argc, argv, "ms:n:t:a:k:")) != -1)
+    {
+        switch (c)
+        {
+        case 'm':
+            cache_flags |= CACHE_MALLOC;
+            break;
+        case 's':
+            object_size = atol(optarg);
+            break;
+        case 'n':
+            lookups = atol(optarg);
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'a':
+            alpha = atof(optarg);
+            break;
+        case 'k':
+            keys_factor = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (object_size == 0 || object_size > MAX_OBJECT_SIZE || lookups <= 0 || keys_factor <= 0)
+        usage(argv[0]);
+
+    run_churn(lookups);
+
+    if (cache_init(&cache, CACHE_LRU | cache_flags) < 0)
+        exit(1);
+
+    /* Filling the cache up to MAX_CACHE_SIZE */
+    payload = Malloc(object_size);
+    memset(payload, 'x', object_size);
+    int nobjects = MAX_CACHE_SIZE / object_size;
+    char key[KEY_LEN];
+    int i;
+    for (i = 0; i < nobjects; i++)
+    {
+        make_key(key, i);
+        if (cache_add(&cache, key, NULL, payload, object_size) < 0)
+            exit(1);
+    }
+
+    printf("Resident objects: %d x %zu bytes\n", nobjects, object_size);
+
+    /* Pre-generating lookup keys so the timed loops only measure the cache */
+    char (*hit_keys)[KEY_LEN] = Malloc(KEY_POOL * KEY_LEN);
+    char (*miss_keys)[KEY_LEN] = Malloc(KEY_POOL * KEY_LEN);
+    unsigned int seed = 1;
+    for (i = 0; i < KEY_POOL; i++)
+    {
+        make_key(hit_keys[i], rand_r(&seed) % nobjects);
+        make_key(miss_keys[i], nobjects + rand_r(&seed) % nobjects);
+    }
+
+    printf("Hit lookups:  %8.1f ns/op\n", time_lookups(hit_keys, lookups));
+    printf("Miss lookups: %8.1f ns/op\n", time_lookups(miss_keys, lookups));
+    free(hit_keys);
+    free(miss_keys);
+    cache_free(&cache);
+
+    /* Get-or-add replay of a Zipfian trace over more keys than fit the cache */
+    int nkeys = nobjects * keys_factor;
+    int *trace = make_zipf_trace(lookups, nkeys, alpha);
+    printf("\nZipf(%.2f) trace over %d keys\n", alpha, nkeys);
+    printf("policy threads       ops/sec  hit rate\n");
+    int policies[] = {CACHE_LRU, CACHE_CLOCK};
+    int p;
+    for (p = 0; p < 2; p++)
+    {
+        int nthreads;
+        for (nthreads = 1; nthreads <= max_threads; nthreads *= 2)
+            run_workers(policies[p], nthreads, trace, lookups);
+    }
+
+    free(trace);
+    free(payload);
+    return 0;
+}
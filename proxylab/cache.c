@@ -1,197 +1,395 @@
 #include "cache.h"
+#include "hash.h"
+#include "metrics.h"
+
+/* Size of the single block holding an entry */
+#define BLOCK_SIZE(payload_size, key_size) (sizeof(CacheNode) + (payload_size) + (key_size))
+
+/* Shard of a hash value. The low bits pick the bucket inside the shard,
+ * so the shard comes from the high bits of a Fibonacci hash of it. FNV-1a
+ * alone leaves them the same for keys that only differ at the end. */
+#define SHARD(cache, hash) (&(cache)->shards[(((hash) * 2654435769u) >> 16) % CACHE_SHARDS])
+/* Index of the hash bucket for a given hash value */
+#define BUCKET(shard, hash) ((hash) & ((shard)->nbuckets - 1))
+
+#ifdef CACHE_QUIET
+#define cache_count(counter)
+#else
+#define cache_count(counter) metrics_add(counter, 1)
+#endif
+
+static CacheNode *find_item(CacheShard *shard, const char *key, unsigned int hash);
+static void insert_item(CacheShard *shard, CacheNode *item);
+static void remove_item(CacheShard *shard, CacheNode *item);
+static void grow_buckets(CacheShard *shard);
+static void evict_item(CacheShard *shard, CacheNode *item);
+static CacheNode *next_victim(Cache *cache, CacheShard *shard);
+static void append_lru(CacheShard *shard, CacheNode *item);
+static void remove_lru(CacheShard *shard, CacheNode *item);
+
+int cache_init(Cache *cache, int flags)
+{
+    cache->policy = flags & CACHE_CLOCK;
+    cache->use_arena = !(flags & CACHE_MALLOC);
+    cache->spill = NULL;
+    cache->spill_arg = NULL;
+    int i;
+    for (i = 0; i < CACHE_SHARDS; i++)
+    {
+        CacheShard *shard = &cache->shards[i];
+        shard->total_size = 0;
+        shard->count = 0;
+        shard->lru_head = NULL;
+        shard->lru_tail = NULL;
+        shard->nbuckets = CACHE_BUCKETS;
+        if ((shard->buckets = Calloc(shard->nbuckets, sizeof(CacheNode *))) == NULL)
+            return -1;
 
-/* Max size of a cacheable request */
-#define MAX_OBJECT_SIZE 102400
-#define MAX_CACHE_SIZE 1049000
+        if (pthread_rwlock_init(&shard->lock, NULL) != 0)
+            return -1;
 
-#define PAYLOAD(node_p) ((char *)node_p + sizeof(CacheNode))
-#define NODE_SIZE(payload_size) (sizeof(CacheNode) + payload_size)
+        if (cache->use_arena && arena_init(&shard->arena, SHARD_ARENA_SHIFT) < 0)
+            return -1;
+    }
 
-static void prepend_item(Cache *cache, CacheNode *item);
-static void remove_item(Cache *cache, CacheNode *item);
-static void append_lru(Cache *cache, LruNode *item);
-static void remove_lru(Cache *cache, LruNode *item);
+    return 0;
+}
 
-int cache_init(Cache *cache)
+/* Freeing all the entries, the cache must not be used afterwards
+ * and none of its entries may be pinned */
+void cache_free(Cache *cache)
 {
-    cache->total_size = 0;
-    cache->head = NULL;
-    if (Sem_init(&cache->readers_lock, 0, 1) < 0)
-        return -1;
+    int i;
+    for (i = 0; i < CACHE_SHARDS; i++)
+    {
+        CacheShard *shard = &cache->shards[i];
+        while (shard->lru_head != NULL)
+        {
+            CacheNode *item = shard->lru_head;
+            evict_item(shard, item);
+            cache_release(item);
+        }
 
-    if (Sem_init(&cache->writers_lock, 0, 1) < 0)
-        return -1;
+        free(shard->buckets);
+        pthread_rwlock_destroy(&shard->lock);
+        if (cache->use_arena)
+            arena_free_all(&shard->arena);
+    }
+}
 
-    return 0;
+/* Hands the entries evicted from now on to spill, e.g. a disk tier */
+void cache_set_spill(Cache *cache, CacheSpill spill, void *arg)
+{
+    cache->spill = spill;
+    cache->spill_arg = arg;
+}
+
+/* Adds an entry, replacing the one with the same key. An entry
+ * without meta never becomes stale. */
+int cache_add(Cache *cache, const char *key, const CacheMeta *meta, const void *buf, size_t length)
+{
+    struct iovec iov = {(void *)buf, length};
+    return cache_addv(cache, key, meta, &iov, 1);
 }
 
-int cache_add(Cache *cache, const char *key, const void *buf, size_t length)
+/* Same as cache_add, but the payload is gathered from several buffers */
+int cache_addv(Cache *cache, const char *key, const CacheMeta *meta, const struct iovec *iov, int iovcnt)
 {
+    size_t length = 0;
+    int i;
+    for (i = 0; i < iovcnt; i++)
+        length += iov[i].iov_len;
+
     if (length > MAX_OBJECT_SIZE)
         return 0;
 
-    /* Holding writers lock */
-    if (Sem_wait(&cache->writers_lock) < 0)
+    unsigned int hash = hash_string(key);
+    CacheShard *shard = SHARD(cache, hash);
+    size_t key_size = strlen(key) + 1;
+    size_t block_size = BLOCK_SIZE(length, key_size);
+    /* Allocating the entry block before taking the lock,
+     * from the shard arena if it still has a chunk for it */
+    CacheNode *new_item = NULL;
+    Arena *arena = NULL;
+    if (cache->use_arena && (new_item = arena_alloc(&shard->arena, block_size)) != NULL)
+        arena = &shard->arena;
+    else if ((new_item = Malloc(block_size)) == NULL)
         return -1;
 
-    /* LRU eviction */
-    while (cache->total_size + length > MAX_CACHE_SIZE)
+    /* Updating item fields */
+    new_item->key = CACHE_PAYLOAD(new_item) + length;
+    new_item->hash = hash;
+    new_item->refs = 1;
+    new_item->referenced = 0;
+    new_item->size = length;
+    new_item->arena = arena;
+    if (meta != NULL)
+        new_item->meta = *meta;
+    else
+    {
+        memset(&new_item->meta, 0, sizeof(CacheMeta));
+        new_item->meta.expires = LONG_MAX;
+    }
+
+    /* Copying the data and the key to the block */
+    char *payload = CACHE_PAYLOAD(new_item);
+    for (i = 0; i < iovcnt; i++)
     {
-        CacheNode *to_evict = cache->lru_head->item;
-        cache->total_size -= to_evict->size;
-        remove_item(cache, to_evict);
-        remove_lru(cache, to_evict->lru);
-        printf("Evicted fromt the cache: %s, freed %d bytes.\n", to_evict->key, (int)to_evict->size);
-        free(to_evict->lru);
-        free(to_evict);
+        memcpy(payload, iov[i].iov_base, iov[i].iov_len);
+        payload += iov[i].iov_len;
     }
 
-    /* Creating a new cache node */
-    CacheNode *new_item;
-    if ((new_item = Malloc(NODE_SIZE(length))) < 0)
-        return -1;
+    memcpy(new_item->key, key, key_size);
 
-    /* Creating a key copy */
-    char *key_copy;
-    if ((key_copy = Malloc(strlen(key) + 1)) < 0)
+    /* Holding the shard lock, the block goes back where it came from if that fails */
+    if (pthread_rwlock_wrlock(&shard->lock) != 0)
+    {
+        cache_release(new_item);
         return -1;
+    }
 
-    memcpy(key_copy, key, strlen(key) + 1);
-    /* Allocating a new lru node */
-    LruNode *new_lru;
-    if ((new_lru = Malloc(sizeof(LruNode))) < 0)
-        return -1;
+    /* Evicted entries are spilled after the lock is dropped,
+     * the replaced one only released */
+    CacheNode *evicted = NULL;
+    CacheNode *replaced;
+    /* Replacing an entry added by a concurrent miss on the same key */
+    if ((replaced = find_item(shard, key, hash)) != NULL)
+        evict_item(shard, replaced);
 
-    new_lru->item = new_item;
-    /* Updating item fields */
-    new_item->key = key_copy;
-    new_item->size = length;
-    new_item->lru = new_lru;
-    /* Copying data to the cache node */
-    void *data = PAYLOAD(new_item);
-    memcpy(data, buf, length);
-    /* Updating linked lists */
-    prepend_item(cache, new_item);
-    append_lru(cache, new_lru);
-    printf("Writen to the cache %s. %d bytes.\n", new_item->key, (int)new_item->size);
-    if (Sem_post(&cache->writers_lock) < 0)
+    /* Eviction within the shard budget */
+    while (shard->total_size + length > SHARD_SIZE)
+    {
+        CacheNode *to_evict = next_victim(cache, shard);
+        cache_count(METRIC_CACHE_EVICTIONS);
+        evict_item(shard, to_evict);
+        to_evict->next = evicted;
+        evicted = to_evict;
+    }
+
+    /* Updating the hash table and the LRU list */
+    insert_item(shard, new_item);
+    append_lru(shard, new_item);
+    cache_count(METRIC_CACHE_WRITES);
+    if (pthread_rwlock_unlock(&shard->lock) != 0)
         return -1;
-    
+
+    /* Dropping the cache references of the evicted entries, or handing
+     * them over to the spill */
+    if (replaced != NULL)
+        cache_release(replaced);
+
+    while (evicted != NULL)
+    {
+        CacheNode *next = evicted->next;
+        if (cache->spill != NULL)
+            cache->spill(cache->spill_arg, evicted);
+        else
+            cache_release(evicted);
+
+        evicted = next;
+    }
+
     return 0;
 }
 
-int cache_get(Cache *cache, const char *key, void **item, size_t *length)
+/* Looks up a key and pins the entry on a hit.
+ * The entry must be given back with cache_release. */
+int cache_get(Cache *cache, const char *key, CacheNode **item)
 {
     int is_cached = 0;
-    /* Aquiring writers lock if it is the first reader */
-    if (Sem_wait(&cache->readers_lock) < 0)
-        return -1;
-
-    cache->readers_count++;
-    if (cache->readers_count == 1)
-        if (Sem_wait(&cache->writers_lock) < 0)
-            return -1;
+    unsigned int hash = hash_string(key);
+    /* An LRU hit moves the node, so it needs the shard lock exclusively.
+     * A CLOCK hit only sets the reference bit and shares the lock. */
+    CacheShard *shard = SHARD(cache, hash);
+    int status;
+    if (cache->policy == CACHE_CLOCK)
+        status = pthread_rwlock_rdlock(&shard->lock);
+    else
+        status = pthread_rwlock_wrlock(&shard->lock);
 
-    if (Sem_post(&cache->readers_lock) < 0)
+    if (status != 0)
         return -1;
 
-    /* Key sequential lookup */
+    /* Key hash lookup */
     CacheNode *current;
-    for (current = cache->head; current != NULL; current = current->next)
+    if ((current = find_item(shard, key, hash)) != NULL)
     {
-        if (!strcmp(current->key, key))
+        if (cache->policy == CACHE_CLOCK)
         {
-            /* Moving the lru node to the end of the LRU list */
-            if (Sem_wait(&cache->readers_lock) < 0)
-                return -1;
-
-            remove_lru(cache, current->lru);
-            append_lru(cache, current->lru);
-            if (Sem_post(&cache->readers_lock) < 0)
-                return -1;
-
-            /* Copying the cached value */
-            if ((*item = Malloc(current->size)) < 0)
-                return -1;
-
-            memcpy(*item, PAYLOAD(current), current->size);
-            *length = current->size;
-            is_cached = 1;
-            break;
+            /* Sparing the entry from the next sweep of the hand */
+            if (!__atomic_load_n(&current->referenced, __ATOMIC_RELAXED))
+                __atomic_store_n(&current->referenced, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            /* Moving the entry to the end of the LRU list */
+            remove_lru(shard, current);
+            append_lru(shard, current);
         }
-    }
-
-    /* Releasing writers lock if it is the last reader */
-    if (Sem_wait(&cache->readers_lock) < 0)
-        return -1;
 
-    cache->readers_count--;
-    if (cache->readers_count == 0)
-        if (Sem_post(&cache->writers_lock) < 0)
-            return -1;
+        /* Pinning the entry for the reader */
+        __atomic_add_fetch(&current->refs, 1, __ATOMIC_RELAXED);
+        *item = current;
+        is_cached = 1;
+    }
 
-    if (Sem_post(&cache->readers_lock) < 0)
+    if (pthread_rwlock_unlock(&shard->lock) != 0)
         return -1;
 
     if (is_cached)
-        printf("Cache hit %s\n", key);
+        cache_count(METRIC_CACHE_HITS);
     else
-        printf("Cache miss %s\n", key);
+        cache_count(METRIC_CACHE_MISSES);
 
     return is_cached;
 }
 
-/* Appending an item to the end of the LRU linked list */
-static void append_lru(Cache *cache, LruNode *item)
+/* Dropping a reference to an entry, the last one frees it */
+void cache_release(CacheNode *item)
 {
-    item->next = NULL;
-    item->prev = cache->lru_tail;
-    if (cache->lru_tail != NULL)
-        cache->lru_tail->next = item;
+    if (__atomic_sub_fetch(&item->refs, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+
+    if (item->arena != NULL)
+        arena_free(item->arena, item);
     else
-        cache->lru_head = item;
+        free(item);
+}
 
-    cache->lru_tail = item;
+/* Number of entries and payload bytes in the cache, each shard is
+ * read under its lock but the sum is not a snapshot of the whole cache */
+void cache_usage(Cache *cache, size_t *count, size_t *bytes)
+{
+    *count = 0;
+    *bytes = 0;
+    int i;
+    for (i = 0; i < CACHE_SHARDS; i++)
+    {
+        CacheShard *shard = &cache->shards[i];
+        pthread_rwlock_rdlock(&shard->lock);
+        *count += shard->count;
+        *bytes += shard->total_size;
+        pthread_rwlock_unlock(&shard->lock);
+    }
 }
 
-/* Removing an item from the LRU linked list*/
-static void remove_lru(Cache *cache, LruNode *item)
+/* Looking up an item in its hash bucket, comparing cached hashes first */
+static CacheNode *find_item(CacheShard *shard, const char *key, unsigned int hash)
 {
-    LruNode *prev = item->prev;
-    LruNode *next = item->next;
-    if (prev != NULL)
-        prev->next = next;
-    else
-        cache->lru_head = next;
+    CacheNode *current;
+    for (current = shard->buckets[BUCKET(shard, hash)]; current != NULL; current = current->next)
+        if (current->hash == hash && !strcmp(current->key, key))
+            return current;
 
-    if (next != NULL)
-        next->prev = prev;
-    else
-        cache->lru_tail = prev;
+    return NULL;
+}
+
+/* Inserting an item into the hash table */
+static void insert_item(CacheShard *shard, CacheNode *item)
+{
+    if (shard->count >= shard->nbuckets)
+        grow_buckets(shard);
+
+    CacheNode **bucket = &shard->buckets[BUCKET(shard, item->hash)];
+    item->next = *bucket;
+    *bucket = item;
+    shard->count++;
+    shard->total_size += item->size;
+}
+
+/* Removing an item from the hash table */
+static void remove_item(CacheShard *shard, CacheNode *item)
+{
+    CacheNode **link = &shard->buckets[BUCKET(shard, item->hash)];
+    while (*link != item)
+        link = &(*link)->next;
+
+    *link = item->next;
+    shard->count--;
+    shard->total_size -= item->size;
 }
 
-/* Prepending an item to the start of the cached items linked list */
-static void prepend_item(Cache *cache, CacheNode *item)
+/* Doubling the number of buckets to keep the chains short.
+ * The table is left as is if the new bucket array can't be allocated. */
+static void grow_buckets(CacheShard *shard)
 {
-    item->prev = NULL;
-    item->next = cache->head;
-    if (cache->head != NULL)
-        cache->head->prev = item;
+    size_t nbuckets = shard->nbuckets * 2;
+    CacheNode **buckets;
+    if ((buckets = Calloc(nbuckets, sizeof(CacheNode *))) == NULL)
+        return;
 
-    cache->head = item;
-    cache->total_size += item->size;
+    size_t i;
+    for (i = 0; i < shard->nbuckets; i++)
+    {
+        CacheNode *current = shard->buckets[i];
+        while (current != NULL)
+        {
+            CacheNode *next = current->next;
+            CacheNode **bucket = &buckets[current->hash & (nbuckets - 1)];
+            current->next = *bucket;
+            *bucket = current;
+            current = next;
+        }
+    }
+
+    free(shard->buckets);
+    shard->buckets = buckets;
+    shard->nbuckets = nbuckets;
+}
+
+/* Unlinking an item from the cache. The caller drops
+ * the cache reference once the shard lock is released. */
+static void evict_item(CacheShard *shard, CacheNode *item)
+{
+    remove_item(shard, item);
+    remove_lru(shard, item);
+}
+
+/* Picking the entry to evict. LRU takes the list head. CLOCK sweeps
+ * from the head, clearing reference bits and moving referenced
+ * entries to the tail, until it finds an unreferenced one. */
+static CacheNode *next_victim(Cache *cache, CacheShard *shard)
+{
+    CacheNode *victim = shard->lru_head;
+    if (cache->policy != CACHE_CLOCK)
+        return victim;
+
+    while (__atomic_load_n(&victim->referenced, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&victim->referenced, 0, __ATOMIC_RELAXED);
+        remove_lru(shard, victim);
+        append_lru(shard, victim);
+        victim = shard->lru_head;
+    }
+
+    return victim;
+}
+
+/* Appending an item to the end of the LRU linked list */
+static void append_lru(CacheShard *shard, CacheNode *item)
+{
+    item->lru_next = NULL;
+    item->lru_prev = shard->lru_tail;
+    if (shard->lru_tail != NULL)
+        shard->lru_tail->lru_next = item;
+    else
+        shard->lru_head = item;
+
+    shard->lru_tail = item;
 }
 
-/* Removing an item from the cached items linked list */
-static void remove_item(Cache *cache, CacheNode *item)
+/* Removing an item from the LRU linked list*/
+static void remove_lru(CacheShard *shard, CacheNode *item)
 {
-    CacheNode *next = item->next;
-    CacheNode *prev = item->prev;
+    CacheNode *prev = item->lru_prev;
+    CacheNode *next = item->lru_next;
     if (prev != NULL)
-        prev->next = next;
+        prev->lru_next = next;
     else
-        cache->head = next;
+        shard->lru_head = next;
 
     if (next != NULL)
-        next->prev = prev;
-}
\ No newline at end of file
+        next->lru_prev = prev;
+    else
+        shard->lru_tail = prev;
+}
@@ -1,36 +1,109 @@
+#include <limits.h>
+#include <sys/uio.h>
 #include "csapp.h"
+#include "arena.h"
+
+/* Max size of a cacheable request */
+#define MAX_OBJECT_SIZE 102400
+#define MAX_CACHE_SIZE 1049000
+
+/* Initial number of hash buckets per shard, must be a power of two */
+#define CACHE_BUCKETS 256
+
+/* Number of independently locked cache shards.
+ * Every shard owns an equal part of MAX_CACHE_SIZE,
+ * so the sum of the shard budgets never exceeds it. */
+#define CACHE_SHARDS 8
+#define SHARD_SIZE (MAX_CACHE_SIZE / CACHE_SHARDS)
+
+#if SHARD_SIZE < MAX_OBJECT_SIZE
+#error "A cache shard must be able to hold the largest cacheable object"
+#endif
+
+/* Every shard preallocates an arena of 2^SHARD_ARENA_SHIFT bytes. It leaves
+ * room for the power of two rounding of the chunks and for the entry headers. */
+#define SHARD_ARENA_SHIFT 19
+
+#if (1 << SHARD_ARENA_SHIFT) < 2 * SHARD_SIZE
+#error "A shard arena must be at least twice as large as the shard budget"
+#endif
+
+/* cache_init flags, the eviction policy is either CACHE_LRU or CACHE_CLOCK */
+#define CACHE_LRU 0x0    /* Hits move the entry to the LRU tail under the write lock */
+#define CACHE_CLOCK 0x1  /* Hits set a reference bit under the read lock */
+#define CACHE_MALLOC 0x2 /* Allocate entries with malloc instead of the shard arenas */
+
+/* Longest ETag or Last-Modified value kept with an entry */
+#define CACHE_VALIDATOR_LEN 128
+
+/* Cached object bytes, stored right after the node header */
+#define CACHE_PAYLOAD(item) ((char *)(item) + sizeof(CacheNode))
 
 typedef struct cache Cache;
+typedef struct shard CacheShard;
 typedef struct item CacheNode;
-typedef struct lru LruNode;
 
-struct cache
+/* Freshness of an entry and the validators to revalidate it with once
+ * it's stale, both taken from the response headers */
+typedef struct cache_meta
+{
+    time_t expires; /* The entry is stale from then on */
+    char etag[CACHE_VALIDATOR_LEN];
+    char modified[CACHE_VALIDATOR_LEN];
+} CacheMeta;
+
+/* Called with every entry pushed out by the eviction policy, outside of
+ * the shard lock. The spill takes over the reference of the cache and
+ * drops it with cache_release once it's done, on any thread. */
+typedef void (*CacheSpill)(void *arg, CacheNode *item);
+
+/* Shards are cache line aligned, so their locks don't share a line.
+ * With CLOCK the LRU list is the clock: the head is the hand
+ * and entries spared by their reference bit move to the tail. */
+struct shard
 {
-    int readers_count;
     size_t total_size;
-    CacheNode *head;
-    LruNode *lru_head;
-    LruNode *lru_tail;
-    sem_t readers_lock;
-    sem_t writers_lock;
-}; 
+    size_t count;
+    size_t nbuckets;
+    CacheNode **buckets;
+    CacheNode *lru_head;
+    CacheNode *lru_tail;
+    pthread_rwlock_t lock;
+    Arena arena;
+} __attribute__((aligned(64)));
 
+struct cache
+{
+    int policy;
+    int use_arena;
+    CacheSpill spill; /* NULL unless there's a tier below */
+    void *spill_arg;
+    CacheShard shards[CACHE_SHARDS];
+};
+
+/* Cache entries are immutable once added. The cache holds one reference
+ * while the entry is resident and every cache_get hit holds another one,
+ * so an evicted entry is freed only after the last reader releases it.
+ * An entry is a single block: this header, the payload and the key. */
 struct item
 {
     char *key;
+    unsigned int hash;
+    int refs;
+    int referenced;
     size_t size;
-    LruNode *lru;
+    Arena *arena; /* NULL if the block comes from malloc */
+    CacheMeta meta;
     CacheNode *next;
-    CacheNode *prev;
+    CacheNode *lru_prev;
+    CacheNode *lru_next;
 };
 
-struct lru
-{
-    CacheNode *item;
-    LruNode *prev;
-    LruNode *next;
-}; 
-
-int cache_init(Cache *cache);
-int cache_add(Cache *cache, const char *key, const void *buf, size_t length);
-int cache_get(Cache *cache, const char *key, void **item, size_t *length);
\ No newline at end of file
+int cache_init(Cache *cache, int flags);
+void cache_free(Cache *cache);
+void cache_set_spill(Cache *cache, CacheSpill spill, void *arg);
+int cache_add(Cache *cache, const char *key, const CacheMeta *meta, const void *buf, size_t length);
+int cache_addv(Cache *cache, const char *key, const CacheMeta *meta, const struct iovec *iov, int iovcnt);
+int cache_get(Cache *cache, const char *key, CacheNode **item);
+void cache_release(CacheNode *item);
+void cache_usage(Cache *cache, size_t *count, size_t *bytes);
\ No newline at end of file
@@ -0,0 +1,469 @@
+#include "disk.h"
+#include "hash.h"
+
+/* Size of a record on disk, header, key, meta and payload padded to 8 bytes */
+#define RECORD_SIZE(key_size, meta_size, size) \
+    ((sizeof(DiskRecord) + (key_size) + (meta_size) + (size) + 7) & ~(size_t)7)
+
+/* Checksum of an empty buffer, where a running one starts */
+#define CHECKSUM_SEED 14695981039346656037ULL
+
+static int append_record(DiskCache *disk, DiskRecord *record, const char *key, const void *meta,
+                         const void *buf, DiskEntry *entry);
+static int open_segment(DiskSegment *segment, const char *dir, int i, size_t size);
+static void scan_segment(DiskCache *disk, DiskSegment *segment);
+static int recycle_segment(DiskCache *disk);
+static DiskEntry *find_entry(DiskCache *disk, const char *key, unsigned int hash);
+static int same_record(DiskEntry *entry, DiskRecord *record);
+static void insert_entry(DiskCache *disk, DiskEntry *entry);
+static void remove_entry(DiskCache *disk, DiskEntry *entry);
+static void grow_buckets(DiskCache *disk);
+static uint64_t checksum(uint64_t sum, const void *buf, size_t size);
+
+/* Opens the segment files in dir, creating them if needed, and rebuilds
+ * the index from the records they hold. Segment files of another size
+ * are emptied. */
+int disk_open(DiskCache *disk, const char *dir, size_t size)
+{
+    memset(disk, 0, sizeof(DiskCache));
+    long page = sysconf(_SC_PAGESIZE);
+    disk->segment_size = size / DISK_SEGMENTS / page * page;
+    if (disk->segment_size < sizeof(DiskSegmentHeader) + RECORD_SIZE(MAXLINE, 0, 0))
+    {
+        fprintf(stderr, "Disk cache of %zu bytes is too small\n", size);
+        return -1;
+    }
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+    {
+        unix_error("mkdir error");
+        return -1;
+    }
+
+    disk->nbuckets = DISK_BUCKETS;
+    if ((disk->buckets = Calloc(disk->nbuckets, sizeof(DiskEntry *))) == NULL)
+        return -1;
+
+    if (pthread_rwlock_init(&disk->lock, NULL) != 0)
+        return -1;
+
+    int i;
+    for (i = 0; i < DISK_SEGMENTS; i++)
+        if (open_segment(&disk->segments[i], dir, i, disk->segment_size) < 0)
+            return -1;
+
+    /* Scanning the oldest segment first, so the newer records of a key win */
+    DiskSegment *order[DISK_SEGMENTS];
+    for (i = 0; i < DISK_SEGMENTS; i++)
+    {
+        int j = i;
+        while (j > 0 && order[j - 1]->generation > disk->segments[i].generation)
+        {
+            order[j] = order[j - 1];
+            j--;
+        }
+
+        order[j] = &disk->segments[i];
+    }
+
+    for (i = 0; i < DISK_SEGMENTS; i++)
+        if (order[i]->generation > 0)
+            scan_segment(disk, order[i]);
+
+    /* Appending to the newest segment, or starting the first one */
+    disk->active = order[DISK_SEGMENTS - 1];
+    if (disk->active->generation == 0 && recycle_segment(disk) < 0)
+        return -1;
+
+    return 0;
+}
+
+void disk_close(DiskCache *disk)
+{
+    int i;
+    for (i = 0; i < DISK_SEGMENTS; i++)
+    {
+        DiskSegment *segment = &disk->segments[i];
+        while (segment->entries != NULL)
+            remove_entry(disk, segment->entries);
+
+        munmap(segment->map, disk->segment_size);
+        close(segment->fd);
+    }
+
+    free(disk->buckets);
+    pthread_rwlock_destroy(&disk->lock);
+}
+
+/* Appends an object and meta_size bytes about it, which are opaque to the
+ * disk tier, to the active segment, recycling the oldest one if it's full.
+ * A record of the key with other meta or payload is replaced, its bytes
+ * stay in their segment until it's recycled. Returns 1 if the object is
+ * written, 0 if the same object is on disk already or it doesn't fit in
+ * a segment and -1 on error. */
+int disk_put(DiskCache *disk, const char *key, const void *meta, size_t meta_size,
+             const void *buf, size_t size)
+{
+    size_t key_size = strlen(key) + 1;
+    size_t record_size = RECORD_SIZE(key_size, meta_size, size);
+    if (record_size > disk->segment_size - sizeof(DiskSegmentHeader))
+        return 0;
+
+    DiskRecord record;
+    memset(&record, 0, sizeof(DiskRecord));
+    record.magic = DISK_MAGIC;
+    record.key_size = key_size;
+    record.size = size;
+    record.hash = hash_string(key);
+    record.meta_size = meta_size;
+    record.checksum = checksum(checksum(CHECKSUM_SEED, meta, meta_size), buf, size);
+
+    /* Most objects leaving the memory cache came from the disk unchanged */
+    if (pthread_rwlock_rdlock(&disk->lock) != 0)
+        return -1;
+
+    DiskEntry *entry = find_entry(disk, key, record.hash);
+    int same = entry != NULL && same_record(entry, &record);
+    if (pthread_rwlock_unlock(&disk->lock) != 0)
+        return -1;
+
+    if (same)
+        return 0;
+
+    if ((entry = Malloc(sizeof(DiskEntry))) == NULL)
+        return -1;
+
+    if (pthread_rwlock_wrlock(&disk->lock) != 0)
+    {
+        free(entry);
+        return -1;
+    }
+
+    /* Another loop may have written it in the meantime. An older copy is
+     * dropped first, recycling a segment could free it. */
+    int status = 0;
+    DiskEntry *old = find_entry(disk, key, record.hash);
+    if (old == NULL || !same_record(old, &record))
+    {
+        if (old != NULL)
+            remove_entry(disk, old);
+
+        status = append_record(disk, &record, key, meta, buf, entry);
+    }
+
+    if (pthread_rwlock_unlock(&disk->lock) != 0)
+        status = -1;
+
+    if (status <= 0)
+        free(entry);
+
+    return status;
+}
+
+/* Looks up a key and hands the meta and the object to load, in place in
+ * the segment mapping, once their checksum is verified. They stay valid
+ * during the call only, which holds the read lock, so load must not call
+ * into the disk tier. Returns 1 on a hit, 0 on a miss or a corrupt record
+ * and -1 if load or the lock failed. */
+int disk_load(DiskCache *disk, const char *key, DiskLoad load, void *arg)
+{
+    unsigned int hash = hash_string(key);
+    if (pthread_rwlock_rdlock(&disk->lock) != 0)
+        return -1;
+
+    DiskEntry *entry;
+    if ((entry = find_entry(disk, key, hash)) == NULL)
+    {
+        pthread_rwlock_unlock(&disk->lock);
+        __atomic_add_fetch(&disk->misses, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    /* The meta comes right before the payload */
+    const char *meta = entry->segment->map + entry->offset - entry->meta_size;
+    struct iovec iov = {(void *)(meta + entry->meta_size), entry->size};
+    uint64_t expected = entry->checksum;
+    if (checksum(checksum(CHECKSUM_SEED, meta, entry->meta_size), iov.iov_base, iov.iov_len) == expected)
+    {
+        int status = load(arg, meta, entry->meta_size, &iov, 1);
+        if (pthread_rwlock_unlock(&disk->lock) != 0 || status < 0)
+            return -1;
+
+        __atomic_add_fetch(&disk->hits, 1, __ATOMIC_RELAXED);
+        return 1;
+    }
+
+    /* A record torn by a crash in the middle of its write is dropped */
+    __atomic_add_fetch(&disk->corrupt, 1, __ATOMIC_RELAXED);
+    if (pthread_rwlock_unlock(&disk->lock) != 0 || pthread_rwlock_wrlock(&disk->lock) != 0)
+        return 0;
+
+    if ((entry = find_entry(disk, key, hash)) != NULL && entry->checksum == expected)
+        remove_entry(disk, entry);
+
+    pthread_rwlock_unlock(&disk->lock);
+    return 0;
+}
+
+/* Writing a record at the end of the active segment and indexing it
+ * with the given entry, called with the write lock held. Returns 1 once
+ * the record is written and -1 on error. */
+static int append_record(DiskCache *disk, DiskRecord *record, const char *key, const void *meta,
+                         const void *buf, DiskEntry *entry)
+{
+    size_t record_size = RECORD_SIZE(record->key_size, record->meta_size, record->size);
+    if (disk->active->end + record_size > disk->segment_size && recycle_segment(disk) < 0)
+        return -1;
+
+    DiskSegment *segment = disk->active;
+    record->generation = (uint32_t)segment->generation;
+    static const char padding[8];
+    struct iovec iov[5] = {
+        {record, sizeof(DiskRecord)},
+        {(void *)key, record->key_size},
+        {(void *)meta, record->meta_size},
+        {(void *)buf, record->size},
+        {(void *)padding, record_size - sizeof(DiskRecord) - record->key_size - record->meta_size - record->size},
+    };
+
+    /* A failed write is written over by the next one */
+    if (pwritev(segment->fd, iov, 5, segment->end) != (ssize_t)record_size)
+    {
+        unix_error("pwritev error");
+        return -1;
+    }
+
+    entry->key = segment->map + segment->end + sizeof(DiskRecord);
+    entry->hash = record->hash;
+    entry->offset = segment->end + sizeof(DiskRecord) + record->key_size + record->meta_size;
+    entry->meta_size = record->meta_size;
+    entry->size = record->size;
+    entry->checksum = record->checksum;
+    entry->segment = segment;
+    insert_entry(disk, entry);
+    segment->end += record_size;
+    disk->writes++;
+    return 1;
+}
+
+/* Opens and maps the i-th segment file, reading its generation */
+static int open_segment(DiskSegment *segment, const char *dir, int i, size_t size)
+{
+    char path[MAXLINE];
+    snprintf(path, MAXLINE, "%s/segment%d", dir, i);
+    if ((segment->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+    {
+        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(segment->fd, &st) < 0)
+    {
+        unix_error("fstat error");
+        return -1;
+    }
+
+    if ((size_t)st.st_size != size && (ftruncate(segment->fd, 0) < 0 || ftruncate(segment->fd, size) < 0))
+    {
+        unix_error("ftruncate error");
+        return -1;
+    }
+
+    if ((segment->map = mmap(NULL, size, PROT_READ, MAP_SHARED, segment->fd, 0)) == MAP_FAILED)
+    {
+        unix_error("mmap error");
+        return -1;
+    }
+
+    DiskSegmentHeader *header = (DiskSegmentHeader *)segment->map;
+    segment->generation = header->magic == DISK_MAGIC ? header->generation : 0;
+    segment->end = sizeof(DiskSegmentHeader);
+    segment->entries = NULL;
+    return 0;
+}
+
+/* Indexing the records of a segment up to the first one that is not
+ * of its generation or doesn't look right */
+static void scan_segment(DiskCache *disk, DiskSegment *segment)
+{
+    size_t offset = sizeof(DiskSegmentHeader);
+    while (offset + sizeof(DiskRecord) <= disk->segment_size)
+    {
+        DiskRecord *record = (DiskRecord *)(segment->map + offset);
+        if (record->magic != DISK_MAGIC || record->generation != (uint32_t)segment->generation)
+            break;
+
+        size_t record_size = RECORD_SIZE(record->key_size, record->meta_size, record->size);
+        if (record->key_size == 0 || record_size > disk->segment_size - offset)
+            break;
+
+        const char *key = (const char *)(record + 1);
+        if (key[record->key_size - 1] != '\0' || strlen(key) + 1 != record->key_size ||
+            hash_string(key) != record->hash)
+            break;
+
+        DiskEntry *entry;
+        if ((entry = find_entry(disk, key, record->hash)) != NULL)
+            remove_entry(disk, entry);
+
+        if ((entry = Malloc(sizeof(DiskEntry))) == NULL)
+            break;
+
+        entry->key = key;
+        entry->hash = record->hash;
+        entry->offset = offset + sizeof(DiskRecord) + record->key_size + record->meta_size;
+        entry->meta_size = record->meta_size;
+        entry->size = record->size;
+        entry->checksum = record->checksum;
+        entry->segment = segment;
+        insert_entry(disk, entry);
+        offset += record_size;
+    }
+
+    segment->end = offset;
+}
+
+/* Emptying the oldest segment and making it the active one,
+ * called with the write lock held */
+static int recycle_segment(DiskCache *disk)
+{
+    DiskSegment *oldest = &disk->segments[0];
+    uint64_t newest = 0;
+    int i;
+    for (i = 0; i < DISK_SEGMENTS; i++)
+    {
+        DiskSegment *segment = &disk->segments[i];
+        if (segment->generation < oldest->generation)
+            oldest = segment;
+
+        if (segment->generation > newest)
+            newest = segment->generation;
+    }
+
+    while (oldest->entries != NULL)
+    {
+        remove_entry(disk, oldest->entries);
+        disk->dropped++;
+    }
+
+    DiskSegmentHeader header = {DISK_MAGIC, 0, newest + 1};
+    if (pwrite(oldest->fd, &header, sizeof(header), 0) != sizeof(header))
+    {
+        unix_error("pwrite error");
+        return -1;
+    }
+
+    oldest->generation = newest + 1;
+    oldest->end = sizeof(DiskSegmentHeader);
+    disk->active = oldest;
+    return 0;
+}
+
+static DiskEntry *find_entry(DiskCache *disk, const char *key, unsigned int hash)
+{
+    DiskEntry *entry;
+    for (entry = disk->buckets[hash & (disk->nbuckets - 1)]; entry != NULL; entry = entry->next)
+        if (entry->hash == hash && !strcmp(entry->key, key))
+            return entry;
+
+    return NULL;
+}
+
+/* Whether the entry holds the object of the record, by size and checksum */
+static int same_record(DiskEntry *entry, DiskRecord *record)
+{
+    return entry->meta_size == record->meta_size && entry->size == record->size &&
+           entry->checksum == record->checksum;
+}
+
+/* Adding an entry to the hash table and to the list of its segment */
+static void insert_entry(DiskCache *disk, DiskEntry *entry)
+{
+    if (disk->count >= disk->nbuckets)
+        grow_buckets(disk);
+
+    DiskEntry **bucket = &disk->buckets[entry->hash & (disk->nbuckets - 1)];
+    entry->next = *bucket;
+    *bucket = entry;
+    DiskSegment *segment = entry->segment;
+    entry->seg_prev = NULL;
+    entry->seg_next = segment->entries;
+    if (segment->entries != NULL)
+        segment->entries->seg_prev = entry;
+
+    segment->entries = entry;
+    disk->count++;
+    disk->bytes += entry->size;
+}
+
+/* Removing an entry from the index and freeing it */
+static void remove_entry(DiskCache *disk, DiskEntry *entry)
+{
+    DiskEntry **link = &disk->buckets[entry->hash & (disk->nbuckets - 1)];
+    while (*link != entry)
+        link = &(*link)->next;
+
+    *link = entry->next;
+    if (entry->seg_prev != NULL)
+        entry->seg_prev->seg_next = entry->seg_next;
+    else
+        entry->segment->entries = entry->seg_next;
+
+    if (entry->seg_next != NULL)
+        entry->seg_next->seg_prev = entry->seg_prev;
+
+    disk->count--;
+    disk->bytes -= entry->size;
+    free(entry);
+}
+
+/* Doubling the number of buckets, the table is left as is
+ * if the new bucket array can't be allocated */
+static void grow_buckets(DiskCache *disk)
+{
+    size_t nbuckets = disk->nbuckets * 2;
+    DiskEntry **buckets;
+    if ((buckets = Calloc(nbuckets, sizeof(DiskEntry *))) == NULL)
+        return;
+
+    size_t i;
+    for (i = 0; i < disk->nbuckets; i++)
+    {
+        DiskEntry *entry = disk->buckets[i];
+        while (entry != NULL)
+        {
+            DiskEntry *next = entry->next;
+            DiskEntry **bucket = &buckets[entry->hash & (nbuckets - 1)];
+            entry->next = *bucket;
+            *bucket = entry;
+            entry = next;
+        }
+    }
+
+    free(disk->buckets);
+    disk->buckets = buckets;
+    disk->nbuckets = nbuckets;
+}
+
+/* FNV-1a over 8-byte words, folded so the high bits reach the low ones.
+ * Buffers are chained by passing the checksum of the previous one as sum,
+ * the first one gets CHECKSUM_SEED. */
+static uint64_t checksum(uint64_t sum, const void *buf, size_t size)
+{
+    const unsigned char *bytes = buf;
+    sum ^= size;
+    size_t i;
+    for (i = 0; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i, 8);
+        sum = (sum ^ word) * 1099511628211ULL;
+        sum ^= sum >> 29;
+    }
+
+    for (; i < size; i++)
+        sum = (sum ^ bytes[i]) * 1099511628211ULL;
+
+    return sum;
+}
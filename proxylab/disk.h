@@ -0,0 +1,99 @@
+#include <stdint.h>
+#include <sys/uio.h>
+#include "csapp.h"
+
+/* Second cache tier on disk. The objects evicted from the memory cache
+ * are appended to one of DISK_SEGMENTS segment files, and once the last
+ * one is full the oldest segment is emptied and written over. The index
+ * lives in memory only, disk_open rebuilds it from the record headers. */
+
+/* Default size of all the segments together */
+#define DISK_SIZE (64 << 20)
+
+/* Number of segment files the disk tier is split into */
+#define DISK_SEGMENTS 4
+
+/* Initial number of index hash buckets, a power of two */
+#define DISK_BUCKETS 1024
+
+/* Marks a segment header and every record header */
+#define DISK_MAGIC 0x4b534944
+
+typedef struct disk_cache DiskCache;
+typedef struct disk_segment DiskSegment;
+typedef struct disk_entry DiskEntry;
+
+/* Start of every segment file. Segments are written over in the order
+ * of their generations, generation 0 is a segment never written to. */
+typedef struct disk_segment_header
+{
+    uint32_t magic;
+    uint32_t unused;
+    uint64_t generation;
+} DiskSegmentHeader;
+
+/* Start of every record, followed by the key with its NUL, the meta bytes
+ * of the caller and the payload, padded to 8 bytes. Records of an earlier
+ * generation past the end of the segment are ignored. */
+typedef struct disk_record
+{
+    uint32_t magic;
+    uint32_t generation; /* Low bits of the segment generation */
+    uint32_t key_size;
+    uint32_t size;
+    uint32_t hash;
+    uint32_t meta_size;
+    uint64_t checksum; /* Of the meta and the payload, checked by every read */
+} DiskRecord;
+
+/* Index entry of a record, the key points into the segment mapping */
+struct disk_entry
+{
+    const char *key;
+    unsigned int hash;
+    size_t offset; /* Of the payload in the segment, the meta is right before it */
+    size_t meta_size;
+    size_t size;
+    uint64_t checksum;
+    DiskSegment *segment;
+    DiskEntry *next; /* Hash chain */
+    DiskEntry *seg_prev;
+    DiskEntry *seg_next;
+};
+
+/* Segment file, mapped read-only and written with pwritev */
+struct disk_segment
+{
+    int fd;
+    char *map;
+    uint64_t generation;
+    size_t end; /* Where the next record goes */
+    DiskEntry *entries;
+};
+
+struct disk_cache
+{
+    pthread_rwlock_t lock;
+    size_t segment_size;
+    DiskSegment *active; /* Segment being appended to */
+    DiskSegment segments[DISK_SEGMENTS];
+    size_t count;
+    size_t bytes;
+    size_t nbuckets;
+    DiskEntry **buckets;
+    /* Counters, updated atomically */
+    long hits;
+    long misses;
+    long writes;
+    long dropped; /* Entries lost with a recycled segment */
+    long corrupt; /* Reads that failed the checksum */
+};
+
+/* Receives the meta and the object of a disk hit, see disk_load */
+typedef int (*DiskLoad)(void *arg, const void *meta, size_t meta_size, const struct iovec *iov, int iovcnt);
+
+int disk_open(DiskCache *disk, const char *dir, size_t size);
+void disk_close(DiskCache *disk);
+int disk_put(DiskCache *disk, const char *key, const void *meta, size_t meta_size,
+             const void *buf, size_t size);
+int disk_load(DiskCache *disk, const char *key, DiskLoad load, void *arg);
@@ -0,0 +1,175 @@
+/*
+ * dns-test.c - Test of the proxy DNS cache against a stub resolver.
+ *     The stub answers every lookup after <delay> milliseconds, with
+ *     127.0.0.1 or, for names ending in ".invalid", with EAI_NONAME.
+ *     Checks that hits and negative hits never reach the stub, that
+ *     concurrent lookups of one name share a single stub call, that the
+ *     entries expire after their TTL and that hits stay fast while slow
+ *     lookups are running. Prints the counters and exits with 1 if any
+ *     check fails.
+ *
+ *     usage: ./dns-test [-d <delay>]
+ */
+#include <getopt.h>
+#include "dns.h"
+
+#define DEFAULT_DELAY 200
+#define CONCURRENT_LOOKUPS 16
+#define TEST_TTL 1
+
+static DnsCache dns;
+static int delay_ms = DEFAULT_DELAY;
+static long stub_calls = 0;
+static int failures = 0;
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static int stub_lookup(const char *host, const char *port, struct addrinfo **addrs)
+{
+    __atomic_add_fetch(&stub_calls, 1, __ATOMIC_RELAXED);
+    usleep(delay_ms * 1000);
+    size_t len = strlen(host);
+    if (len >= 8 && !strcmp(host + len - 8, ".invalid"))
+        return EAI_NONAME;
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICHOST | AI_NUMERICSERV;
+    return getaddrinfo("127.0.0.1", port, &hints, addrs);
+}
+
+static void check(int ok, const char *what)
+{
+    printf("%s %s\n", ok ? "PASS" : "FAIL", what);
+    if (!ok)
+        failures++;
+}
+
+/* Resolves a name through the cache the way the proxy does.
+ * Returns the entry status and sets the elapsed time. */
+static int lookup(const char *host, double *elapsed)
+{
+    double start = now_ms();
+    DnsEntry *entry;
+    if (dns_get(&dns, host, "80", &entry) <= 0 && (entry = dns_resolve(&dns, host, "80")) == NULL)
+        exit(1);
+
+    *elapsed = now_ms() - start;
+    int status = entry->status;
+    dns_release(&dns, entry);
+    return status;
+}
+
+static void *resolve_thread(void *vargp)
+{
+    double elapsed;
+    lookup(vargp, &elapsed);
+    return NULL;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr, "usage: %s [-d <delay>]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int c;
+    while ((c = getopt(argc, argv, "d:")) != -1)
+    {
+        switch (c)
+        {
+        case 'd':
+            delay_ms = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc || delay_ms <= 0)
+        usage(argv[0]);
+
+    if (dns_init(&dns, stub_lookup, TEST_TTL, TEST_TTL) < 0)
+        exit(1);
+
+    /* A miss waits for the stub, the following lookups don't */
+    double miss, hit;
+    int status = lookup("origin.test", &miss);
+    lookup("origin.test", &hit);
+    printf("Miss: %.1f ms, hit: %.3f ms\n", miss, hit);
+    check(status == 0 && miss >= delay_ms && hit < delay_ms / 10.0, "hits skip the stub");
+
+    /* Failed lookups are cached too */
+    status = lookup("missing.invalid", &miss);
+    int negative = lookup("missing.invalid", &hit);
+    printf("Negative miss: %.1f ms, negative hit: %.3f ms\n", miss, hit);
+    check(status == EAI_NONAME && negative == EAI_NONAME && hit < delay_ms / 10.0,
+          "failed lookups are cached");
+
+    /* Concurrent misses for one name share a lookup */
+    long calls = stub_calls;
+    pthread_t tids[CONCURRENT_LOOKUPS];
+    int i;
+    for (i = 0; i < CONCURRENT_LOOKUPS; i++)
+        if (Pthread_create(&tids[i], NULL, resolve_thread, "shared.test") != 0)
+            exit(1);
+
+    for (i = 0; i < CONCURRENT_LOOKUPS; i++)
+        Pthread_join(tids[i], NULL);
+
+    printf("Stub calls for %d concurrent lookups: %ld\n", CONCURRENT_LOOKUPS, stub_calls - calls);
+    check(stub_calls - calls == 1, "concurrent lookups are coalesced");
+
+    /* Hits are answered while slow lookups hold resolver threads */
+    for (i = 0; i < CONCURRENT_LOOKUPS; i++)
+    {
+        char *host = Malloc(32);
+        sprintf(host, "slow%d.test", i);
+        if (Pthread_create(&tids[i], NULL, resolve_thread, host) != 0)
+            exit(1);
+    }
+
+    usleep(delay_ms * 1000 / 4);
+    double worst = 0;
+    for (i = 0; i < 1000; i++)
+    {
+        lookup("shared.test", &hit);
+        if (hit > worst)
+            worst = hit;
+    }
+
+    for (i = 0; i < CONCURRENT_LOOKUPS; i++)
+        Pthread_join(tids[i], NULL);
+
+    printf("Slowest of 1000 hits during %d slow lookups: %.3f ms\n", CONCURRENT_LOOKUPS, worst);
+    check(worst < delay_ms / 10.0, "hits don't wait for slow lookups");
+
+    /* Entries expire after their TTL */
+    usleep(TEST_TTL * 1000000 + 100000);
+    calls = stub_calls;
+    lookup("origin.test", &miss);
+    lookup("missing.invalid", &miss);
+    check(stub_calls - calls == 2, "expired entries are looked up again");
+
+    pthread_mutex_lock(&dns.lock);
+    printf("Hits: %ld (%ld negative), misses: %ld, lookups: %ld, expired: %ld\n",
+           dns.hits, dns.negative_hits, dns.misses, dns.lookups, dns.expired);
+    pthread_mutex_unlock(&dns.lock);
+
+    if (failures > 0)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("All checks passed\n");
+    return 0;
+}
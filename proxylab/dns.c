@@ -0,0 +1,185 @@
+#include "dns.h"
+#include "hash.h"
+
+static int default_lookup(const char *host, const char *port, struct addrinfo **addrs);
+static DnsEntry *find_entry(DnsCache *dns, const char *name, unsigned int hash);
+static void remove_entry(DnsCache *dns, DnsEntry *entry);
+static void prune_bucket(DnsCache *dns, DnsEntry **bucket);
+static void unpin(DnsEntry *entry);
+
+/* The lookup function is getaddrinfo if it's NULL */
+int dns_init(DnsCache *dns, DnsLookup lookup, int ttl, int negative_ttl)
+{
+    dns->lookup = lookup != NULL ? lookup : default_lookup;
+    dns->ttl = ttl;
+    dns->negative_ttl = negative_ttl;
+    dns->hits = 0;
+    dns->negative_hits = 0;
+    dns->misses = 0;
+    dns->lookups = 0;
+    dns->expired = 0;
+    memset(dns->buckets, 0, sizeof(dns->buckets));
+    if (pthread_mutex_init(&dns->lock, NULL) != 0)
+        return -1;
+
+    if (pthread_cond_init(&dns->resolved, NULL) != 0)
+        return -1;
+
+    return 0;
+}
+
+/* Looks up a fresh result for the host and port without blocking.
+ * A hit pins the entry, which must be given back with dns_release. */
+int dns_get(DnsCache *dns, const char *host, const char *port, DnsEntry **entry)
+{
+    char name[DNS_MAX_NAME];
+    snprintf(name, sizeof(name), "%s:%s", host, port);
+    unsigned int hash = hash_string(name);
+    time_t now = time(NULL);
+    pthread_mutex_lock(&dns->lock);
+    DnsEntry *current = find_entry(dns, name, hash);
+    int hit = current != NULL && !current->pending && current->expires > now;
+    if (hit)
+    {
+        current->refs++;
+        dns->hits++;
+        if (current->status != 0)
+            dns->negative_hits++;
+
+        *entry = current;
+    }
+    else
+        dns->misses++;
+
+    pthread_mutex_unlock(&dns->lock);
+    return hit;
+}
+
+/* Resolves the host and port, blocking. Concurrent calls for the same
+ * name wait for a single lookup, a fresh result is reused right away.
+ * Returns the pinned entry, or NULL if it can't be allocated. */
+DnsEntry *dns_resolve(DnsCache *dns, const char *host, const char *port)
+{
+    char name[DNS_MAX_NAME];
+    snprintf(name, sizeof(name), "%s:%s", host, port);
+    unsigned int hash = hash_string(name);
+    DnsEntry *entry;
+    pthread_mutex_lock(&dns->lock);
+    while ((entry = find_entry(dns, name, hash)) != NULL)
+    {
+        if (entry->pending)
+            pthread_cond_wait(&dns->resolved, &dns->lock);
+        else if (entry->expires > time(NULL))
+        {
+            entry->refs++;
+            pthread_mutex_unlock(&dns->lock);
+            return entry;
+        }
+        else
+        {
+            remove_entry(dns, entry);
+            dns->expired++;
+        }
+    }
+
+    /* Adding a pending entry, so the concurrent calls wait for this lookup */
+    size_t name_size = strlen(name) + 1;
+    if ((entry = Calloc(1, sizeof(DnsEntry) + name_size)) == NULL)
+    {
+        pthread_mutex_unlock(&dns->lock);
+        return NULL;
+    }
+
+    entry->name = (char *)(entry + 1);
+    memcpy(entry->name, name, name_size);
+    entry->hash = hash;
+    entry->refs = 2;
+    entry->pending = 1;
+    DnsEntry **bucket = &dns->buckets[hash & (DNS_BUCKETS - 1)];
+    prune_bucket(dns, bucket);
+    entry->next = *bucket;
+    *bucket = entry;
+    dns->lookups++;
+    pthread_mutex_unlock(&dns->lock);
+
+    struct addrinfo *addrs = NULL;
+    int status = dns->lookup(host, port, &addrs);
+
+    pthread_mutex_lock(&dns->lock);
+    entry->status = status;
+    entry->addrs = status == 0 ? addrs : NULL;
+    entry->expires = time(NULL) + (status == 0 ? dns->ttl : dns->negative_ttl);
+    entry->pending = 0;
+    pthread_cond_broadcast(&dns->resolved);
+    pthread_mutex_unlock(&dns->lock);
+    return entry;
+}
+
+/* Dropping a reference to an entry, the last one frees it */
+void dns_release(DnsCache *dns, DnsEntry *entry)
+{
+    pthread_mutex_lock(&dns->lock);
+    unpin(entry);
+    pthread_mutex_unlock(&dns->lock);
+}
+
+static int default_lookup(const char *host, const char *port, struct addrinfo **addrs)
+{
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    return getaddrinfo(host, port, &hints, addrs);
+}
+
+static DnsEntry *find_entry(DnsCache *dns, const char *name, unsigned int hash)
+{
+    DnsEntry *entry;
+    for (entry = dns->buckets[hash & (DNS_BUCKETS - 1)]; entry != NULL; entry = entry->next)
+        if (entry->hash == hash && !strcmp(entry->name, name))
+            return entry;
+
+    return NULL;
+}
+
+/* Unlinking an entry and dropping the cache reference, called with the lock held */
+static void remove_entry(DnsCache *dns, DnsEntry *entry)
+{
+    DnsEntry **link = &dns->buckets[entry->hash & (DNS_BUCKETS - 1)];
+    while (*link != entry)
+        link = &(*link)->next;
+
+    *link = entry->next;
+    unpin(entry);
+}
+
+/* Dropping the expired entries of a bucket, so names that are not looked
+ * up anymore don't stay forever. Called with the lock held. */
+static void prune_bucket(DnsCache *dns, DnsEntry **bucket)
+{
+    time_t now = time(NULL);
+    DnsEntry **link = bucket;
+    while (*link != NULL)
+    {
+        DnsEntry *entry = *link;
+        if (!entry->pending && entry->expires <= now)
+        {
+            *link = entry->next;
+            unpin(entry);
+            dns->expired++;
+        }
+        else
+            link = &entry->next;
+    }
+}
+
+static void unpin(DnsEntry *entry)
+{
+    if (--entry->refs > 0)
+        return;
+
+    if (entry->addrs != NULL)
+        freeaddrinfo(entry->addrs);
+
+    free(entry);
+}
@@ -0,0 +1,57 @@
+#include "csapp.h"
+
+/* Seconds a lookup result is reused. getaddrinfo doesn't tell the record
+ * TTLs, so successful lookups are kept for a fixed time and failed ones
+ * for a shorter one. */
+#define DNS_TTL 60
+#define DNS_NEGATIVE_TTL 5
+
+/* Number of hash buckets, a power of two */
+#define DNS_BUCKETS 256
+
+/* Longest "host:port" name */
+#define DNS_MAX_NAME 512
+
+typedef struct dns_cache DnsCache;
+typedef struct dns_entry DnsEntry;
+
+/* Resolves a host and port the way getaddrinfo does, the addresses
+ * are freed with freeaddrinfo. Returns 0 or an EAI_* error code. */
+typedef int (*DnsLookup)(const char *host, const char *port, struct addrinfo **addrs);
+
+/* Lookup result for a host and port. Entries are immutable once the
+ * lookup is done. The cache holds one reference while the entry is
+ * resident, every caller of dns_get and dns_resolve holds another one. */
+struct dns_entry
+{
+    char *name;
+    unsigned int hash;
+    int refs;
+    int pending; /* The lookup is still running */
+    int status;  /* getaddrinfo status, the addresses are NULL unless it's 0 */
+    struct addrinfo *addrs;
+    time_t expires;
+    DnsEntry *next;
+};
+
+/* Process-wide cache of the name lookups */
+struct dns_cache
+{
+    pthread_mutex_t lock;
+    pthread_cond_t resolved; /* Signaled whenever a pending lookup is done */
+    DnsLookup lookup;
+    int ttl;
+    int negative_ttl;
+    /* Counters, read under the lock */
+    long hits;          /* dns_get calls answered from the cache */
+    long negative_hits; /* The part of the hits that were failed lookups */
+    long misses;        /* dns_get calls left to dns_resolve */
+    long lookups;       /* Calls of the lookup function */
+    long expired;       /* Entries dropped because their TTL ran out */
+    DnsEntry *buckets[DNS_BUCKETS];
+};
+
+int dns_init(DnsCache *dns, DnsLookup lookup, int ttl, int negative_ttl);
+int dns_get(DnsCache *dns, const char *host, const char *port, DnsEntry **entry);
+DnsEntry *dns_resolve(DnsCache *dns, const char *host, const char *port);
+void dns_release(DnsCache *dns, DnsEntry *entry);
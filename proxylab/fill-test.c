@@ -0,0 +1,245 @@
+/*
+ * fill-test.c - Test of the shared cache fills through a running proxy.
+ *     A stub origin serves objects of any body size, pausing halfway
+ *     through the body so that concurrent requests overlap. <clients>
+ *     concurrent GETs for an object whose head and body fit in
+ *     MAX_OBJECT_SIZE must all read the whole body from a single origin
+ *     request, and a later GET must be a cache hit. A body just under
+ *     MAX_OBJECT_SIZE that is too large with its head can't be shared,
+ *     but must still reach every client intact. Exits with 1 if any
+ *     check fails.
+ *
+ *     usage: ./fill-test [-c <clients>] <proxy host> <proxy port>
+ */
+#include <getopt.h>
+#include "cache.h"
+
+#define DEFAULT_CLIENTS 50
+
+/* Pause of the origin in the middle of a body */
+#define ORIGIN_PAUSE_MS 200
+
+/* Body sizes of the two objects, the head of the origin's responses is
+ * less than 1024 and more than 16 bytes */
+#define FITTING_SIZE (MAX_OBJECT_SIZE - 1024)
+#define TIGHT_SIZE (MAX_OBJECT_SIZE - 16)
+
+typedef struct client
+{
+    pthread_t tid;
+    const char *path;
+    size_t size;
+    int complete;
+} Client;
+
+static char *proxy_host;
+static char *proxy_port;
+static int origin_port;
+static long origin_requests = 0;
+static int failures = 0;
+
+static void check(int ok, const char *what)
+{
+    printf("%s %s\n", ok ? "PASS" : "FAIL", what);
+    if (!ok)
+        failures++;
+}
+
+static char body_byte(size_t i)
+{
+    return 'a' + i % 26;
+}
+
+/* Answering a request for /<size>/<name> with a body of size bytes */
+static void *serve_thread(void *vargp)
+{
+    int fd = *(int *)vargp;
+    free(vargp);
+    Pthread_detach(pthread_self());
+
+    char line[MAXLINE], path[MAXLINE];
+    rio_t rio;
+    rio_readinitb(&rio, fd);
+    if (rio_readlineb(&rio, line, MAXLINE) <= 0 || sscanf(line, "GET %s", path) != 1)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    while (rio_readlineb(&rio, line, MAXLINE) > 0 && strcmp(line, "\r\n"))
+        ;
+
+    __atomic_add_fetch(&origin_requests, 1, __ATOMIC_RELAXED);
+    size_t size = strtoul(path + 1, NULL, 10);
+    char *body = Malloc(size);
+    size_t i;
+    for (i = 0; i < size; i++)
+        body[i] = body_byte(i);
+
+    int n = snprintf(line, MAXLINE, "HTTP/1.0 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                                    "Content-Length: %zu\r\n\r\n", size);
+    if (rio_writen(fd, line, n) == n && rio_writen(fd, body, size / 2) == (ssize_t)(size / 2))
+    {
+        usleep(ORIGIN_PAUSE_MS * 1000);
+        rio_writen(fd, body + size / 2, size - size / 2);
+    }
+
+    free(body);
+    close(fd);
+    return NULL;
+}
+
+static void *origin_thread(void *vargp)
+{
+    int listenfd = *(int *)vargp;
+    while (1)
+    {
+        int *fd = Malloc(sizeof(int));
+        if ((*fd = accept(listenfd, NULL, NULL)) < 0)
+        {
+            free(fd);
+            continue;
+        }
+
+        pthread_t tid;
+        Pthread_create(&tid, NULL, serve_thread, fd);
+    }
+
+    return NULL;
+}
+
+/* Fetching the client's object through the proxy and checking every byte */
+static void *client_thread(void *vargp)
+{
+    Client *client = vargp;
+    int fd;
+    if ((fd = open_clientfd(proxy_host, proxy_port)) < 0)
+        return NULL;
+
+    char request[MAXLINE];
+    int n = snprintf(request, MAXLINE, "GET http://127.0.0.1:%d%s HTTP/1.0\r\n"
+                                       "Host: 127.0.0.1:%d\r\nConnection: close\r\n\r\n",
+                     origin_port, client->path, origin_port);
+    size_t capacity = 2 * MAX_OBJECT_SIZE;
+    char *buf = Malloc(capacity);
+    ssize_t length = -1;
+    if (rio_writen(fd, request, n) == n)
+        length = rio_readn(fd, buf, capacity);
+
+    close(fd);
+    ssize_t i;
+    for (i = 0; i + 4 <= length && memcmp(buf + i, "\r\n\r\n", 4); i++)
+        ;
+
+    if (i + 4 <= length)
+    {
+        char *body = buf + i + 4;
+        size_t size = buf + length - body;
+        for (i = 0; i < (ssize_t)size && body[i] == body_byte(i); i++)
+            ;
+
+        client->complete = size == client->size && i == (ssize_t)size;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+/* Running count concurrent clients for the path, returns how many of them
+ * read the whole body */
+static int fetch(const char *path, size_t size, int count)
+{
+    Client *clients = Calloc(count, sizeof(Client));
+    int i, complete = 0;
+    for (i = 0; i < count; i++)
+    {
+        clients[i].path = path;
+        clients[i].size = size;
+        Pthread_create(&clients[i].tid, NULL, client_thread, &clients[i]);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        Pthread_join(clients[i].tid, NULL);
+        complete += clients[i].complete;
+    }
+
+    free(clients);
+    return complete;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr, "usage: %s [-c <clients>] <proxy host> <proxy port>\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int clients = DEFAULT_CLIENTS;
+    int c;
+    while ((c = getopt(argc, argv, "c:")) != -1)
+    {
+        switch (c)
+        {
+        case 'c':
+            clients = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 2 || clients <= 0)
+        usage(argv[0]);
+
+    proxy_host = argv[optind];
+    proxy_port = argv[optind + 1];
+    Signal(SIGPIPE, SIG_IGN);
+
+    /* The origin listens on a port of the system's choice */
+    int listenfd;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+    if ((listenfd = open_listenfd("0")) < 0 ||
+        getsockname(listenfd, (struct sockaddr *)&addr, &addrlen) < 0)
+    {
+        fprintf(stderr, "Can't start the origin: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    origin_port = ntohs(addr.sin_port);
+    pthread_t tid;
+    Pthread_create(&tid, NULL, origin_thread, &listenfd);
+
+    /* The paths are new to the proxy's memory and disk caches on every run */
+    char fitting[MAXLINE], tight[MAXLINE];
+    long run = (long)time(NULL) * 100000 + getpid();
+    snprintf(fitting, MAXLINE, "/%d/fitting-%ld", FITTING_SIZE, run);
+    snprintf(tight, MAXLINE, "/%d/tight-%ld", TIGHT_SIZE, run);
+
+    int complete = fetch(fitting, FITTING_SIZE, clients);
+    long requests = origin_requests;
+    printf("Body of %d bytes: %d of %d clients complete, %ld origin requests\n", FITTING_SIZE,
+           complete, clients, requests);
+    check(complete == clients, "a shared fill reaches every client");
+    check(requests == 1, "concurrent requests share one fill");
+
+    complete = fetch(fitting, FITTING_SIZE, 1);
+    check(complete == 1 && origin_requests == requests, "the filled object is cached");
+
+    requests = origin_requests;
+    complete = fetch(tight, TIGHT_SIZE, clients);
+    printf("Body of %d bytes: %d of %d clients complete, %ld origin requests\n", TIGHT_SIZE,
+           complete, clients, origin_requests - requests);
+    check(complete == clients, "a body that fits only without its head reaches every client");
+
+    if (failures > 0)
+    {
+        printf("%d checks failed\n", failures);
+        return 1;
+    }
+
+    printf("All checks passed\n");
+    return 0;
+}
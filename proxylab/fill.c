@@ -0,0 +1,256 @@
+#include "fill.h"
+#include "hash.h"
+
+static void wake_waiters(Fill *fill);
+static void free_fill(Fill *fill);
+
+int fill_init(FillTable *table)
+{
+    memset(table->buckets, 0, sizeof(table->buckets));
+    if (Sem_init(&table->lock, 0, 1) < 0)
+        return -1;
+
+    return 0;
+}
+
+/* Joins the fill in flight for the key, or starts a new one if there is
+ * none, then created is set. Either way the caller holds a reference.
+ * Returns NULL if a new fill can't be allocated. */
+Fill *fill_start(FillTable *table, const char *key, int *created)
+{
+    unsigned int hash = hash_string(key);
+    Fill **bucket = &table->buckets[hash & (FILL_BUCKETS - 1)];
+    Fill *fill;
+    Sem_wait(&table->lock);
+    for (fill = *bucket; fill != NULL; fill = fill->next)
+    {
+        if (fill->hash == hash && !strcmp(fill->key, key))
+        {
+            fill->refs++;
+            Sem_post(&table->lock);
+            *created = 0;
+            return fill;
+        }
+    }
+
+    size_t key_size = strlen(key) + 1;
+    if ((fill = Calloc(1, sizeof(Fill) + key_size)) == NULL)
+    {
+        Sem_post(&table->lock);
+        return NULL;
+    }
+
+    fill->key = (char *)(fill + 1);
+    memcpy(fill->key, key, key_size);
+    fill->hash = hash;
+    fill->refs = 2;
+    fill->state = FILL_ACTIVE;
+    fill->next = *bucket;
+    *bucket = fill;
+    Sem_post(&table->lock);
+    *created = 1;
+    return fill;
+}
+
+/* Called by the filler before the first append once the response is known
+ * to fit in MAX_OBJECT_SIZE. Otherwise the readers don't send anything
+ * until the fill is done, since it may still be aborted halfway. */
+void fill_stream(Fill *fill)
+{
+    __atomic_store_n(&fill->stream, 1, __ATOMIC_RELEASE);
+}
+
+/* Called by the filler with the next response bytes. The segments grow
+ * as needed, the readers see the bytes once they are all copied.
+ * Returns -1 if the response outgrows MAX_OBJECT_SIZE or memory runs out,
+ * the caller is then expected to abort the fill. */
+int fill_append(FillTable *table, Fill *fill, const char *buf, size_t n)
+{
+    size_t length = fill->length;
+    if (length + n > MAX_OBJECT_SIZE)
+        return -1;
+
+    while (n > 0)
+    {
+        /* Starting a new segment once the last one is full */
+        size_t used = length % FILL_SEGMENT_SIZE;
+        if (used == 0)
+        {
+            FillSegment *segment;
+            if ((segment = Malloc(sizeof(FillSegment))) == NULL)
+                return -1;
+
+            segment->next = NULL;
+            if (fill->tail != NULL)
+                fill->tail->next = segment;
+            else
+                fill->head = segment;
+
+            fill->tail = segment;
+        }
+
+        size_t take = FILL_SEGMENT_SIZE - used < n ? FILL_SEGMENT_SIZE - used : n;
+        memcpy(fill->tail->data + used, buf, take);
+        buf += take;
+        n -= take;
+        length += take;
+    }
+
+    __atomic_store_n(&fill->length, length, __ATOMIC_RELEASE);
+    if (fill->stream)
+    {
+        Sem_wait(&table->lock);
+        wake_waiters(fill);
+        Sem_post(&table->lock);
+    }
+
+    return 0;
+}
+
+/* Called by the filler once the response is complete or has failed. The fill
+ * leaves the table, so the next request for the key starts a new one. */
+void fill_finish(FillTable *table, Fill *fill, int state)
+{
+    Sem_wait(&table->lock);
+    __atomic_store_n(&fill->state, state, __ATOMIC_RELEASE);
+    Fill **link = &table->buckets[fill->hash & (FILL_BUCKETS - 1)];
+    while (*link != fill)
+        link = &(*link)->next;
+
+    *link = fill->next;
+    wake_waiters(fill);
+    int refs = --fill->refs;
+    Sem_post(&table->lock);
+    if (refs == 0)
+        free_fill(fill);
+}
+
+/* Points data to the bytes available at the offset. Returns how many
+ * of them are contiguous, 0 if the reader has seen all of them. */
+size_t fill_read(Fill *fill, size_t offset, char **data)
+{
+    size_t length = __atomic_load_n(&fill->length, __ATOMIC_ACQUIRE);
+    if (offset >= length)
+        return 0;
+
+    FillSegment *segment = fill->head;
+    size_t start = offset - offset % FILL_SEGMENT_SIZE;
+    size_t i;
+    for (i = 0; i < start; i += FILL_SEGMENT_SIZE)
+        segment = segment->next;
+
+    size_t n = length - offset;
+    if (n > FILL_SEGMENT_SIZE - offset % FILL_SEGMENT_SIZE)
+        n = FILL_SEGMENT_SIZE - offset % FILL_SEGMENT_SIZE;
+
+    *data = segment->data + offset % FILL_SEGMENT_SIZE;
+    return n;
+}
+
+/* Returns the fill state. Reading it before fill_read guarantees that
+ * a finished fill has no bytes left past the ones fill_read returns. */
+int fill_state(Fill *fill)
+{
+    return __atomic_load_n(&fill->state, __ATOMIC_ACQUIRE);
+}
+
+/* Returns 1 if the readers may send the bytes as they arrive */
+int fill_streams(Fill *fill)
+{
+    return __atomic_load_n(&fill->stream, __ATOMIC_ACQUIRE);
+}
+
+/* Registers a reader that has seen offset bytes to be woken up by the
+ * next append it may stream or by the end of the fill. Returns 0 without
+ * registering if there is something to send already. */
+int fill_wait(FillTable *table, Fill *fill, size_t offset, FillWaiter *waiter)
+{
+    int wait = 0;
+    Sem_wait(&table->lock);
+    if (fill->state == FILL_ACTIVE && (!fill->stream || fill->length <= offset))
+    {
+        /* The reader may check again before it's woken up */
+        if (!waiter->waiting)
+        {
+            waiter->waiting = 1;
+            waiter->next = fill->waiters;
+            fill->waiters = waiter;
+        }
+
+        wait = 1;
+    }
+
+    Sem_post(&table->lock);
+    return wait;
+}
+
+/* Unregisters a reader that is going away, it won't be woken up afterwards */
+void fill_cancel(FillTable *table, Fill *fill, FillWaiter *waiter)
+{
+    Sem_wait(&table->lock);
+    FillWaiter **link;
+    for (link = &fill->waiters; *link != NULL; link = &(*link)->next)
+    {
+        if (*link == waiter)
+        {
+            *link = waiter->next;
+            waiter->waiting = 0;
+            break;
+        }
+    }
+
+    Sem_post(&table->lock);
+}
+
+/* Describes the bytes of a finished fill, iov must have room for
+ * FILL_MAX_SEGMENTS entries. Returns the number of entries used. */
+int fill_segments(Fill *fill, struct iovec *iov)
+{
+    size_t left = fill->length;
+    int count = 0;
+    FillSegment *segment;
+    for (segment = fill->head; segment != NULL && left > 0; segment = segment->next)
+    {
+        iov[count].iov_base = segment->data;
+        iov[count].iov_len = left < FILL_SEGMENT_SIZE ? left : FILL_SEGMENT_SIZE;
+        left -= iov[count].iov_len;
+        count++;
+    }
+
+    return count;
+}
+
+/* Dropping a reference to a fill, the last one frees it */
+void fill_release(FillTable *table, Fill *fill)
+{
+    Sem_wait(&table->lock);
+    int refs = --fill->refs;
+    Sem_post(&table->lock);
+    if (refs == 0)
+        free_fill(fill);
+}
+
+/* Handing all the registered readers back to their owners,
+ * called with the table lock held */
+static void wake_waiters(Fill *fill)
+{
+    while (fill->waiters != NULL)
+    {
+        FillWaiter *waiter = fill->waiters;
+        fill->waiters = waiter->next;
+        waiter->waiting = 0;
+        waiter->wake(waiter);
+    }
+}
+
+static void free_fill(Fill *fill)
+{
+    while (fill->head != NULL)
+    {
+        FillSegment *segment = fill->head;
+        fill->head = segment->next;
+        free(segment);
+    }
+
+    free(fill);
+}
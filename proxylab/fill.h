@@ -0,0 +1,75 @@
+#include <sys/uio.h>
+#include "csapp.h"
+#include "cache.h"
+
+/* Size of the blocks a response grows by while it's filled */
+#define FILL_SEGMENT_SIZE 16384
+#define FILL_MAX_SEGMENTS ((MAX_OBJECT_SIZE + FILL_SEGMENT_SIZE - 1) / FILL_SEGMENT_SIZE)
+
+/* Number of hash buckets of the in-flight table, a power of two */
+#define FILL_BUCKETS 256
+
+/* Fill states */
+#define FILL_ACTIVE 0  /* The response is still arriving */
+#define FILL_DONE 1    /* The whole response is in the segments */
+#define FILL_ABORTED 2 /* The response failed or outgrew MAX_OBJECT_SIZE */
+
+typedef struct fill_table FillTable;
+typedef struct fill Fill;
+typedef struct fill_segment FillSegment;
+typedef struct fill_waiter FillWaiter;
+
+/* Block of response bytes, segments never move once allocated */
+struct fill_segment
+{
+    FillSegment *next;
+    char data[FILL_SEGMENT_SIZE];
+};
+
+/* A reader that ran out of bytes. The wake callback is called
+ * under the table lock, so it must only hand the reader over. */
+struct fill_waiter
+{
+    void (*wake)(FillWaiter *waiter);
+    int waiting; /* In the waiters list of a fill */
+    FillWaiter *next;
+};
+
+/* Response being fetched for a cache key. The filler appends the bytes
+ * as they arrive and any number of readers stream them concurrently,
+ * or wait for the whole response unless its length is known to fit.
+ * The table holds one reference while the fill is in flight, the filler
+ * and every reader hold another one. */
+struct fill
+{
+    char *key;
+    unsigned int hash;
+    int refs;
+    int state;
+    int stream;    /* The readers may send the bytes before the fill is done */
+    size_t length; /* Published after the bytes are in the segments */
+    FillSegment *head;
+    FillSegment *tail;
+    FillWaiter *waiters;
+    Fill *next;
+};
+
+/* Responses in flight, one per cache key */
+struct fill_table
+{
+    sem_t lock;
+    Fill *buckets[FILL_BUCKETS];
+};
+
+int fill_init(FillTable *table);
+Fill *fill_start(FillTable *table, const char *key, int *created);
+void fill_stream(Fill *fill);
+int fill_append(FillTable *table, Fill *fill, const char *buf, size_t n);
+void fill_finish(FillTable *table, Fill *fill, int state);
+size_t fill_read(Fill *fill, size_t offset, char **data);
+int fill_state(Fill *fill);
+int fill_streams(Fill *fill);
+int fill_wait(FillTable *table, Fill *fill, size_t offset, FillWaiter *waiter);
+void fill_cancel(FillTable *table, Fill *fill, FillWaiter *waiter);
+int fill_segments(Fill *fill, struct iovec *iov);
+void fill_release(FillTable *table, Fill *fill);
@@ -0,0 +1,13 @@
+/* Hash of the string keys of the caches and tables, FNV-1a. The memory
+ * cache, the disk tier and the fill table index the same keys with it. */
+static inline unsigned int hash_string(const char *s)
+{
+    unsigned int hash = 2166136261u;
+    while (*s != '\0')
+    {
+        hash ^= (unsigned char)*s++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
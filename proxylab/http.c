@@ -0,0 +1,616 @@
+#include "http.h"
+
+static void request_line(Request *req, const char *buf, size_t start, size_t len);
+static void header_line(Request *req, const char *buf, size_t start, size_t len);
+static void split_uri(Request *req, const char *buf);
+static int header_kind(const char *name, size_t len);
+static int span_has_token(const char *value, size_t len, const char *token);
+static HttpSpan make_span(size_t off, size_t len);
+static size_t frame(Response *resp, const char *buf, size_t n, int head_only);
+static void end_line(Response *resp);
+static void end_headers(Response *resp);
+static void cache_control(Response *resp, const char *value);
+static long directive_seconds(const char *value, const char *name);
+static void copy_value(char *dst, size_t size, const char *value);
+
+void request_init(Request *req)
+{
+    memset(req, 0, offsetof(Request, headers));
+    req->state = REQUEST_LINE;
+}
+
+/* Parsing the complete lines among the first n bytes of buf that the
+ * previous calls haven't seen. buf holds the request from its start.
+ * Returns the state, the head is complete at REQUEST_DONE. */
+int request_parse(Request *req, const char *buf, size_t n)
+{
+    while (req->state < REQUEST_DONE && req->scanned < n)
+    {
+        const char *start = buf + req->pos;
+        const char *end = memchr(buf + req->scanned, '\n', n - req->scanned);
+        if (end == NULL)
+        {
+            req->scanned = n;
+            break;
+        }
+
+        /* The line without its LF or CRLF */
+        size_t len = end - start;
+        if (len > 0 && start[len - 1] == '\r')
+            len--;
+
+        if (req->state == REQUEST_LINE)
+            request_line(req, buf, req->pos, len);
+        else
+            header_line(req, buf, req->pos, len);
+
+        req->pos = req->scanned = end + 1 - buf;
+    }
+
+    return req->state;
+}
+
+/* Copying a span as a string, cut to size. Returns dst. */
+char *http_span_copy(char *dst, size_t size, const char *buf, HttpSpan span)
+{
+    size_t len = span.len < size ? span.len : size - 1;
+    memcpy(dst, buf + span.off, len);
+    dst[len] = '\0';
+    return dst;
+}
+
+/* Splitting the request line into the method, the URI and the version.
+ * Empty lines before it are skipped. */
+static void request_line(Request *req, const char *buf, size_t start, size_t len)
+{
+    if (len == 0)
+        return;
+
+    const char *line = buf + start;
+    const char *end = line + len;
+    const char *token[3];
+    size_t token_len[3];
+    const char *p = line;
+    int i;
+    for (i = 0; i < 3; i++)
+    {
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+
+        token[i] = p;
+        while (p < end && *p != ' ' && *p != '\t')
+            p++;
+
+        if ((token_len[i] = p - token[i]) == 0)
+        {
+            req->error = 400;
+            req->state = REQUEST_ERROR;
+            return;
+        }
+    }
+
+    req->line = make_span(start, len);
+    req->method = make_span(token[0] - buf, token_len[0]);
+    req->uri = make_span(token[1] - buf, token_len[1]);
+    req->version = make_span(token[2] - buf, token_len[2]);
+    split_uri(req, buf);
+
+    /* HTTP/1.1 connections are persistent unless the client asks to close */
+    req->keep_alive = token_len[2] == 8 && !strncasecmp(token[2], "HTTP/1.1", 8);
+    req->state = REQUEST_HEADERS;
+}
+
+/* Recording a header line and classifying it, the empty line ends the head */
+static void header_line(Request *req, const char *buf, size_t start, size_t len)
+{
+    if (len == 0)
+    {
+        req->state = REQUEST_DONE;
+        return;
+    }
+
+    const char *line = buf + start;
+    const char *colon = memchr(line, ':', len);
+    if (colon == NULL || colon == line || req->count == REQUEST_MAX_HEADERS)
+    {
+        req->error = colon == NULL || colon == line ? 400 : 413;
+        req->state = REQUEST_ERROR;
+        return;
+    }
+
+    const char *value = colon + 1;
+    const char *end = line + len;
+    while (value < end && (*value == ' ' || *value == '\t'))
+        value++;
+
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t'))
+        end--;
+
+    RequestHeader *header = &req->headers[req->count++];
+    header->line = make_span(start, len);
+    header->value = make_span(value - buf, end - value);
+    header->kind = header_kind(line, colon - line);
+    if (header->kind == HEADER_CONNECTION || header->kind == HEADER_PROXY_CONNECTION)
+    {
+        if (span_has_token(value, end - value, "close"))
+            req->keep_alive = 0;
+        else if (span_has_token(value, end - value, "keep-alive"))
+            req->keep_alive = 1;
+    }
+}
+
+/* Finding the host, the port and the path of an absolute URI. Duplicate
+ * slashes after the scheme and at the start of the path are skipped. */
+static void split_uri(Request *req, const char *buf)
+{
+    const char *uri = buf + req->uri.off;
+    const char *end = uri + req->uri.len;
+    const char *p = memchr(uri, ':', req->uri.len);
+    req->absolute = 0;
+    if (p == NULL || !((p - uri == 4 && !strncasecmp(uri, "http", 4)) ||
+                       (p - uri == 5 && !strncasecmp(uri, "https", 5))))
+        return;
+
+    p++;
+    while (p < end && *p == '/')
+        p++;
+
+    const char *host = p;
+    while (p < end && *p != ':' && *p != '/')
+        p++;
+
+    if (p == host || p == end)
+        return;
+
+    req->host = make_span(host - buf, p - host);
+    req->port = make_span(p - buf, 0);
+    if (*p == ':')
+    {
+        const char *port = ++p;
+        while (p < end && *p != '/')
+            p++;
+
+        if (p == end)
+            return;
+
+        req->port = make_span(port - buf, p - port);
+    }
+
+    while (p + 1 < end && p[1] == '/')
+        p++;
+
+    req->path = make_span(p - buf, end - p);
+    req->absolute = 1;
+}
+
+/* Telling the headers the proxy handles apart by their name */
+static int header_kind(const char *name, size_t len)
+{
+    switch (len)
+    {
+    case 4:
+        if (!strncasecmp(name, "Host", len))
+            return HEADER_HOST;
+        break;
+    case 10:
+        if (!strncasecmp(name, "User-Agent", len))
+            return HEADER_USER_AGENT;
+        if (!strncasecmp(name, "Connection", len))
+            return HEADER_CONNECTION;
+        if (!strncasecmp(name, "Keep-Alive", len))
+            return HEADER_KEEP_ALIVE;
+        break;
+    case 13:
+        if (!strncasecmp(name, "If-None-Match", len))
+            return HEADER_IF_NONE_MATCH;
+        break;
+    case 16:
+        if (!strncasecmp(name, "Proxy-Connection", len))
+            return HEADER_PROXY_CONNECTION;
+        break;
+    case 17:
+        if (!strncasecmp(name, "If-Modified-Since", len))
+            return HEADER_IF_MODIFIED_SINCE;
+        break;
+    }
+
+    return HEADER_OTHER;
+}
+
+/* Same as http_has_token, for a value that is not NUL-terminated */
+static int span_has_token(const char *value, size_t len, const char *token)
+{
+    size_t token_len = strlen(token);
+    size_t i;
+    for (i = 0; i + token_len <= len; i++)
+        if (!strncasecmp(value + i, token, token_len))
+            return 1;
+
+    return 0;
+}
+
+static HttpSpan make_span(size_t off, size_t len)
+{
+    HttpSpan span = {off, len};
+    return span;
+}
+
+void response_init(Response *resp)
+{
+    resp->state = RESPONSE_STATUS;
+    resp->status = 0;
+    resp->keep_alive = 0;
+    resp->chunked = 0;
+    resp->content_length = -1;
+    resp->remaining = 0;
+    resp->line_len = 0;
+    resp->no_store = 0;
+    resp->no_cache = 0;
+    resp->max_age = -1;
+    resp->s_maxage = -1;
+    resp->age = 0;
+    resp->date = 0;
+    resp->expires = -1;
+    resp->last_modified = 0;
+    resp->etag[0] = '\0';
+    resp->modified[0] = '\0';
+}
+
+/* Feeding the next n response bytes to the framer. Returns how many of
+ * them belong to the response, it's less than n only if the response
+ * ends inside the buffer. */
+size_t response_frame(Response *resp, const char *buf, size_t n)
+{
+    return frame(resp, buf, n, 0);
+}
+
+/* Same as response_frame, but stops right after the empty line ending
+ * the headers, so the caller knows where the body starts */
+size_t response_head(Response *resp, const char *buf, size_t n)
+{
+    return frame(resp, buf, n, 1);
+}
+
+/* Returns how many of the next response bytes are body data the framer
+ * only has to count, -1 if the body runs until the connection closes
+ * and 0 if the next bytes must go through response_frame */
+long response_raw(Response *resp)
+{
+    switch (resp->state)
+    {
+    case RESPONSE_BODY:
+    case RESPONSE_CHUNK_DATA:
+        return resp->remaining;
+    case RESPONSE_UNTIL_CLOSE:
+        return -1;
+    default:
+        return 0;
+    }
+}
+
+/* Checking if a complete response head may be stored and served to
+ * other clients. Error pages are only cached if they say for how long. */
+int response_cacheable(Response *resp)
+{
+    if (resp->no_store)
+        return 0;
+
+    switch (resp->status)
+    {
+    case 200:
+    case 203:
+    case 204:
+    case 300:
+    case 301:
+    case 308:
+        return 1;
+    case 404:
+    case 405:
+    case 410:
+    case 414:
+    case 501:
+        return resp->max_age >= 0 || resp->s_maxage >= 0 || resp->expires >= 0;
+    default:
+        return 0;
+    }
+}
+
+/* Returns the time a response received at now becomes stale. Cache-Control
+ * takes precedence over Expires, which is relative to the Date of the
+ * origin so their clocks don't have to agree. */
+time_t response_expires(Response *resp, time_t now)
+{
+    if (resp->no_cache)
+        return now;
+
+    time_t date = resp->date > 0 ? resp->date : now;
+    long lifetime;
+    if (resp->s_maxage >= 0)
+        lifetime = resp->s_maxage;
+    else if (resp->max_age >= 0)
+        lifetime = resp->max_age;
+    else if (resp->expires >= 0)
+        lifetime = resp->expires - date;
+    else if (resp->last_modified > 0 && resp->last_modified <= date)
+    {
+        lifetime = (date - resp->last_modified) / 10;
+        if (lifetime > HTTP_HEURISTIC_MAX)
+            lifetime = HTTP_HEURISTIC_MAX;
+    }
+    else
+        lifetime = HTTP_DEFAULT_TTL;
+
+    return now + lifetime - resp->age;
+}
+
+/* Counting n body bytes passed on without looking at them,
+ * n must not exceed the count returned by response_raw */
+void response_skip(Response *resp, size_t n)
+{
+    frame(resp, NULL, n, 0);
+}
+
+static size_t frame(Response *resp, const char *buf, size_t n, int head_only)
+{
+    size_t used = 0;
+    while (used < n && resp->state != RESPONSE_DONE)
+    {
+        if (head_only && resp->state > RESPONSE_HEADERS)
+            break;
+
+        switch (resp->state)
+        {
+        case RESPONSE_BODY:
+        case RESPONSE_CHUNK_DATA:
+        {
+            /* Skipping over the body bytes */
+            size_t take = n - used;
+            if ((long)take > resp->remaining)
+                take = resp->remaining;
+
+            used += take;
+            resp->remaining -= take;
+            if (resp->remaining == 0)
+                resp->state = resp->state == RESPONSE_BODY ? RESPONSE_DONE : RESPONSE_CHUNK_END;
+
+            break;
+        }
+        case RESPONSE_UNTIL_CLOSE:
+            used = n;
+            break;
+        default:
+        {
+            /* Collecting a line, the part that doesn't fit is dropped */
+            const char *start = buf + used;
+            const char *end = memchr(start, '\n', n - used);
+            size_t len = (end != NULL ? end + 1 : buf + n) - start;
+            size_t room = sizeof(resp->line) - 1 - resp->line_len;
+            memcpy(resp->line + resp->line_len, start, len < room ? len : room);
+            resp->line_len += len < room ? len : room;
+            used += len;
+            if (end != NULL)
+            {
+                resp->line[resp->line_len] = '\0';
+                end_line(resp);
+                resp->line_len = 0;
+            }
+        }
+        }
+    }
+
+    return used;
+}
+
+/* Handling a complete line in one of the line states */
+static void end_line(Response *resp)
+{
+    int empty = !strcmp(resp->line, "\r\n") || !strcmp(resp->line, "\n");
+    char *value;
+    switch (resp->state)
+    {
+    case RESPONSE_STATUS:
+    {
+        int major, minor;
+        if (sscanf(resp->line, "HTTP/%d.%d %d", &major, &minor, &resp->status) < 3)
+        {
+            /* Not an HTTP/1.x response, it can only end with the connection */
+            resp->keep_alive = 0;
+            resp->state = RESPONSE_UNTIL_CLOSE;
+            return;
+        }
+
+        /* HTTP/1.1 connections are persistent by default */
+        resp->keep_alive = major == 1 && minor >= 1;
+        resp->state = RESPONSE_HEADERS;
+        break;
+    }
+    case RESPONSE_HEADERS:
+        if (empty)
+            end_headers(resp);
+        else if ((value = http_header_value(resp->line, "Content-Length")) != NULL)
+            resp->content_length = strtol(value, NULL, 10);
+        else if ((value = http_header_value(resp->line, "Transfer-Encoding")) != NULL)
+            resp->chunked = http_has_token(value, "chunked");
+        else if ((value = http_header_value(resp->line, "Connection")) != NULL)
+        {
+            if (http_has_token(value, "close"))
+                resp->keep_alive = 0;
+            else if (http_has_token(value, "keep-alive"))
+                resp->keep_alive = 1;
+        }
+        else if ((value = http_header_value(resp->line, "Cache-Control")) != NULL)
+            cache_control(resp, value);
+        else if ((value = http_header_value(resp->line, "Age")) != NULL)
+        {
+            if ((resp->age = strtol(value, NULL, 10)) < 0)
+                resp->age = 0;
+        }
+        else if ((value = http_header_value(resp->line, "Date")) != NULL)
+            resp->date = http_parse_date(value);
+        else if ((value = http_header_value(resp->line, "Expires")) != NULL)
+            resp->expires = http_parse_date(value);
+        else if ((value = http_header_value(resp->line, "ETag")) != NULL)
+            copy_value(resp->etag, sizeof(resp->etag), value);
+        else if ((value = http_header_value(resp->line, "Last-Modified")) != NULL)
+        {
+            resp->last_modified = http_parse_date(value);
+            copy_value(resp->modified, sizeof(resp->modified), value);
+        }
+        break;
+    case RESPONSE_CHUNK_SIZE:
+        resp->remaining = strtol(resp->line, NULL, 16);
+        if (resp->remaining < 0)
+        {
+            resp->keep_alive = 0;
+            resp->state = RESPONSE_UNTIL_CLOSE;
+        }
+        else
+            resp->state = resp->remaining > 0 ? RESPONSE_CHUNK_DATA : RESPONSE_TRAILERS;
+        break;
+    case RESPONSE_CHUNK_END:
+        resp->state = RESPONSE_CHUNK_SIZE;
+        break;
+    case RESPONSE_TRAILERS:
+        if (empty)
+            resp->state = RESPONSE_DONE;
+        break;
+    }
+}
+
+/* Picking the body framing once all the headers are read */
+static void end_headers(Response *resp)
+{
+    if (resp->status >= 100 && resp->status < 200)
+    {
+        /* An interim response, the final one follows it */
+        response_init(resp);
+        return;
+    }
+
+    if (resp->status == 204 || resp->status == 304)
+        resp->state = RESPONSE_DONE;
+    else if (resp->chunked)
+        resp->state = RESPONSE_CHUNK_SIZE;
+    else if (resp->content_length >= 0)
+    {
+        resp->remaining = resp->content_length;
+        resp->state = resp->remaining > 0 ? RESPONSE_BODY : RESPONSE_DONE;
+    }
+    else
+    {
+        resp->keep_alive = 0;
+        resp->state = RESPONSE_UNTIL_CLOSE;
+    }
+}
+
+/* Picking the directives that decide if and for how long the response is
+ * cached. A header may be repeated, its directives add up. */
+static void cache_control(Response *resp, const char *value)
+{
+    if (http_has_token(value, "no-store") || http_has_token(value, "private"))
+        resp->no_store = 1;
+
+    if (http_has_token(value, "no-cache"))
+        resp->no_cache = 1;
+
+    long seconds;
+    if ((seconds = directive_seconds(value, "s-maxage")) >= 0)
+        resp->s_maxage = seconds;
+
+    if ((seconds = directive_seconds(value, "max-age")) >= 0)
+        resp->max_age = seconds;
+}
+
+/* Returns the seconds of a directive like max-age=60, -1 if the value
+ * doesn't have it */
+static long directive_seconds(const char *value, const char *name)
+{
+    size_t len = strlen(name);
+    for (; *value != '\0'; value++)
+    {
+        if (strncasecmp(value, name, len) || value[len] != '=')
+            continue;
+
+        value += len + 1;
+        if (*value == '"')
+            value++;
+
+        long seconds = strtol(value, NULL, 10);
+        return seconds > 0 ? seconds : 0;
+    }
+
+    return -1;
+}
+
+/* Copying a header value without the line end. A value that doesn't fit
+ * is left out, a cut validator would never match. */
+static void copy_value(char *dst, size_t size, const char *value)
+{
+    size_t len = strcspn(value, "\r\n");
+    while (len > 0 && (value[len - 1] == ' ' || value[len - 1] == '\t'))
+        len--;
+
+    if (len >= size)
+        len = 0;
+
+    memcpy(dst, value, len);
+    dst[len] = '\0';
+}
+
+/* Parsing an HTTP date in any of the three formats HTTP/1.1 allows:
+ * Sun, 06 Nov 1994 08:49:37 GMT, Sunday, 06-Nov-94 08:49:37 GMT and
+ * Sun Nov  6 08:49:37 1994. Returns 0 if the date is invalid. */
+time_t http_parse_date(const char *value)
+{
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    struct tm tm;
+    char month[4];
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(value, "%*[a-zA-Z], %d %3s %d %d:%d:%d", &tm.tm_mday, month, &tm.tm_year,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 &&
+        sscanf(value, "%*[a-zA-Z], %d-%3s-%d %d:%d:%d", &tm.tm_mday, month, &tm.tm_year,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6 &&
+        sscanf(value, "%*[a-zA-Z] %3s %d %d:%d:%d %d", month, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &tm.tm_year) != 6)
+        return 0;
+
+    char *found = strstr(months, month);
+    if (strlen(month) != 3 || found == NULL || (found - months) % 3 != 0)
+        return 0;
+
+    /* Two-digit years of the second format */
+    if (tm.tm_year < 70)
+        tm.tm_year += 2000;
+    else if (tm.tm_year < 100)
+        tm.tm_year += 1900;
+
+    tm.tm_mon = (found - months) / 3;
+    tm.tm_year -= 1900;
+    time_t t = timegm(&tm);
+    return t > 0 ? t : 0;
+}
+
+/* Returns the value of the header line if it's the named header, NULL otherwise */
+char *http_header_value(char *line, const char *name)
+{
+    size_t len = strlen(name);
+    if (strncasecmp(line, name, len) || line[len] != ':')
+        return NULL;
+
+    line += len + 1;
+    while (*line == ' ' || *line == '\t')
+        line++;
+
+    return line;
+}
+
+/* Checking if a header value contains the token */
+int http_has_token(const char *value, const char *token)
+{
+    size_t len = strlen(token);
+    for (; *value != '\0'; value++)
+        if (!strncasecmp(value, token, len))
+            return 1;
+
+    return 0;
+}
@@ -0,0 +1,125 @@
+#include <stddef.h>
+#include "csapp.h"
+
+/* Response framing states */
+#define RESPONSE_STATUS 0      /* Reading the status line */
+#define RESPONSE_HEADERS 1     /* Reading the header lines */
+#define RESPONSE_BODY 2        /* Reading a Content-Length body */
+#define RESPONSE_CHUNK_SIZE 3  /* Reading a chunk size line */
+#define RESPONSE_CHUNK_DATA 4  /* Reading the chunk data */
+#define RESPONSE_CHUNK_END 5   /* Reading the CRLF after the chunk data */
+#define RESPONSE_TRAILERS 6    /* Reading the trailer lines after the last chunk */
+#define RESPONSE_UNTIL_CLOSE 7 /* The body ends when the server closes the connection */
+#define RESPONSE_DONE 8
+
+/* Longest ETag or Last-Modified value kept to revalidate a response */
+#define HTTP_VALIDATOR_LEN 128
+
+/* Freshness lifetime of a response without an explicit one, a tenth of
+ * the time since it was last modified but at most HTTP_HEURISTIC_MAX
+ * seconds, or HTTP_DEFAULT_TTL seconds without a Last-Modified header */
+#define HTTP_HEURISTIC_MAX 86400
+#define HTTP_DEFAULT_TTL 60
+
+/* Request parsing states */
+#define REQUEST_LINE 0    /* Reading the request line */
+#define REQUEST_HEADERS 1 /* Reading the header lines */
+#define REQUEST_DONE 2    /* The empty line ending the head is read */
+#define REQUEST_ERROR 3   /* The head is malformed, error holds the status to answer with */
+
+/* Max number of header lines in a request */
+#define REQUEST_MAX_HEADERS 200
+
+/* Request headers the parser tells apart, any other is HEADER_OTHER */
+#define HEADER_OTHER 0
+#define HEADER_HOST 1
+#define HEADER_USER_AGENT 2
+#define HEADER_IF_NONE_MATCH 3
+#define HEADER_IF_MODIFIED_SINCE 4
+#define HEADER_CONNECTION 5 /* The hop-by-hop ones come last */
+#define HEADER_PROXY_CONNECTION 6
+#define HEADER_KEEP_ALIVE 7
+
+#define HEADER_HOP_BY_HOP(kind) ((kind) >= HEADER_CONNECTION)
+
+typedef struct response Response;
+typedef struct request Request;
+
+/* Part of a request head, as an offset from its start and a length.
+ * Heads are kept in buffers of less than 64 KB. */
+typedef struct http_span
+{
+    unsigned short off;
+    unsigned short len;
+} HttpSpan;
+
+typedef struct request_header
+{
+    HttpSpan line;  /* The whole line without its line end */
+    HttpSpan value; /* Without the whitespace around it */
+    int kind;
+} RequestHeader;
+
+/* Incremental single-pass parser of an HTTP/1.x request head. It never
+ * copies the bytes, the parts of the request are spans of the caller's
+ * buffer. Every call goes on where the last one stopped, so a head
+ * split across reads is only looked at once. */
+struct request
+{
+    int state;
+    int error;      /* 400 or 413 once the state is REQUEST_ERROR */
+    size_t pos;     /* Bytes of the head parsed so far */
+    size_t scanned; /* Bytes searched for the next line end */
+    HttpSpan line;  /* The request line without its line end */
+    HttpSpan method;
+    HttpSpan uri;
+    HttpSpan version;
+    int absolute;   /* The URI is http[s]://host[:port]/path */
+    HttpSpan host;
+    HttpSpan port;  /* Empty without a port */
+    HttpSpan path;  /* With a single leading slash */
+    int keep_alive; /* The client wants the connection kept open */
+    int count;
+    RequestHeader headers[REQUEST_MAX_HEADERS];
+};
+
+/* Incremental framing of an HTTP/1.x response. It only tracks where
+ * the response ends, whether the connection can carry another one and
+ * for how long the response may be cached, the bytes themselves are
+ * relayed untouched. */
+struct response
+{
+    int state;
+    int status;
+    int keep_alive;
+    int chunked;
+    long content_length; /* -1 if there is no Content-Length header */
+    long remaining;      /* Bytes left in the body or the current chunk */
+    char line[MAXLINE];  /* Current line, truncated if it's longer */
+    size_t line_len;
+    /* Caching headers */
+    int no_store;                      /* Cache-Control no-store or private */
+    int no_cache;                      /* Cache-Control no-cache, stale right away */
+    long max_age;                      /* Cache-Control max-age, -1 without it */
+    long s_maxage;                     /* Cache-Control s-maxage, -1 without it */
+    long age;                          /* Seconds the response spent in other caches */
+    time_t date;                       /* 0 without a valid Date header */
+    time_t expires;                    /* -1 without an Expires header, 0 if it's invalid */
+    time_t last_modified;              /* 0 without a valid Last-Modified header */
+    char etag[HTTP_VALIDATOR_LEN];     /* Empty without one that fits */
+    char modified[HTTP_VALIDATOR_LEN]; /* Last-Modified as sent, empty without one that fits */
+};
+
+void request_init(Request *req);
+int request_parse(Request *req, const char *buf, size_t n);
+char *http_span_copy(char *dst, size_t size, const char *buf, HttpSpan span);
+void response_init(Response *resp);
+size_t response_frame(Response *resp, const char *buf, size_t n);
+size_t response_head(Response *resp, const char *buf, size_t n);
+long response_raw(Response *resp);
+void response_skip(Response *resp, size_t n);
+int response_cacheable(Response *resp);
+time_t response_expires(Response *resp, time_t now);
+time_t http_parse_date(const char *value);
+char *http_header_value(char *line, const char *name);
+int http_has_token(const char *value, const char *token);
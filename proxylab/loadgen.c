@@ -0,0 +1,286 @@
+/*
+ * loadgen.c - Load generator for the proxy.
+ *     Opens <idle> connections to the proxy that never send a request
+ *     and keeps them open, then runs <clients> concurrent clients, each
+ *     sending GET requests for <url> through the proxy one after another
+ *     until <requests> responses in total have been read. Reports the
+ *     request rate and the latency percentiles. With -u every request
+ *     gets a unique query string, so none of them is a cache hit.
+ *     With -o every request picks one of <objects> query strings at random,
+ *     a working set of distinct cache keys for the same URL.
+ *     With -k every connection carries <per connection> HTTP/1.1 requests,
+ *     sent one at a time, or all at once if -p is given too.
+ *
+ *     usage: ./loadgen [-u | -o <objects>] [-k <per connection> [-p]] [-i <idle>]
+ *                      [-c <clients>] [-n <requests>] <proxy host> <proxy port> <url>
+ */
+#include <getopt.h>
+#include <sys/resource.h>
+#include "csapp.h"
+#include "http.h"
+
+#define DEFAULT_IDLE 0
+#define DEFAULT_CLIENTS 16
+#define DEFAULT_REQUESTS 10000
+
+/* Per-client state */
+typedef struct client
+{
+    pthread_t tid;
+    int id;
+    long requests;
+    long failures;
+    long bytes;
+    unsigned int seed;
+    double *latencies;
+} Client;
+
+static char *proxy_host;
+static char *proxy_port;
+static char *url;
+static int unique = 0;
+static int objects = 0;
+static int per_conn = 1;
+static int pipelined = 0;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr, "usage: %s [-u | -o <objects>] [-k <per connection> [-p]] [-i <idle>] [-c <clients>] "
+                    "[-n <requests>] <proxy host> <proxy port> <url>\n",
+            name);
+    exit(1);
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Formats the i-th request of the client, HTTP/1.0 unless
+ * the connection is reused. Returns its length. */
+static size_t make_request(char *request, Client *client, long i)
+{
+    int version = per_conn > 1;
+    if (unique)
+        return snprintf(request, MAXLINE, "GET %s?%d.%ld HTTP/1.%d\r\n\r\n", url, client->id, i, version);
+    else if (objects > 0)
+        return snprintf(request, MAXLINE, "GET %s?o%d HTTP/1.%d\r\n\r\n", url,
+                        rand_r(&client->seed) % objects, version);
+    else
+        return snprintf(request, MAXLINE, "GET %s HTTP/1.%d\r\n\r\n", url, version);
+}
+
+/* Reads the next response, the bytes past its end are left in buf.
+ * Returns the response size or -1. */
+static long read_response(int fd, char *buf, size_t *len)
+{
+    Response resp;
+    response_init(&resp);
+    long total = 0;
+    while (1)
+    {
+        size_t used = response_frame(&resp, buf, *len);
+        total += used;
+        *len -= used;
+        memmove(buf, buf + used, *len);
+        if (resp.state == RESPONSE_DONE)
+            return total;
+
+        ssize_t n;
+        if ((n = read(fd, buf + *len, MAXBUF - *len)) < 0)
+            return -1;
+
+        if (n == 0)
+            return resp.state == RESPONSE_UNTIL_CLOSE && total > 0 ? total : -1;
+
+        *len += n;
+    }
+}
+
+/* Sends count requests starting with the first-th one over a single
+ * connection and reads the responses, the latency of a pipelined
+ * request is counted from the moment the whole batch is sent */
+static void fetch(Client *client, long first, int count)
+{
+    char request[MAXLINE];
+    char buf[MAXBUF];
+    size_t len = 0;
+    int fd, k;
+    if ((fd = open_clientfd(proxy_host, proxy_port)) < 0)
+    {
+        client->failures += count;
+        return;
+    }
+
+    double start = now_ns();
+    if (pipelined)
+    {
+        for (k = 0; k < count; k++)
+        {
+            size_t request_len = make_request(request, client, first + k);
+            if (rio_writen(fd, request, request_len) != (ssize_t)request_len)
+                break;
+        }
+
+        start = now_ns();
+    }
+
+    for (k = 0; k < count; k++)
+    {
+        if (!pipelined)
+        {
+            start = now_ns();
+            size_t request_len = make_request(request, client, first + k);
+            if (rio_writen(fd, request, request_len) != (ssize_t)request_len)
+                break;
+        }
+
+        long n;
+        if ((n = read_response(fd, buf, &len)) < 0)
+            break;
+
+        client->bytes += n;
+        client->latencies[first + k] = now_ns() - start;
+    }
+
+    /* The requests without a response failed */
+    client->failures += count - k;
+    close(fd);
+}
+
+static void *client_thread(void *vargp)
+{
+    Client *client = vargp;
+    long i;
+    for (i = 0; i < client->requests; i += per_conn)
+        fetch(client, i, client->requests - i < per_conn ? client->requests - i : per_conn);
+
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    long idle = DEFAULT_IDLE;
+    int nclients = DEFAULT_CLIENTS;
+    long requests = DEFAULT_REQUESTS;
+    int c;
+    while ((c = getopt(argc, argv, "uo:k:pi:c:n:")) != -1)
+    {
+        switch (c)
+        {
+        case 'u':
+            unique = 1;
+            break;
+        case 'o':
+            objects = atoi(optarg);
+            break;
+        case 'k':
+            per_conn = atoi(optarg);
+            break;
+        case 'p':
+            pipelined = 1;
+            break;
+        case 'i':
+            idle = atol(optarg);
+            break;
+        case 'c':
+            nclients = atoi(optarg);
+            break;
+        case 'n':
+            requests = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc - 3 || idle < 0 || nclients <= 0 || requests < nclients || per_conn <= 0 ||
+        objects < 0 || (unique && objects > 0))
+        usage(argv[0]);
+
+    proxy_host = argv[optind];
+    proxy_port = argv[optind + 1];
+    url = argv[optind + 2];
+    if (strlen(url) > MAXLINE / 2)
+        usage(argv[0]);
+
+    /* The idle connections take a descriptor each */
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    /* Opening the idle connections */
+    int *idle_fds = Calloc(idle + 1, sizeof(int));
+    long i;
+    for (i = 0; i < idle; i++)
+    {
+        if ((idle_fds[i] = open_clientfd(proxy_host, proxy_port)) < 0)
+        {
+            fprintf(stderr, "Opened only %ld idle connections\n", i);
+            idle = i;
+            break;
+        }
+    }
+
+    /* Running the clients, every one takes an equal share of the requests */
+    Client *clients = Calloc(nclients, sizeof(Client));
+    double start = now_ns();
+    for (i = 0; i < nclients; i++)
+    {
+        clients[i].id = i;
+        clients[i].seed = i + 1;
+        clients[i].requests = requests / nclients;
+        clients[i].latencies = Calloc(clients[i].requests, sizeof(double));
+        if (Pthread_create(&clients[i].tid, NULL, client_thread, &clients[i]) != 0)
+            exit(1);
+    }
+
+    long done = 0, failures = 0, bytes = 0;
+    for (i = 0; i < nclients; i++)
+    {
+        Pthread_join(clients[i].tid, NULL);
+        done += clients[i].requests;
+        failures += clients[i].failures;
+        bytes += clients[i].bytes;
+    }
+
+    double elapsed = now_ns() - start;
+
+    /* Merging the latencies of all the clients */
+    double *latencies = Malloc(done * sizeof(double));
+    long k = 0;
+    for (i = 0; i < nclients; i++)
+    {
+        memcpy(latencies + k, clients[i].latencies, clients[i].requests * sizeof(double));
+        k += clients[i].requests;
+        free(clients[i].latencies);
+    }
+
+    qsort(latencies, done, sizeof(double), compare_doubles);
+    printf("Idle connections: %ld, clients: %d, requests per connection: %d%s\n", idle, nclients,
+           per_conn, pipelined ? " (pipelined)" : "");
+    printf("Requests: %ld, failed: %ld, %.1f MB read\n", done, failures, bytes / 1e6);
+    printf("Throughput: %.0f req/s, %.1f MB/s\n", done / elapsed * 1e9, bytes / elapsed * 1e3);
+    printf("Latency: p50 %.0f us, p90 %.0f us, p99 %.0f us, max %.0f us\n",
+           latencies[done / 2] / 1e3, latencies[done * 9 / 10] / 1e3,
+           latencies[done * 99 / 100] / 1e3, latencies[done - 1] / 1e3);
+
+    for (i = 0; i < idle; i++)
+        close(idle_fds[i]);
+
+    free(idle_fds);
+    free(latencies);
+    free(clients);
+    return 0;
+}
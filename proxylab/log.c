@@ -0,0 +1,233 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "log.h"
+
+static void *log_thread(void *vargp);
+static LogRing *thread_ring(void);
+static void release_ring(void *arg);
+static size_t collect(LogRing *ring, char *batch, size_t used);
+static void write_batch(const char *batch, size_t length);
+
+static int enabled = 0;
+static int log_fd = STDOUT_FILENO;
+static int flush_interval;
+/* Every ring ever claimed, rings are never freed */
+static LogRing *rings;
+static pthread_key_t ring_key;
+static __thread LogRing *local;
+/* Posted by a thread whose ring got half full, so the logger wakes up early */
+static sem_t half_full;
+
+/* Starting the logger thread. The log goes to stdout if path is NULL,
+ * otherwise it's appended to the file at path. */
+int log_start(const char *path, int flush_ms)
+{
+    if (path != NULL && (log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0)
+    {
+        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    flush_interval = flush_ms > 0 ? flush_ms : LOG_FLUSH_MS;
+    if (pthread_key_create(&ring_key, release_ring) != 0 || sem_init(&half_full, 0, 0) < 0)
+    {
+        fprintf(stderr, "Can't set up the log\n");
+        return -1;
+    }
+
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, log_thread, NULL) != 0)
+    {
+        fprintf(stderr, "Can't start the logger thread\n");
+        return -1;
+    }
+
+    enabled = 1;
+    return 0;
+}
+
+/* Tells whether the lines are written anywhere, so the callers can skip
+ * the work of collecting what they would log */
+int log_on(void)
+{
+    return enabled;
+}
+
+/* Formatting a line straight into the next record of the thread's ring,
+ * the newline is added by the logger */
+void log_printf(const char *fmt, ...)
+{
+    if (!enabled)
+        return;
+
+    LogRing *ring;
+    if ((ring = thread_ring()) == NULL)
+        return;
+
+    size_t head = ring->head;
+    size_t used = head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (used == LOG_RING_RECORDS)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    LogRecord *record = &ring->records[head & (LOG_RING_RECORDS - 1)];
+    clock_gettime(CLOCK_REALTIME, &record->time);
+    va_list ap;
+    va_start(ap, fmt);
+    int length = vsnprintf(record->text, LOG_TEXT_LEN, fmt, ap);
+    va_end(ap);
+    if (length < 0)
+        return;
+
+    record->length = length < LOG_TEXT_LEN ? length : LOG_TEXT_LEN - 1;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    if (used + 1 == LOG_RING_RECORDS / 2)
+        sem_post(&half_full);
+}
+
+/* Number of lines dropped so far */
+long log_dropped(void)
+{
+    long dropped = 0;
+    LogRing *ring;
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+        dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+    return dropped;
+}
+
+/* Collecting the records of all the rings once per flush interval */
+static void *log_thread(void *vargp)
+{
+    pthread_detach(pthread_self());
+    char *batch;
+    if ((batch = malloc(LOG_BATCH_SIZE)) == NULL)
+    {
+        fprintf(stderr, "Can't allocate the log batch\n");
+        exit(1);
+    }
+
+    while (1)
+    {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += flush_interval / 1000;
+        deadline.tv_nsec += (flush_interval % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+
+        while (sem_timedwait(&half_full, &deadline) < 0 && errno == EINTR)
+            ;
+
+        size_t used = 0;
+        LogRing *ring;
+        for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+            used = collect(ring, batch, used);
+
+        write_batch(batch, used);
+    }
+
+    return NULL;
+}
+
+/* Ring of the calling thread, claimed on its first line. Returns NULL
+ * if it can't be allocated, the lines of the thread are lost then. */
+static LogRing *thread_ring(void)
+{
+    if (local != NULL)
+        return local;
+
+    LogRing *ring;
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        int owned = 0;
+        if (__atomic_compare_exchange_n(&ring->owned, &owned, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (ring == NULL)
+    {
+        if ((ring = calloc(1, sizeof(LogRing))) == NULL)
+            return NULL;
+
+        ring->owned = 1;
+        ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_setspecific(ring_key, ring);
+    local = ring;
+    return ring;
+}
+
+/* Key destructor, run when a thread that logged exits */
+static void release_ring(void *arg)
+{
+    LogRing *ring = arg;
+    __atomic_store_n(&ring->owned, 0, __ATOMIC_RELEASE);
+}
+
+/* Appending the records of a ring to the batch as lines, the batch is
+ * written whenever it fills up. Returns the bytes left in the batch. */
+static size_t collect(LogRing *ring, char *batch, size_t used)
+{
+    static time_t last_second = -1;
+    static char stamp[32];
+    size_t tail = ring->tail;
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    for (; tail != head; tail++)
+    {
+        LogRecord *record = &ring->records[tail & (LOG_RING_RECORDS - 1)];
+        if (used + LOG_TEXT_LEN + 64 > LOG_BATCH_SIZE)
+        {
+            write_batch(batch, used);
+            used = 0;
+        }
+
+        /* The date only changes once a second */
+        if (record->time.tv_sec != last_second)
+        {
+            struct tm tm;
+            localtime_r(&record->time.tv_sec, &tm);
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+            last_second = record->time.tv_sec;
+        }
+
+        used += sprintf(batch + used, "%s.%06ld ", stamp, record->time.tv_nsec / 1000);
+        memcpy(batch + used, record->text, record->length);
+        used += record->length;
+        batch[used++] = '\n';
+    }
+
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    return used;
+}
+
+static void write_batch(const char *batch, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t n = write(log_fd, batch, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        else if (n < 0)
+            return;
+
+        batch += n;
+        length -= n;
+    }
+}
@@ -0,0 +1,47 @@
+#include <time.h>
+
+/* Asynchronous log, shared by the proxy and tiny and off unless log_start
+ * is called. Every thread formats its lines into fixed-size records of a
+ * ring of its own, without locks. A logger thread collects the records of
+ * all the rings once per flush interval, or sooner once a ring is half
+ * full, and appends them to the log with a single write per batch. A line
+ * that finds the ring of its thread full is dropped and counted. */
+
+/* Records per thread ring, a power of two */
+#define LOG_RING_RECORDS 2048
+
+/* Text of a record, longer lines are cut. A record is 256 bytes. */
+#define LOG_TEXT_LEN 236
+
+/* Default time between two collections */
+#define LOG_FLUSH_MS 100
+
+/* Bytes the logger writes at once, at most */
+#define LOG_BATCH_SIZE 65536
+
+typedef struct log_ring LogRing;
+
+typedef struct log_record
+{
+    struct timespec time;
+    unsigned int length;
+    char text[LOG_TEXT_LEN];
+} LogRecord;
+
+/* Written only by the thread owning it, head is advanced by the owner
+ * and tail by the logger. The ring of an exited thread goes to the next
+ * one that logs, with its records still in it. */
+struct log_ring
+{
+    size_t head __attribute__((aligned(64))); /* Next record to fill */
+    long dropped;
+    size_t tail __attribute__((aligned(64))); /* Next record to collect */
+    int owned;
+    LogRing *next;
+    LogRecord records[LOG_RING_RECORDS];
+};
+
+int log_start(const char *path, int flush_ms);
+int log_on(void);
+void log_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+long log_dropped(void);
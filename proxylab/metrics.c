@@ -0,0 +1,217 @@
+#include "metrics.h"
+
+static MetricsBlock *thread_block(void);
+static MetricsBlock *claim_block(void);
+static void release_block(void *arg);
+static int bucket_index(long value);
+static long bucket_max(int index);
+
+/* Names and help of the counters and histograms, in the order of their numbers */
+static const char *counter_names[METRIC_COUNTERS][2] = {
+    {"accepts_total", "Client connections accepted."},
+    {"requests_total", "Requests read from the clients."},
+    {"errors_total", "Error pages sent to the clients."},
+    {"cache_hits_total", "Lookups that found a memory cache entry."},
+    {"cache_misses_total", "Lookups that found no memory cache entry."},
+    {"cache_writes_total", "Entries added to the memory cache."},
+    {"cache_evictions_total", "Entries pushed out of the memory cache."},
+    {"origin_fetches_total", "Responses received in full from the origins."},
+    {"origin_bytes_total", "Bytes received from the origins for them."},
+    {"revalidations_total", "Conditional requests for stale entries."},
+    {"not_modified_total", "Stale entries the origins confirmed with a 304."},
+    {"bytes_saved_total", "Cached bytes the 304s did not download again."},
+};
+
+static const char *histogram_names[METRIC_HISTOGRAMS][2] = {
+    {"first_byte_seconds", "Time from the accept or the start of a request to its first byte sent."},
+    {"origin_fetch_seconds", "Time from the decision to fetch to the end of the origin response."},
+    {"cache_lookup_seconds", "Time of a cache lookup, with the disk tier on a memory miss."},
+};
+
+/* Every block ever claimed, blocks are never freed */
+static MetricsBlock *blocks;
+static pthread_key_t block_key;
+static __thread MetricsBlock *local;
+
+int metrics_init(void)
+{
+    /* Blocks go back to the list when their thread exits */
+    if (pthread_key_create(&block_key, release_block) != 0)
+    {
+        fprintf(stderr, "pthread_key_create error\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Adding n to a counter of the calling thread */
+void metrics_add(int counter, long n)
+{
+    MetricsBlock *block = thread_block();
+    __atomic_store_n(&block->counters[counter], block->counters[counter] + n, __ATOMIC_RELAXED);
+}
+
+/* Counting a latency of ns nanoseconds in a histogram of the calling thread */
+void metrics_record(int histogram, long ns)
+{
+    Histogram *hist = &thread_block()->histograms[histogram];
+    long *bucket = &hist->buckets[bucket_index(ns)];
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->sum, hist->sum + ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELAXED);
+}
+
+/* Monotonic time in nanoseconds */
+long metrics_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* Printing the sums over all the threads in the Prometheus text format,
+ * every name starting with prefix. Histograms list every bucket up to the
+ * highest one used so far. The counts never go back, so a bound printed
+ * once is printed by every later scrape. */
+void metrics_print(FILE *out, const char *prefix)
+{
+    char name[MAXLINE];
+    long counters[METRIC_COUNTERS] = {0};
+    Histogram *sums = Calloc(METRIC_HISTOGRAMS, sizeof(Histogram));
+    if (sums == NULL)
+        return;
+
+    MetricsBlock *block;
+    for (block = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); block != NULL; block = block->next)
+    {
+        int i, j;
+        for (i = 0; i < METRIC_COUNTERS; i++)
+            counters[i] += __atomic_load_n(&block->counters[i], __ATOMIC_RELAXED);
+
+        for (i = 0; i < METRIC_HISTOGRAMS; i++)
+        {
+            Histogram *hist = &block->histograms[i];
+            sums[i].count += __atomic_load_n(&hist->count, __ATOMIC_RELAXED);
+            sums[i].sum += __atomic_load_n(&hist->sum, __ATOMIC_RELAXED);
+            for (j = 0; j < HIST_BUCKETS; j++)
+                sums[i].buckets[j] += __atomic_load_n(&hist->buckets[j], __ATOMIC_RELAXED);
+        }
+    }
+
+    int i, j;
+    for (i = 0; i < METRIC_COUNTERS; i++)
+    {
+        snprintf(name, MAXLINE, "%s%s", prefix, counter_names[i][0]);
+        metrics_print_value(out, name, "counter", counter_names[i][1], counters[i]);
+    }
+
+    for (i = 0; i < METRIC_HISTOGRAMS; i++)
+    {
+        snprintf(name, MAXLINE, "%s%s", prefix, histogram_names[i][0]);
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, histogram_names[i][1], name);
+
+        /* The buckets are cumulative and le is inclusive. The count is taken
+         * from them, so the lines agree even if a thread records in the middle
+         * of the scrape. The last bucket also holds every larger value, only
+         * +Inf covers it. */
+        int top = HIST_BUCKETS - 1;
+        while (top > 0 && sums[i].buckets[top] == 0)
+            top--;
+
+        long count = 0;
+        for (j = 0; j <= top; j++)
+        {
+            count += sums[i].buckets[j];
+            if (j < HIST_BUCKETS - 1)
+                fprintf(out, "%s_bucket{le=\"%.9g\"} %ld\n", name, bucket_max(j) / 1e9, count);
+        }
+
+        fprintf(out, "%s_bucket{le=\"+Inf\"} %ld\n", name, count);
+        fprintf(out, "%s_sum %.9f\n", name, sums[i].sum / 1e9);
+        fprintf(out, "%s_count %ld\n", name, count);
+    }
+
+    free(sums);
+}
+
+/* Printing a single counter or gauge */
+void metrics_print_value(FILE *out, const char *name, const char *type, const char *help, double value)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+    if (value == (long)value)
+        fprintf(out, "%s %ld\n", name, (long)value);
+    else
+        fprintf(out, "%s %.9g\n", name, value);
+}
+
+/* Block of the calling thread, claimed on its first update */
+static MetricsBlock *thread_block(void)
+{
+    if (local == NULL && (local = claim_block()) == NULL)
+    {
+        fprintf(stderr, "Can't allocate the metrics of a thread\n");
+        exit(1);
+    }
+
+    return local;
+}
+
+/* Taking the block of an exited thread, or adding a new one. The counts
+ * of the exited thread stay in it, so the sums never go back. */
+static MetricsBlock *claim_block(void)
+{
+    MetricsBlock *block;
+    for (block = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); block != NULL; block = block->next)
+    {
+        int owned = 0;
+        if (__atomic_compare_exchange_n(&block->owned, &owned, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (block == NULL)
+    {
+        if ((block = Calloc(1, sizeof(MetricsBlock))) == NULL)
+            return NULL;
+
+        block->owned = 1;
+        block->next = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&blocks, &block->next, block, 1,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_setspecific(block_key, block);
+    return block;
+}
+
+/* Key destructor, run when a thread that used its block exits */
+static void release_block(void *arg)
+{
+    MetricsBlock *block = arg;
+    __atomic_store_n(&block->owned, 0, __ATOMIC_RELEASE);
+}
+
+/* Bucket of a value, see HIST_BUCKETS */
+static int bucket_index(long value)
+{
+    if (value < HIST_SUB)
+        return value > 0 ? value : 0;
+
+    int msb = 63 - __builtin_clzl(value);
+    if (msb >= HIST_MAX_BITS)
+        return HIST_BUCKETS - 1;
+
+    int shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)(value >> shift) - HIST_SUB;
+}
+
+/* Largest value of a bucket */
+static long bucket_max(int index)
+{
+    if (index < HIST_SUB)
+        return index;
+
+    int shift = index / HIST_SUB - 1;
+    return ((long)(index % HIST_SUB + HIST_SUB + 1) << shift) - 1;
+}
@@ -0,0 +1,62 @@
+#include <stdio.h>
+#include "csapp.h"
+
+/* Counters and latency histograms. Every thread updates a block of its
+ * own with plain stores, so nothing on the serving path takes a lock or
+ * an atomic read-modify-write. A scrape sums the blocks of all the
+ * threads, the block of an exited thread goes to the next one started. */
+
+/* Counters */
+#define METRIC_ACCEPTS 0         /* Client connections accepted */
+#define METRIC_REQUESTS 1        /* Requests read from the clients */
+#define METRIC_ERRORS 2          /* Error pages sent to the clients */
+#define METRIC_CACHE_HITS 3      /* Lookups that found a memory cache entry */
+#define METRIC_CACHE_MISSES 4    /* Lookups that didn't */
+#define METRIC_CACHE_WRITES 5    /* Entries added to the memory cache */
+#define METRIC_CACHE_EVICTIONS 6 /* Entries the eviction policy pushed out */
+#define METRIC_FETCHES 7         /* Responses received in full from the origins */
+#define METRIC_FETCH_BYTES 8     /* Bytes received for them */
+#define METRIC_REVALIDATIONS 9   /* Conditional requests for stale entries */
+#define METRIC_NOT_MODIFIED 10   /* Stale entries the origin confirmed with a 304 */
+#define METRIC_BYTES_SAVED 11    /* Cached bytes the 304s didn't download again */
+#define METRIC_COUNTERS 12
+
+/* Latency histograms, in nanoseconds */
+#define METRIC_FIRST_BYTE 0   /* From the accept, or the start of a later request, to the first byte sent */
+#define METRIC_FETCH_TIME 1   /* From the decision to fetch to the end of the origin response */
+#define METRIC_LOOKUP_TIME 2  /* Memory cache lookups, with the disk tier if they miss */
+#define METRIC_HISTOGRAMS 3
+
+/* Histogram buckets in the HDR layout. Values below HIST_SUB get a bucket
+ * each, every power of two above is split into HIST_SUB buckets, so a
+ * bucket is never wider than 1/HIST_SUB of its lower bound. Values from
+ * 2^HIST_MAX_BITS ns, about 18 minutes, count in the last bucket. */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct metrics_block MetricsBlock;
+
+typedef struct histogram
+{
+    long count;
+    long sum;
+    long buckets[HIST_BUCKETS];
+} Histogram;
+
+/* Written only by the thread owning it, read by the scrapes */
+struct metrics_block
+{
+    long counters[METRIC_COUNTERS];
+    Histogram histograms[METRIC_HISTOGRAMS];
+    int owned;
+    MetricsBlock *next;
+} __attribute__((aligned(64)));
+
+int metrics_init(void);
+void metrics_add(int counter, long n);
+void metrics_record(int histogram, long ns);
+long metrics_now(void);
+void metrics_print(FILE *out, const char *prefix);
+void metrics_print_value(FILE *out, const char *name, const char *type, const char *help, double value);
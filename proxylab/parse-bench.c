@@ -0,0 +1,339 @@
+/*
+ * parse-bench.c - Request parsing microbenchmark.
+ *     Parses the same request heads over and over and reports requests
+ *     per second for the single-pass request_parse and, for comparison,
+ *     the way the proxy used to do it: sscanf of the request line, a
+ *     copying URI parser, a malloc per header line and strstr over every
+ *     header to find the ones it replaces. Every head is parsed once as
+ *     a whole and once arriving in <read size> byte reads.
+ *
+ *     usage: ./parse-bench [-n <requests>] [-r <read size>]
+ */
+#include <getopt.h>
+#include "http.h"
+
+#define DEFAULT_REQUESTS 1000000
+#define DEFAULT_READ_SIZE 64
+
+/* Limits of the previous parser */
+#define MAX_HOSTNAME_LEN 256
+#define MAX_PORT_LEN 6
+#define MAX_QUERY_LEN 2048
+#define MAX_HEADERS_NUMBER 200
+
+typedef struct uri_info
+{
+    char hostname[MAX_HOSTNAME_LEN];
+    char port[MAX_PORT_LEN];
+    char query[MAX_QUERY_LEN];
+} Uri_info;
+
+typedef struct headers
+{
+    int cout;
+    char *data[MAX_HEADERS_NUMBER];
+} Headers;
+
+static const char *heads[] = {
+    "GET http://localhost:8080/home.html HTTP/1.0\r\n\r\n",
+    "GET http://localhost:8080/home.html HTTP/1.1\r\n"
+    "Host: localhost:8080\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "Proxy-Connection: Keep-Alive\r\n\r\n",
+    "GET http://www.example.com/static/js/app.3f9a1c.js?v=20240101 HTTP/1.1\r\n"
+    "Host: www.example.com\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:121.0) Gecko/20100101 Firefox/121.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Referer: http://www.example.com/index.html\r\n"
+    "Cookie: session=4f1c2d3e4f5a6b7c8d9e0f1a2b3c4d5e; theme=dark; consent=1\r\n"
+    "DNT: 1\r\n"
+    "Proxy-Connection: keep-alive\r\n"
+    "If-None-Match: \"5f3a-1c2b3d4e\"\r\n"
+    "If-Modified-Since: Mon, 01 Jan 2024 00:00:00 GMT\r\n"
+    "Cache-Control: max-age=0\r\n\r\n",
+};
+
+static const char *names[] = {"minimal", "curl", "browser"};
+
+/* The previous URI parser, copying through a MAXLINE buffer */
+static int parse_uri(const char *uri, Uri_info *uri_info)
+{
+    char buf[MAXLINE];
+    char *index = buf;
+    while (*uri != ':')
+    {
+        if (*uri == '\0')
+            return -1;
+
+        *index++ = *uri++;
+    }
+
+    *index = '\0';
+    if (strcasecmp(buf, "http") && strcasecmp(buf, "https"))
+        return -1;
+
+    uri++;
+    while (*uri == '/')
+        uri++;
+
+    index = buf;
+    while (*uri != ':' && *uri != '/')
+    {
+        if (*uri == '\0')
+            return -1;
+
+        *index++ = *uri++;
+    }
+
+    *index = '\0';
+    size_t hostname_len = strlen(buf) + 1;
+    if (hostname_len > MAX_HOSTNAME_LEN)
+        return -1;
+
+    memcpy(uri_info->hostname, buf, hostname_len);
+    index = buf;
+    if (*uri == ':')
+    {
+        uri++;
+        while (*uri != '/')
+        {
+            if (*uri == '\0')
+                return -1;
+
+            *index++ = *uri++;
+        }
+
+        *index = '\0';
+        size_t port_len = strlen(buf) + 1;
+        if (port_len > MAX_PORT_LEN)
+            return -1;
+
+        memcpy(uri_info->port, buf, port_len);
+    }
+    else
+        strcpy(uri_info->port, "80");
+
+    uri++;
+    while (*uri == '/')
+        uri++;
+
+    uri--;
+    index = buf;
+    while (*uri != '\0')
+        *index++ = *uri++;
+
+    *index = '\0';
+    size_t query_len = strlen(buf) + 1;
+    if (query_len > MAX_QUERY_LEN)
+        return -1;
+
+    memcpy(uri_info->query, buf, query_len);
+    return 0;
+}
+
+/* The previous header parser, a malloc per line */
+static int parse_headers(char *buf, Headers *headers)
+{
+    headers->cout = 0;
+    char *line_end;
+    while (strncmp(buf, "\r\n", 2) && (line_end = strstr(buf, "\r\n")) != NULL)
+    {
+        if (headers->cout >= MAX_HEADERS_NUMBER)
+            return -1;
+
+        size_t line_len = line_end - buf + 2;
+        char *header = Malloc(line_len + 1);
+        memcpy(header, buf, line_len);
+        header[line_len] = '\0';
+        headers->data[headers->cout++] = header;
+        buf += line_len;
+    }
+
+    return 0;
+}
+
+/* The previous request handling up to the headers to forward. Returns
+ * the number of forwarded headers, -1 if the request is not complete. */
+static int old_parse(char *in)
+{
+    char *end;
+    if ((end = strstr(in, "\r\n\r\n")) == NULL)
+        return -1;
+
+    char buf[MAXLINE];
+    char *line_end = strstr(in, "\r\n");
+    size_t line_len = line_end - in + 2;
+    memcpy(buf, in, line_len);
+    buf[line_len] = '\0';
+
+    char method[MAXLINE];
+    char uri[MAXLINE];
+    char version[MAXLINE];
+    if (sscanf(buf, "%s %s %s", method, uri, version) < 3)
+        return 0;
+
+    Uri_info uri_info;
+    Headers headers;
+    if (parse_uri(uri, &uri_info) < 0 || parse_headers(line_end + 2, &headers) < 0)
+        return 0;
+
+    /* Keep-alive and the headers the proxy replaces */
+    int keep_alive = !strcasecmp(version, "HTTP/1.1");
+    int host_in_headers = 0;
+    int forwarded = 0;
+    int i;
+    for (i = 0; i < headers.cout; i++)
+    {
+        char *value;
+        if ((value = http_header_value(headers.data[i], "Connection")) != NULL ||
+            (value = http_header_value(headers.data[i], "Proxy-Connection")) != NULL)
+        {
+            if (http_has_token(value, "close"))
+                keep_alive = 0;
+            else if (http_has_token(value, "keep-alive"))
+                keep_alive = 1;
+        }
+
+        if (!host_in_headers && strstr(headers.data[i], "Host:"))
+            host_in_headers = 1;
+        else if (strstr(headers.data[i], "User-Agent:") ||
+                 strstr(headers.data[i], "Connection:") ||
+                 strstr(headers.data[i], "Proxy-Connection") ||
+                 strstr(headers.data[i], "Keep-Alive:"))
+            continue;
+
+        forwarded++;
+    }
+
+    for (i = 0; i < headers.cout; i++)
+        free(headers.data[i]);
+
+    return forwarded + keep_alive;
+}
+
+/* The same result from request_parse */
+static int new_parse(Request *req, const char *in, size_t n)
+{
+    if (request_parse(req, in, n) != REQUEST_DONE)
+        return -1;
+
+    int forwarded = 0;
+    int i;
+    for (i = 0; i < req->count; i++)
+        if (req->headers[i].kind != HEADER_USER_AGENT && !HEADER_HOP_BY_HOP(req->headers[i].kind))
+            forwarded++;
+
+    return forwarded + req->keep_alive;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Returns the requests parsed per second. With a read size, the head
+ * grows by that many bytes between the attempts to parse it, as it
+ * would coming from a socket. */
+static double run(int parser, const char *head, long requests, size_t read_size)
+{
+    char in[MAXLINE];
+    size_t len = strlen(head);
+    Request *req = Malloc(sizeof(Request));
+    long parsed = 0;
+    double start = now_ns();
+    long i;
+    for (i = 0; i < requests; i++)
+    {
+        size_t copied = 0;
+        size_t have = read_size > 0 && read_size < len ? read_size : len;
+        int result;
+        request_init(req);
+        while (1)
+        {
+            memcpy(in + copied, head + copied, have - copied);
+            in[have] = '\0';
+            copied = have;
+            result = parser ? new_parse(req, in, have) : old_parse(in);
+            if (result >= 0 || have == len)
+                break;
+
+            have = have + read_size < len ? have + read_size : len;
+        }
+
+        parsed += result >= 0;
+    }
+
+    double elapsed = now_ns() - start;
+    free(req);
+    if (parsed != requests)
+    {
+        fprintf(stderr, "Only %ld of %ld requests parsed\n", parsed, requests);
+        exit(1);
+    }
+
+    return requests / elapsed * 1e9;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr, "usage: %s [-n <requests>] [-r <read size>]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    long requests = DEFAULT_REQUESTS;
+    long read_size = DEFAULT_READ_SIZE;
+    int c;
+    while ((c = getopt(argc, argv, "n:r:")) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            requests = atol(optarg);
+            break;
+        case 'r':
+            read_size = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc || requests <= 0 || read_size <= 0)
+        usage(argv[0]);
+
+    /* Both parsers must agree before they are timed */
+    int i;
+    for (i = 0; i < (int)(sizeof(heads) / sizeof(heads[0])); i++)
+    {
+        char in[MAXLINE];
+        Request req;
+        strcpy(in, heads[i]);
+        request_init(&req);
+        if (old_parse(in) != new_parse(&req, in, strlen(in)))
+        {
+            fprintf(stderr, "Parsers disagree on the %s request\n", names[i]);
+            exit(1);
+        }
+    }
+
+    printf("%ld requests per run, reads of %ld bytes\n", requests, read_size);
+    printf("request  bytes   old whole      new whole    old reads      new reads  (requests/sec)\n");
+    for (i = 0; i < (int)(sizeof(heads) / sizeof(heads[0])); i++)
+    {
+        printf("%-8s %5zu", names[i], strlen(heads[i]));
+        printf(" %11.0f", run(0, heads[i], requests, 0));
+        printf("  %13.0f", run(1, heads[i], requests, 0));
+        printf("  %11.0f", run(0, heads[i], requests, read_size));
+        printf("  %13.0f\n", run(1, heads[i], requests, read_size));
+        fflush(stdout);
+    }
+
+    return 0;
+}
@@ -0,0 +1,289 @@
+/*
+ * parse-fuzz.c - Fuzzer of the request parser.
+ *     Every input is parsed as a whole and again one byte at a time, as
+ *     if every byte came with its own read. Both must end in the same
+ *     state with the same spans, and every span must lie inside the
+ *     parsed part of the input. The inputs are the files given as
+ *     arguments and, with -m, that many random mutations of them.
+ *     The first failing input is written to crash-<n>.
+ *
+ *     Built with -DLIBFUZZER it's a libFuzzer target instead, with the
+ *     files in fuzz/request as its seed corpus.
+ *
+ *     usage: ./parse-fuzz [-m <mutations>] [-s <seed>] <file>...
+ */
+#include <getopt.h>
+#include <stdint.h>
+#include "http.h"
+
+/* Inputs larger than the proxy's request buffer are cut */
+#define MAX_INPUT_SIZE (MAXLINE - 1)
+
+/* Mutations applied to a corpus entry at a time, at most */
+#define MAX_MUTATIONS 4
+
+/* Byte sequences that drive the parser into its corners */
+static const char *tokens[] = {
+    "\r\n", "\n", "\r\n\r\n", ":", " ", "\t", "/", "//", "http://", "https://",
+    "GET ", " HTTP/1.1", " HTTP/1.0", "Host: ", "Connection: close",
+    "Proxy-Connection: keep-alive", "Keep-Alive: 5", "User-Agent: ",
+    "If-None-Match: ", "If-Modified-Since: ", ":8080",
+};
+
+typedef struct input
+{
+    char *data;
+    size_t size;
+} Input;
+
+static Request whole;
+static Request split;
+static long states[4];
+
+static int span_inside(HttpSpan span, size_t end)
+{
+    return (size_t)span.off + span.len <= end;
+}
+
+/* Parsing one input both ways. Returns 0 if the results agree and
+ * make sense, -1 otherwise. */
+static int check(const char *data, size_t size)
+{
+    if (size > MAX_INPUT_SIZE)
+        size = MAX_INPUT_SIZE;
+
+    /* An exact copy, so reading past the end shows up under a sanitizer */
+    char *buf = Malloc(size + 1);
+    memcpy(buf, data, size);
+
+    request_init(&whole);
+    request_parse(&whole, buf, size);
+    request_init(&split);
+    size_t n;
+    for (n = 0; n <= size; n++)
+        request_parse(&split, buf, n);
+
+    int ok = 1;
+    if (memcmp(&whole, &split, offsetof(Request, headers)) ||
+        memcmp(whole.headers, split.headers, whole.count * sizeof(RequestHeader)))
+        ok = 0;
+
+    /* The spans lie in the lines parsed so far, without a line end */
+    Request *req = &whole;
+    size_t end = req->pos;
+    if (req->pos > size || (req->state == REQUEST_ERROR && req->error != 400 && req->error != 413))
+        ok = 0;
+
+    if (req->state >= REQUEST_HEADERS && req->state != REQUEST_ERROR &&
+        (!span_inside(req->line, end) || memchr(buf + req->line.off, '\n', req->line.len) ||
+         !span_inside(req->method, end) || !span_inside(req->uri, end) ||
+         !span_inside(req->version, end) || req->method.len == 0 || req->uri.len == 0))
+        ok = 0;
+
+    if (req->absolute && (!span_inside(req->host, end) || !span_inside(req->port, end) ||
+                          !span_inside(req->path, end) || req->host.len == 0 ||
+                          req->path.len == 0 || buf[req->path.off] != '/'))
+        ok = 0;
+
+    int i;
+    for (i = 0; i < req->count && ok; i++)
+    {
+        RequestHeader *header = &req->headers[i];
+        if (!span_inside(header->line, end) || !span_inside(header->value, end) ||
+            memchr(buf + header->line.off, '\n', header->line.len) ||
+            header->value.off < header->line.off ||
+            header->value.off + header->value.len > header->line.off + header->line.len)
+            ok = 0;
+    }
+
+    if (req->state == REQUEST_DONE && (req->pos == 0 || buf[req->pos - 1] != '\n'))
+        ok = 0;
+
+    states[req->state]++;
+    free(buf);
+    return ok ? 0 : -1;
+}
+
+#ifdef LIBFUZZER
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (check((const char *)data, size) < 0)
+        abort();
+
+    return 0;
+}
+#else
+static uint64_t rng_state;
+
+/* xorshift64* */
+static uint64_t next_random(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+static size_t random_below(size_t n)
+{
+    return n > 0 ? next_random() % n : 0;
+}
+
+/* Inserting len bytes at pos, as far as they fit */
+static size_t insert_bytes(char *buf, size_t size, size_t pos, const char *bytes, size_t len)
+{
+    if (size + len > MAX_INPUT_SIZE)
+        len = MAX_INPUT_SIZE - size;
+
+    memmove(buf + pos + len, buf + pos, size - pos);
+    memcpy(buf + pos, bytes, len);
+    return size + len;
+}
+
+/* Changing a copy of a corpus entry in a few random ways */
+static size_t mutate(char *buf, Input *corpus, int count)
+{
+    Input *base = &corpus[random_below(count)];
+    size_t size = base->size < MAX_INPUT_SIZE ? base->size : MAX_INPUT_SIZE;
+    memcpy(buf, base->data, size);
+    int rounds = 1 + random_below(MAX_MUTATIONS);
+    while (rounds-- > 0)
+    {
+        size_t pos = random_below(size + 1);
+        size_t len = 1 + random_below(16);
+        switch (random_below(6))
+        {
+        case 0: /* Flipping a byte */
+            if (size > 0)
+                buf[random_below(size)] ^= 1 << random_below(8);
+            break;
+        case 1: /* A random byte */
+        {
+            char byte = next_random();
+            size = insert_bytes(buf, size, pos, &byte, 1);
+            break;
+        }
+        case 2: /* A token */
+        {
+            const char *token = tokens[random_below(sizeof(tokens) / sizeof(tokens[0]))];
+            size = insert_bytes(buf, size, pos, token, strlen(token));
+            break;
+        }
+        case 3: /* Dropping a range */
+            if (pos + len > size)
+                len = size - pos;
+            memmove(buf + pos, buf + pos + len, size - pos - len);
+            size -= len;
+            break;
+        case 4: /* Repeating a range */
+            if (pos + len > size)
+                len = size - pos;
+            {
+                char range[16];
+                memcpy(range, buf + pos, len);
+                size = insert_bytes(buf, size, pos, range, len);
+            }
+            break;
+        default: /* A part of another entry */
+        {
+            Input *other = &corpus[random_below(count)];
+            size_t from = random_below(other->size);
+            size_t take = random_below(other->size - from + 1);
+            size = insert_bytes(buf, size, pos, other->data + from, take);
+        }
+        }
+    }
+
+    return size;
+}
+
+static int read_input(const char *path, Input *input)
+{
+    FILE *file;
+    if ((file = fopen(path, "rb")) == NULL)
+    {
+        fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    input->data = Malloc(MAX_INPUT_SIZE);
+    input->size = fread(input->data, 1, MAX_INPUT_SIZE, file);
+    fclose(file);
+    return 0;
+}
+
+static void save_crash(const char *data, size_t size, long n)
+{
+    char path[MAXLINE];
+    snprintf(path, MAXLINE, "crash-%ld", n);
+    FILE *file;
+    if ((file = fopen(path, "wb")) != NULL)
+    {
+        fwrite(data, 1, size, file);
+        fclose(file);
+    }
+
+    fprintf(stderr, "Input %ld failed, written to %s\n", n, path);
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr, "usage: %s [-m <mutations>] [-s <seed>] <file>...\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    long mutations = 0;
+    rng_state = 88172645463325252ULL;
+    int c;
+    while ((c = getopt(argc, argv, "m:s:")) != -1)
+    {
+        switch (c)
+        {
+        case 'm':
+            mutations = atol(optarg);
+            break;
+        case 's':
+            rng_state = strtoull(optarg, NULL, 10) | 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind == argc || mutations < 0)
+        usage(argv[0]);
+
+    int count = argc - optind;
+    Input *corpus = Calloc(count, sizeof(Input));
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        if (read_input(argv[optind + i], &corpus[i]) < 0)
+            exit(1);
+
+        if (check(corpus[i].data, corpus[i].size) < 0)
+        {
+            fprintf(stderr, "Corpus entry %s failed\n", argv[optind + i]);
+            exit(1);
+        }
+    }
+
+    char *buf = Malloc(MAX_INPUT_SIZE);
+    long n;
+    for (n = 0; n < mutations; n++)
+    {
+        size_t size = mutate(buf, corpus, count);
+        if (check(buf, size) < 0)
+        {
+            save_crash(buf, size, n);
+            exit(1);
+        }
+    }
+
+    printf("%ld inputs: %ld complete, %ld malformed, %ld incomplete\n", count + mutations,
+           states[REQUEST_DONE], states[REQUEST_ERROR], states[REQUEST_LINE] + states[REQUEST_HEADERS]);
+    return 0;
+}
+#endif
@@ -1,64 +1,384 @@
 #include <stdio.h>
+#include <stddef.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
 #include "csapp.h"
 #include "sbuf.h"
-#include "cache.h"
-
-/* Max size of a cacheable request */
-#define MAX_OBJECT_SIZE 102400
+#include "disk.h"
+#include "dns.h"
+#include "fill.h"
+#include "hash.h"
+#include "http.h"
+#include "log.h"
+#include "metrics.h"
+#include "splice.h"
 
 /* HTTP requset line limits */
 #define MAX_HOSTNAME_LEN 256
 #define MAX_PORT_LEN 6
 #define MAX_QUERY_LEN 2048
-
-/* HTTP max header limit */
-#define MAX_HEADERS_NUMBER 200
-
-/* Thread pool constants */
-#define NTHREADS 4
-#define SBUFSIZE 16
+#define MAX_KEY_LEN (MAX_HOSTNAME_LEN + MAX_PORT_LEN + MAX_QUERY_LEN)
+
+/* Resolver pool constants. The pool grows while lookups queue up
+ * behind busy resolvers and shrinks back as they sit idle. While the
+ * lookups are slow, it keeps one idle resolver spare. */
+#define RESOLVERS_MIN 2
+#define RESOLVERS_MAX 64
+#define RESOLVER_IDLE_TIMEOUT 10 /* Seconds a resolver above the minimum waits before it exits */
+#define RESOLVER_SLOW_US 20000   /* Average lookup time from which lookups are slow */
+#define RESOLVER_AVG_WEIGHT 8    /* The average moves by 1/8 of the difference to every lookup */
+#define SBUFSIZE 16              /* Default capacity of the lookup buffer */
+
+/* Entries evicted from the memory cache waiting for the disk writer,
+ * a loop evicting while the queue is full doesn't wait, the entry is
+ * not written */
+#define SPILL_QUEUE 256
+
+/* Memory cache misses waiting for the disk loader, a miss that finds the
+ * queue full goes to the origin */
+#define LOAD_QUEUE 256
+
+/* Max number of events handled per epoll_wait call */
+#define MAX_EVENTS 256
+
+/* Pieces the upstream request is gathered from. A header line of the
+ * client takes two if it doesn't end in CRLF, the rest fit in 16. */
+#define REQUEST_PIECES (2 * REQUEST_MAX_HEADERS + 16)
+
+/* Upstream connection pool constants */
+#define POOL_MAX_IDLE 8       /* Default cap of idle connections per origin and loop */
+#define POOL_IDLE_TIMEOUT 15  /* Seconds before an idle connection is closed */
+#define ORIGIN_BUCKETS 64     /* Origin hash buckets per loop, a power of two */
+#define MAX_ORIGIN_LEN (MAX_HOSTNAME_LEN + MAX_PORT_LEN + 1)
 
 /* Task required proxy headers */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *connection_hdr = "Connection: close\r\n";
 static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
+/* Upstream headers when the connection goes back to the pool,
+ * also sent to the clients whose connections stay open */
+static const char *keep_alive_hdr = "Connection: keep-alive\r\n";
+/* Parts of the upstream request around the strings it takes from elsewhere */
+static const char *crlf = "\r\n";
 
+/* Origin of a request, as strings for the name lookup */
 typedef struct uri_info
 {
     char hostname[MAX_HOSTNAME_LEN];
     char port[MAX_PORT_LEN];
-    char query[MAX_QUERY_LEN];
 } Uri_info;
 
-typedef struct headers
+/* Size and load of the resolver pool, updated atomically */
+typedef struct resolver_pool
 {
-    int cout;
-    char *data[MAX_HEADERS_NUMBER];
-} Headers;
-
-static void proxy(int fd);
-static int parse_headers(rio_t *rp, Headers *headers);
-static int parse_uri(const char *uri, Uri_info *uri_info);
-static void forward(int fd, Uri_info *uri_info, Headers *headers);
-static void clear_headers(Headers *headers);
-static void *thread(void *vargp);
-static int build_cache_key(char key[], size_t length, Uri_info *uri_info);
-static void clienterror(int fd, char *cause, char *errnum, char *shortmsg, char *longmsg);
-static void servererror(int fd);
+    int min;
+    int max;
+    int threads;     /* Running resolvers */
+    int active;      /* Resolvers busy with a lookup */
+    long lookups;    /* Lookups done */
+    long blocked_us; /* Time spent in them */
+    long recent_us;  /* Moving average of the lookup time, updates may race */
+    long grown;      /* Resolvers started above the minimum */
+    long shrunk;     /* Resolvers that exited */
+} ResolverPool;
+
+typedef struct loop Loop;
+typedef struct conn Conn;
+typedef struct upstream Upstream;
+typedef struct origin Origin;
+
+/* Connection states */
+#define READ_REQUEST 0 /* Reading the request line and the headers */
+#define RESOLVING 1    /* Waiting for the resolver pool */
+#define LOADING 2      /* Waiting for the disk loader */
+#define CONNECTING 3   /* Waiting for the upstream connect to complete */
+#define SEND_REQUEST 4 /* Writing the request to the upstream */
+#define RELAY 5        /* Relaying the response from the upstream to the client */
+#define WRITE_HIT 6    /* Writing a cached entry to the client */
+#define WRITE_ERROR 7  /* Writing an error page to the client */
+#define STREAM_FILL 8  /* Streaming a response another connection is fetching */
+#define CLOSED 9       /* Waiting to be freed at the end of the event batch */
+
+/* A descriptor registered in an epoll set. The conn is NULL for the
+ * listening socket, the resolver notifications and idle upstreams. */
+typedef struct endpoint
+{
+    int fd;
+    Conn *conn;
+} Endpoint;
 
-/* Thread safe buffer */
+/* Connection to an origin server. It stays registered in the loop
+ * epoll set while it waits in the pool for the next request. */
+struct upstream
+{
+    Endpoint endpoint; /* Must be the first member, idle events are cast back */
+    Origin *origin;    /* Pool the connection is idle in */
+    time_t idle_since;
+    Upstream *prev;
+    Upstream *next;
+};
+
+/* Idle upstream connections to one hostname and port, most recently used first */
+struct origin
+{
+    char name[MAX_ORIGIN_LEN];
+    int idle;
+    Upstream *head;
+    Upstream *tail;
+    Origin *next;
+};
+
+/* One event loop per thread, every loop accepts on its own
+ * SO_REUSEPORT listening socket and owns its connections */
+struct loop
+{
+    pthread_t tid;
+    int epfd;
+    Endpoint listener;
+    Endpoint notifier;
+    /* Connections with a finished name lookup, queued by the resolvers,
+     * connections whose disk lookup is done, queued by the disk loader,
+     * and fill readers with new bytes to stream, queued by the fillers */
+    sem_t pending_lock;
+    Conn *resolved;
+    Conn *loaded;
+    Conn *woken;
+    /* Lookups that didn't fit in the resolver buffer, oldest first */
+    Conn *backlog;
+    Conn *backlog_tail;
+    /* Connections and upstreams closed during the current event batch */
+    Conn *closed;
+    Upstream *dropped;
+    /* Upstream connection pool */
+    Origin *origins[ORIGIN_BUCKETS];
+    time_t last_sweep;
+};
+
+/* Per-connection state machine. Every event on either descriptor
+ * advances it as far as it gets without blocking. */
+struct conn
+{
+    int state;
+    Loop *loop;
+    Endpoint client;
+    Upstream *upstream;
+    int reused;     /* The upstream came from the pool */
+    int keep_alive; /* The client connection stays open after the response */
+    /* Start of the current request, until its first byte is sent, and
+     * of its fetch from the origin, in metrics_now nanoseconds */
+    long started;
+    long fetch_started;
+    /* Start of the cache lookup, which may go on in the disk loader */
+    long lookup_started;
+    /* Request line and headers read from the client, pipelined
+     * requests wait after the current one. The parsed request
+     * points into them. */
+    char in[MAXLINE];
+    size_t in_len;
+    size_t request_len;
+    Request req;
+    Uri_info uri_info;
+    char key[MAX_KEY_LEN];
+    /* Upstream addresses from the DNS cache and the one being tried */
+    DnsEntry *dns;
+    struct addrinfo *addr;
+    /* Request written to the upstream, gathered from the head of the
+     * client, the validators of the stale entry and fixed strings, and
+     * the first piece not written in full */
+    struct iovec *request;
+    int request_count;
+    int request_next;
+    /* Pending output to the client, the status line,
+     * the Connection header and the rest of the response */
+    struct iovec out[3];
+    int out_count;
+    char *buf;
+    size_t buf_len;
+    CacheNode *hit;
+    /* Stale entry pinned while the origin is asked if it's still valid,
+     * and the freshness of the response being fetched */
+    CacheNode *stale;
+    CacheMeta meta;
+    /* Pipe moving the body bytes that are not cached, and
+     * the number of them waiting in it for the client */
+    int pipe[2];
+    size_t piped;
+    /* Upstream response framing */
+    Response *response;
+    long received;
+    /* Response shared by the requests for the same key. The connection
+     * either fetches it or, in STREAM_FILL, streams it from the filler. */
+    Fill *fill;
+    size_t fill_off;
+    FillWaiter waiter;
+    int woken; /* Queued in the woken list of the loop */
+    /* Link in the resolved, loaded, woken or closed list of the loop */
+    Conn *next;
+};
+
+static void *event_loop(void *vargp);
+static void *resolver(void *vargp);
+static void *disk_writer(void *vargp);
+static void *disk_loader(void *vargp);
+static int load_entry(void *arg, const void *meta, size_t meta_size, const struct iovec *iov, int iovcnt);
+static int start_resolver(void);
+static void grow_resolvers(Loop *loop);
+static int shrink_resolvers(void);
+static void log_resolvers(const char *event);
+static int open_loop_listenfd(char *port);
+static void accept_conns(Loop *loop);
+static void notify_resolved(Conn *conn);
+static void notify_loaded(Conn *conn);
+static void wake_reader(FillWaiter *waiter);
+static void wake_loop(Loop *loop);
+static void take_pending(Loop *loop);
+static void advance(Conn *conn);
+static int read_request(Conn *conn);
+static int handle_request(Conn *conn);
+static int serve_hit(Conn *conn);
+static int serve_metrics(Conn *conn);
+static void print_metrics(FILE *out);
+static int finish_lookup(Conn *conn, int cacheable, CacheNode *item);
+static int finish_load(Conn *conn);
+static void spill_to_disk(void *arg, CacheNode *item);
+static int fetch_response(Conn *conn);
+static int resolve(Conn *conn);
+static void queue_lookup(Conn *conn);
+static void flush_backlog(Loop *loop);
+static int connect_resolved(Conn *conn);
+static int stream_fill(Conn *conn);
+static void drop_fill(Conn *conn);
+static int start_connect(Conn *conn);
+static int finish_connect(Conn *conn);
+static int start_request(Conn *conn);
+static int send_request(Conn *conn);
+static int relay(Conn *conn);
+static int retry_request(Conn *conn);
+static int serve_revalidated(Conn *conn);
+static void set_meta(CacheMeta *meta, Response *resp);
+static int write_out(Conn *conn);
+static int drain_pipe(Conn *conn);
+static int open_pipe(Conn *conn);
+static void finish_response(Conn *conn);
+static void end_upstream(Conn *conn);
+static void end_response(Conn *conn);
+static void next_request(Conn *conn);
+static void queue_output(Conn *conn, char *data, size_t length, int head);
+static size_t strip_hop_headers(char *head, size_t length);
+static void close_conn(Conn *conn);
+static Upstream *pool_take(Loop *loop, Uri_info *uri_info);
+static void pool_put(Loop *loop, Uri_info *uri_info, Upstream *upstream);
+static void pool_remove(Loop *loop, Upstream *upstream);
+static void pool_check(Loop *loop, Upstream *upstream);
+static void pool_sweep(Loop *loop, time_t now);
+static void drop_upstream(Loop *loop, Upstream *upstream);
+static unsigned int origin_bucket(const char *name);
+static int build_request(Conn *conn, CacheMeta *validators, struct iovec *iov);
+static int add_piece(struct iovec *iov, int count, const char *data, size_t length);
+static int build_cache_key(Conn *conn);
+static int clienterror(Conn *conn, char *cause, char *errnum, char *shortmsg, char *longmsg);
+static int servererror(Conn *conn);
+static void usage(char *name);
+
+/* Name lookup requests for the resolver pool */
 static sbuf_t sbuf;
+static ResolverPool resolvers = {RESOLVERS_MIN, RESOLVERS_MAX};
 /* Local proxy cache */
 static Cache cache;
+/* Disk tier below it, holding what the memory cache evicts */
+static DiskCache disk;
+static int use_disk = 0;
+/* Evicted entries on their way to the disk writer, and the ones dropped
+ * because it fell behind. Memory cache misses on their way to the disk
+ * loader. */
+static sbuf_t spills;
+static long spills_dropped = 0;
+static sbuf_t loads;
+/* Name lookup results shared by all the loops */
+static DnsCache dns;
+/* Responses being fetched, shared by all the loops */
+static FillTable fills;
+/* Port all the loops listen on */
+static char *listen_port;
+/* Idle upstream connections kept per origin and loop, 0 disables pooling */
+static int pool_max_idle = POOL_MAX_IDLE;
 
 int main(int argc, char **argv)
 {
-    if (argc != 2)
+    /* Parsing command line options */
+    int policy = CACHE_LRU;
+    int nloops = sysconf(_SC_NPROCESSORS_ONLN);
+    int sbuf_size = SBUFSIZE;
+    char *disk_dir = NULL;
+    char *log_path = NULL;
+    int flush_ms = LOG_FLUSH_MS;
+    size_t disk_size = DISK_SIZE;
+    int c;
+    int verbose = 0;
+    while ((c = getopt(argc, argv, "c:d:f:l:o:p:q:r:s:v")) != -1)
     {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
+        switch (c)
+        {
+        case 'c':
+            if (!strcasecmp(optarg, "lru"))
+                policy = CACHE_LRU;
+            else if (!strcasecmp(optarg, "clock"))
+                policy = CACHE_CLOCK;
+            else
+                usage(argv[0]);
+            break;
+        case 'd':
+            disk_dir = optarg;
+            break;
+        case 'f':
+            if ((flush_ms = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'l':
+            if ((nloops = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'o':
+            log_path = optarg;
+            verbose = 1;
+            break;
+        case 'p':
+            if ((pool_max_idle = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'q':
+            if ((sbuf_size = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'r':
+            if (sscanf(optarg, "%d:%d", &resolvers.min, &resolvers.max) != 2 ||
+                resolvers.min <= 0 || resolvers.max < resolvers.min)
+                usage(argv[0]);
+            break;
+        case 's':
+            if (atol(optarg) <= 0)
+                usage(argv[0]);
+            disk_size = (size_t)atol(optarg) << 20;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
     }
 
+    if (optind != argc - 1)
+        usage(argv[0]);
+
+    listen_port = argv[optind];
+    if (nloops <= 0)
+        nloops = 1;
+
     /* Blocking SIGPIPE signal */
     /* SIGPIPE signal will be send by write() when
      *  the connection socket closes prematurely.
@@ -73,459 +393,1927 @@ int main(int argc, char **argv)
     if (Sigprocmask(SIG_BLOCK, &mask, NULL) < 0)
         exit(1);
 
-    /* Creatin listening socket */
-    int listenfd;
-    if ((listenfd = Open_listenfd(argv[1])) < 0)
+    /* Every connection takes up to two descriptors,
+     * so the soft limit is raised as far as allowed */
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    /* Counters and histograms, and the log if it's asked for */
+    if (metrics_init() < 0)
+        exit(1);
+
+    if (verbose && log_start(log_path, flush_ms) < 0)
+        exit(1);
+
+    /* Creating resolver pool */
+    if (sbuf_init(&sbuf, sbuf_size) < 0)
+        exit(1);
+
+    if (cache_init(&cache, policy) < 0)
         exit(1);
 
-    /* Creating thread pool */
-    if (sbuf_init(&sbuf, SBUFSIZE) < 0)
+    /* Opening the disk tier, the index is rebuilt from the segment files */
+    if (disk_dir != NULL)
+    {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        if (disk_open(&disk, disk_dir, disk_size) < 0)
+            exit(1);
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        log_printf("Disk cache %s: %zu objects, %zu bytes, indexed in %.1f ms", disk_dir, disk.count,
+                   disk.bytes, (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+        pthread_t tid;
+        if (sbuf_init(&spills, SPILL_QUEUE) < 0 || Pthread_create(&tid, NULL, disk_writer, &disk) != 0)
+            exit(1);
+
+        if (sbuf_init(&loads, LOAD_QUEUE) < 0 || Pthread_create(&tid, NULL, disk_loader, &disk) != 0)
+            exit(1);
+
+        cache_set_spill(&cache, spill_to_disk, &spills);
+        use_disk = 1;
+    }
+
+    if (fill_init(&fills) < 0)
         exit(1);
 
-    if (cache_init(&cache) < 0)
+    if (dns_init(&dns, NULL, DNS_TTL, DNS_NEGATIVE_TTL) < 0)
         exit(1);
 
     int i;
-    pthread_t tid;
-    for (i = 0; i < NTHREADS; i++)
-        if (Pthread_create(&tid, NULL, thread, NULL) != 0)
+    for (i = 0; i < resolvers.min; i++)
+    {
+        resolvers.threads++;
+        if (start_resolver() < 0)
             exit(1);
+    }
 
-    struct sockaddr_storage clientaddr;
-    socklen_t clientlen = sizeof(clientaddr);
-    int connfd;
-    while (1)
+    /* Creating event loops, the main thread runs the last one */
+    Loop *loops;
+    if ((loops = Calloc(nloops, sizeof(Loop))) == NULL)
+        exit(1);
+
+    for (i = 0; i < nloops; i++)
     {
-        if ((connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen)) < 0)
-            continue;
+        Loop *loop = &loops[i];
+        if ((loop->epfd = epoll_create1(0)) < 0)
+        {
+            unix_error("epoll_create1 error");
+            exit(1);
+        }
 
-        /* Logging client info */
-        char client_host[MAXLINE];
-        char port[MAXLINE];
-        Getnameinfo((SA *)&clientaddr, clientlen, client_host, MAXLINE, port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", client_host, port);
-        /* Adding request to the buffer */
-        if (sbuf_insert(&sbuf, connfd) < 0)
+        if ((loop->listener.fd = open_loop_listenfd(listen_port)) < 0)
+            exit(1);
+
+        if ((loop->notifier.fd = eventfd(0, EFD_NONBLOCK)) < 0)
+        {
+            unix_error("eventfd error");
+            exit(1);
+        }
+
+        if (Sem_init(&loop->pending_lock, 0, 1) < 0)
+            exit(1);
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLET;
+        event.data.ptr = &loop->listener;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listener.fd, &event) < 0)
+            exit(1);
+
+        event.data.ptr = &loop->notifier;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->notifier.fd, &event) < 0)
+            exit(1);
+
+        if (i < nloops - 1 && Pthread_create(&loop->tid, NULL, event_loop, loop) != 0)
             exit(1);
     }
 
+    event_loop(&loops[nloops - 1]);
     return 0;
 }
 
-static void *thread(void *vargp)
+static void *event_loop(void *vargp)
+{
+    Loop *loop = vargp;
+    struct epoll_event events[MAX_EVENTS];
+    while (1)
+    {
+        /* Waking up at least once a second to close expired idle upstreams */
+        int n;
+        if ((n = epoll_wait(loop->epfd, events, MAX_EVENTS, 1000)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            unix_error("epoll_wait error");
+            exit(1);
+        }
+
+        int i;
+        for (i = 0; i < n; i++)
+        {
+            Endpoint *endpoint = events[i].data.ptr;
+            if (endpoint == &loop->listener)
+                accept_conns(loop);
+            else if (endpoint == &loop->notifier)
+                take_pending(loop);
+            else if (endpoint->conn == NULL)
+                pool_check(loop, (Upstream *)endpoint);
+            else if (endpoint->conn->state != CLOSED)
+                advance(endpoint->conn);
+        }
+
+        flush_backlog(loop);
+        time_t now = time(NULL);
+        if (now != loop->last_sweep)
+        {
+            pool_sweep(loop, now);
+            loop->last_sweep = now;
+        }
+
+        /* Freeing connections and upstreams closed in this batch,
+         * later events of the batch could still point to them */
+        while (loop->closed != NULL)
+        {
+            Conn *conn = loop->closed;
+            loop->closed = conn->next;
+            free(conn);
+        }
+
+        while (loop->dropped != NULL)
+        {
+            Upstream *upstream = loop->dropped;
+            loop->dropped = upstream->next;
+            free(upstream);
+        }
+    }
+
+    return NULL;
+}
+
+/* Resolver pool thread. getaddrinfo blocks, so the loops hand
+ * the name lookups over to these threads through sbuf. */
+static void *resolver(void *vargp)
 {
     if (Pthread_detach(pthread_self()) != 0)
         exit(1);
 
-    int connfd;
+    void *item;
     while (1)
     {
-        /* Dequeuing a request from the buffer */
-        if (sbuf_remove(&sbuf, &connfd) < 0)
+        /* Dequeuing a lookup from the buffer, the resolvers above
+         * the minimum exit once they run out of lookups for a while */
+        int status;
+        if ((status = sbuf_timedremove(&sbuf, &item, RESOLVER_IDLE_TIMEOUT * 1000)) < 0)
             exit(1);
+        else if (status == 0)
+        {
+            if (shrink_resolvers())
+                return NULL;
+
+            continue;
+        }
 
-        /* Request pipeline */
-        proxy(connfd);
-        Close(connfd);
+        __atomic_add_fetch(&resolvers.active, 1, __ATOMIC_RELAXED);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        Conn *conn = item;
+        conn->dns = dns_resolve(&dns, conn->uri_info.hostname, conn->uri_info.port);
+        if (conn->dns != NULL && conn->dns->status != 0)
+            log_printf("getaddrinfo failed (%s:%s): %s", conn->uri_info.hostname,
+                       conn->uri_info.port, gai_strerror(conn->dns->status));
+
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        long blocked = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_nsec - start.tv_nsec) / 1000;
+        __atomic_add_fetch(&resolvers.blocked_us, blocked, __ATOMIC_RELAXED);
+        long recent = __atomic_load_n(&resolvers.recent_us, __ATOMIC_RELAXED);
+        __atomic_store_n(&resolvers.recent_us, recent + (blocked - recent) / RESOLVER_AVG_WEIGHT,
+                         __ATOMIC_RELAXED);
+        __atomic_add_fetch(&resolvers.lookups, 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&resolvers.active, 1, __ATOMIC_RELAXED);
+        notify_resolved(conn);
     }
+
+    return NULL;
 }
 
-/* This is the main request pipeline routine.
- * It gets a connected socket descriptor. Parses the request,
- * sends a proxy request to the requested server and
- * forwards the response back to the client. */
-static void proxy(int fd)
+/* Writes the entries evicted by the loops to the disk tier, so that no
+ * loop waits for the disk. Every entry comes with the reference the
+ * memory cache held. */
+static void *disk_writer(void *vargp)
 {
-    rio_t rio;
-    Rio_readinitb(&rio, fd);
-    char buf[MAXLINE];
-    /* Reading an HTTP request line from the connected socket */
-    if (Rio_readlineb(&rio, buf, MAXLINE) < 0)
-    {
-        servererror(fd);
-        return;
-    }
+    if (Pthread_detach(pthread_self()) != 0)
+        exit(1);
 
-    char method[MAXLINE];
-    char uri[MAXLINE];
-    char version[MAXLINE];
-    if (sscanf(buf, "%s %s %s", method, uri, version) == EOF)
+    DiskCache *disk = vargp;
+    void *item;
+    while (1)
     {
-        clienterror(fd, "", "400", "Bad request",
-                    "Request is empty");
-        return;
+        if (sbuf_remove(&spills, &item) < 0)
+            exit(1);
+
+        CacheNode *spilled = item;
+        disk_put(disk, spilled->key, &spilled->meta, sizeof(CacheMeta), CACHE_PAYLOAD(spilled),
+                 spilled->size);
+        cache_release(spilled);
     }
 
-    printf("%s", buf);
-    if (strcasecmp(method, "GET"))
+    return NULL;
+}
+
+/* Moves the entries the loops missed in the memory cache from the disk
+ * tier to the memory cache, so that no loop waits for a page of a segment
+ * to be read. The loop looks the entry up again once it's resumed. */
+static void *disk_loader(void *vargp)
+{
+    if (Pthread_detach(pthread_self()) != 0)
+        exit(1);
+
+    DiskCache *disk = vargp;
+    void *item;
+    while (1)
     {
-        clienterror(fd, method, "501", "Not implemented",
-                    "Proxy does not implement this method");
-        return;
+        if (sbuf_remove(&loads, &item) < 0)
+            exit(1);
+
+        Conn *conn = item;
+        disk_load(disk, conn->key, load_entry, conn->key);
+        notify_loaded(conn);
     }
 
-    if (strcasecmp(version, "HTTP/1.0") &&
-        strcasecmp(version, "HTTP/1.1"))
+    return NULL;
+}
+
+/* Adding a disk hit to the memory cache, straight from the segment
+ * mapping. The meta bytes missing from an older record are zeroed. */
+static int load_entry(void *arg, const void *meta, size_t meta_size, const struct iovec *iov, int iovcnt)
+{
+    CacheMeta cache_meta;
+    memset(&cache_meta, 0, sizeof(CacheMeta));
+    memcpy(&cache_meta, meta, meta_size < sizeof(CacheMeta) ? meta_size : sizeof(CacheMeta));
+    return cache_addv(&cache, arg, &cache_meta, iov, iovcnt);
+}
+
+/* Starting a resolver the caller has already counted in threads */
+static int start_resolver(void)
+{
+    pthread_t tid;
+    if (Pthread_create(&tid, NULL, resolver, NULL) != 0)
     {
-        clienterror(fd, version, "501", "Not implemented",
-                    "Proxy supports only HTTP/1.0(1.1) protocol versions");
+        __atomic_sub_fetch(&resolvers.threads, 1, __ATOMIC_RELAXED);
+        return -1;
     }
 
-    Uri_info reciever;
-    if (parse_uri(uri, &reciever) < 0)
-    {
-        clienterror(fd, uri, "400", "Bad request",
-                    "Invalid request URI. "
-                    "URI must have the following structure: "
-                    "http[s]://{hostname}[:{port}]/{location}");
+    return 0;
+}
+
+/* Called by the loops after queuing lookups. Starts another resolver
+ * if the queued lookups outnumber the idle resolvers, or, while the
+ * lookups are slow, once they leave no idle resolver spare. A slow
+ * lookup holds its resolver long enough for the next ones to queue up. */
+static void grow_resolvers(Loop *loop)
+{
+    int threads = __atomic_load_n(&resolvers.threads, __ATOMIC_RELAXED);
+    int idle = threads - __atomic_load_n(&resolvers.active, __ATOMIC_RELAXED);
+    int queued = sbuf_count(&sbuf) + (loop->backlog != NULL);
+    int spare = __atomic_load_n(&resolvers.recent_us, __ATOMIC_RELAXED) >= RESOLVER_SLOW_US;
+    if (queued + spare <= idle || threads >= resolvers.max)
+        return;
+
+    /* Another loop may be growing the pool at the same time */
+    if (!__atomic_compare_exchange_n(&resolvers.threads, &threads, threads + 1, 0,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
         return;
+
+    if (start_resolver() == 0)
+    {
+        __atomic_add_fetch(&resolvers.grown, 1, __ATOMIC_RELAXED);
+        log_resolvers("grew");
     }
+}
 
-    Headers headers;
-    int status;
-    if ((status = parse_headers(&rio, &headers)) < 0)
+/* Called by a resolver that has been idle for RESOLVER_IDLE_TIMEOUT.
+ * Returns 1 if it should exit, which it may unless the pool is at the
+ * minimum or, while the lookups are slow, it's the only idle resolver. */
+static int shrink_resolvers(void)
+{
+    int threads = __atomic_load_n(&resolvers.threads, __ATOMIC_RELAXED);
+    while (threads > resolvers.min)
     {
-        switch (status)
+        int idle = threads - __atomic_load_n(&resolvers.active, __ATOMIC_RELAXED);
+        if (idle <= 1 && __atomic_load_n(&resolvers.recent_us, __ATOMIC_RELAXED) >= RESOLVER_SLOW_US)
+            return 0;
+
+        if (__atomic_compare_exchange_n(&resolvers.threads, &threads, threads - 1, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
         {
-        case -1:
-            clienterror(fd, "", "413", "Entity is too large",
-                        "Maximum header count or maximum header length is exceeded");
-            break;
-        case -2:
-            servererror(fd);
-            break;
+            __atomic_add_fetch(&resolvers.shrunk, 1, __ATOMIC_RELAXED);
+            log_resolvers("shrank");
+            return 1;
         }
-
-        clear_headers(&headers);
-        return;
     }
 
-    forward(fd, &reciever, &headers);
-    clear_headers(&headers);
+    return 0;
 }
 
-/* This is the part of the request pipeline, where the request is being send to the server
- * and the response is being forwarded to the client */
-static void forward(int fd, Uri_info *uri_info, Headers *headers)
+/* Logging the pool size and load whenever the pool is resized */
+static void log_resolvers(const char *event)
 {
-    jmp_buf fd_closed;
-    if (setjmp(fd_closed))
-        return;
+    long lookups = __atomic_load_n(&resolvers.lookups, __ATOMIC_RELAXED);
+    long blocked = __atomic_load_n(&resolvers.blocked_us, __ATOMIC_RELAXED);
+    log_printf("Resolver pool %s: %d threads, %d active, %d queued, %ld lookups, %.1f ms per lookup, "
+               "%.1f ms lately",
+               event, __atomic_load_n(&resolvers.threads, __ATOMIC_RELAXED),
+               __atomic_load_n(&resolvers.active, __ATOMIC_RELAXED), sbuf_count(&sbuf), lookups,
+               lookups > 0 ? blocked / 1000.0 / lookups : 0.0,
+               __atomic_load_n(&resolvers.recent_us, __ATOMIC_RELAXED) / 1000.0);
+}
 
-    /* Returning cached data if present */
-    void *cached = NULL;
-    size_t cached_length;
-    char key[MAXLINE];
-    if (build_cache_key(key, MAXLINE, uri_info))
+/* Opens a non-blocking listening socket. SO_REUSEPORT lets every loop
+ * bind its own socket to the port and the kernel spread the connections. */
+static int open_loop_listenfd(char *port)
+{
+    struct addrinfo hints, *listp, *p;
+    int listenfd, rc, optval = 1;
+
+    /* Get a list of potential server addresses */
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;             /* Accept connections */
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG; /* ... on any IP address */
+    hints.ai_flags |= AI_NUMERICSERV;            /* ... using port number */
+    if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0)
     {
-        if (cache_get(&cache, key, &cached, &cached_length) > 0)
-        {
-            Rio_writen(fd, cached, cached_length, fd_closed);
-            return;
-        }
+        fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port, gai_strerror(rc));
+        return -2;
     }
 
-    rio_t rio;
-    int clientfd;
-    if ((clientfd = Open_clientfd(uri_info->hostname, uri_info->port)) < 0)
+    /* Walk the list for one that we can bind to */
+    for (p = listp; p; p = p->ai_next)
     {
-        switch (clientfd)
-        {
-        case -1:
-            servererror(fd);
-            break;
-        case -2:
-            clienterror(fd, uri_info->hostname, "400", "Host not found",
-                        "The DNS entry for the hostname was not resolved");
+        if ((listenfd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol)) < 0)
+            continue;
+
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(int));
+        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
             break;
-        }
 
-        return;
+        close(listenfd);
     }
 
-    /* jmp if clientfd closes connection */
-    jmp_buf client_close_conn;
-    if (setjmp(client_close_conn))
+    freeaddrinfo(listp);
+    if (!p)
     {
-        Close(clientfd);
-        servererror(fd);
-        return;
+        unix_error("open_loop_listenfd error");
+        return -1;
     }
 
-    /* Sending the HTTP request line to the client socket */
-    Rio_readinitb(&rio, clientfd);
-    char buf[MAXLINE];
-    sprintf(buf, "GET ");
-    Rio_writen(clientfd, buf, strlen(buf), client_close_conn);
-    sprintf(buf, "%s", uri_info->query);
-    Rio_writen(clientfd, buf, strlen(buf), client_close_conn);
-    sprintf(buf, " HTTP/1.0\r\n");
-    Rio_writen(clientfd, buf, strlen(buf), client_close_conn);
-    /* Sending the HTTP headers from the request to the client socket */
-    int host_in_headers = 0;
-    int i;
-    for (i = 0; i < headers->cout; i++)
+    if (listen(listenfd, LISTENQ) < 0)
     {
-        if (!host_in_headers && strstr(headers->data[i], "Host:"))
-            host_in_headers = 1;
-        else if (strstr(headers->data[i], "User-Agent:") ||
-                 strstr(headers->data[i], "Connection:") ||
-                 strstr(headers->data[i], "Proxy-Connection"))
-            continue;
-
-        Rio_writen(clientfd, headers->data[i], strlen(headers->data[i]), client_close_conn);
+        unix_error("listen error");
+        close(listenfd);
+        return -1;
     }
 
-    if (!host_in_headers)
-    {
-        /* Sending a Host header */
-        sprintf(buf, "Host: ");
-        Rio_writen(clientfd, buf, strlen(buf), client_close_conn);
-        sprintf(buf, "%s", uri_info->hostname);
-        Rio_writen(clientfd, buf, strlen(buf), client_close_conn);
-        sprintf(buf, "\r\n");
-    }
-
-    /* Sending a User-Agent header */
-    sprintf(buf, "%s", user_agent_hdr);
-    Rio_writen(clientfd, buf, strlen(buf), client_close_conn);
-    /* Sending a Connection header */
-    sprintf(buf, "%s", connection_hdr);
-    Rio_writen(clientfd, buf, strlen(buf), client_close_conn);
-    /* Sending a Proxy-Connection header */
-    sprintf(buf, "%s", proxy_connection_hdr);
-    Rio_writen(clientfd, buf, strlen(buf), client_close_conn);
-    /* Sending the end of the request */
-    sprintf(buf, "\r\n");
-    Rio_writen(clientfd, buf, strlen(buf), client_close_conn);
-
-    /* jmp is the client close connection while the request is being forwarded */
-    jmp_buf fd_closed_and_client_opened;
-    if (setjmp(fd_closed_and_client_opened))
-    {
-        Close(clientfd);
-        return;
-    }
+    return listenfd;
+}
 
-    /* Creating a temp cache buffer */
-    size_t cached_len = 0;
-    int cacheable = 1;
-    char cache_buffer[MAX_OBJECT_SIZE];
-    char *cache_free = cache_buffer;
-    /* Transmitting the response from the client socket to the listening socket*/
-    Rio_readinitb(&rio, clientfd);
-    size_t response_len = 0;
-    while ((response_len = Rio_readnb(&rio, buf, MAXLINE)) > 0)
+/* Accepting all the pending connections of the loop listener */
+static void accept_conns(Loop *loop)
+{
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    int connfd;
+    while (1)
     {
-        if (cacheable)
+        clientlen = sizeof(clientaddr);
+        if ((connfd = accept(loop->listener.fd, (SA *)&clientaddr, &clientlen)) < 0)
         {
-            if (cached_len + response_len > MAX_OBJECT_SIZE)
-            {
-                cacheable = 0;
-            }
-            else
-            {
-                memcpy(cache_free, buf, response_len);
-                cached_len += response_len;
-                cache_free += response_len;
-            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                unix_error("Accept error");
+
+            if (errno == EINTR)
+                continue;
+
+            return;
         }
 
-        Rio_writen(fd, buf, response_len, fd_closed_and_client_opened);
-    }
+        /* Logging client info */
+        metrics_add(METRIC_ACCEPTS, 1);
+        if (log_on())
+        {
+            char client_host[MAXLINE];
+            char port[MAXLINE];
+            Getnameinfo((SA *)&clientaddr, clientlen, client_host, MAXLINE, port, MAXLINE,
+                        NI_NUMERICHOST | NI_NUMERICSERV);
+            log_printf("Accepted connection from (%s, %s)", client_host, port);
+        }
 
-    Close(clientfd);
-    /* Caching the respone */
-    if (!(response_len < 0) && cacheable)
-    {
-        char key[MAXLINE];
-        if (build_cache_key(key, MAXLINE, uri_info))
-            cache_add(&cache, key, cache_buffer, cached_len);
+        /* A response is relayed in parts as they arrive, Nagle would hold
+         * back every part after the first until the client acks it */
+        int optval = 1;
+        setsockopt(connfd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+        Conn *conn;
+        if (fcntl(connfd, F_SETFL, O_NONBLOCK) < 0 || (conn = Calloc(1, sizeof(Conn))) == NULL)
+        {
+            Close(connfd);
+            continue;
+        }
+
+        conn->state = READ_REQUEST;
+        conn->loop = loop;
+        conn->client.fd = connfd;
+        conn->client.conn = conn;
+        conn->pipe[0] = conn->pipe[1] = -1;
+        conn->started = metrics_now();
+        request_init(&conn->req);
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = &conn->client;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, connfd, &event) < 0)
+        {
+            unix_error("epoll_ctl error");
+            Close(connfd);
+            free(conn);
+        }
     }
 }
 
-static int parse_uri(const char *uri, Uri_info *uri_info)
+/* Called by a resolver: queues the connection to its loop and wakes it up */
+static void notify_resolved(Conn *conn)
 {
-    char buf[MAXLINE];
-    char *index = buf;
-    /* Parsing a protocol */
-    while (*uri != ':')
-    {
-        if (*uri == '\0')
-            return -1;
+    Loop *loop = conn->loop;
+    Sem_wait(&loop->pending_lock);
+    conn->next = loop->resolved;
+    loop->resolved = conn;
+    Sem_post(&loop->pending_lock);
+    wake_loop(loop);
+}
 
-        *index++ = *uri++;
+/* Called by the disk loader: queues the connection to its loop and wakes it up */
+static void notify_loaded(Conn *conn)
+{
+    Loop *loop = conn->loop;
+    Sem_wait(&loop->pending_lock);
+    conn->next = loop->loaded;
+    loop->loaded = conn;
+    Sem_post(&loop->pending_lock);
+    wake_loop(loop);
+}
+
+/* Called by a filler under the fill table lock: queues a reader that ran
+ * out of bytes to its loop, unless it's queued already, and wakes it up */
+static void wake_reader(FillWaiter *waiter)
+{
+    Conn *conn = (Conn *)((char *)waiter - offsetof(Conn, waiter));
+    Loop *loop = conn->loop;
+    Sem_wait(&loop->pending_lock);
+    int queued = conn->woken;
+    if (!queued)
+    {
+        conn->woken = 1;
+        conn->next = loop->woken;
+        loop->woken = conn;
     }
 
-    *index = '\0';
-    if (strcasecmp(buf, "http") && strcasecmp(buf, "https"))
-        return -1;
+    Sem_post(&loop->pending_lock);
+    if (!queued)
+        wake_loop(loop);
+}
 
-    /* Omitting duplicated slashes */
-    uri++;
-    while (*uri == '/')
-        uri++;
+static void wake_loop(Loop *loop)
+{
+    uint64_t one = 1;
+    if (write(loop->notifier.fd, &one, sizeof(one)) < 0)
+        unix_error("eventfd write error");
+}
 
-    /* Parsing a hostname */
-    index = buf;
-    while (*uri != ':' && *uri != '/')
+/* Resuming the connections whose name or disk lookups have finished
+ * and the readers of the fills that got new bytes */
+static void take_pending(Loop *loop)
+{
+    uint64_t count;
+    while (read(loop->notifier.fd, &count, sizeof(count)) > 0)
+        ;
+
+    Sem_wait(&loop->pending_lock);
+    Conn *conn = loop->resolved;
+    Conn *loaded = loop->loaded;
+    Conn *woken = loop->woken;
+    loop->resolved = NULL;
+    loop->loaded = NULL;
+    loop->woken = NULL;
+    Sem_post(&loop->pending_lock);
+
+    /* A reader can be queued again as soon as its flag is cleared */
+    while (woken != NULL)
     {
-        if (*uri == '\0')
-            return -1;
+        Sem_wait(&loop->pending_lock);
+        Conn *next = woken->next;
+        woken->woken = 0;
+        Sem_post(&loop->pending_lock);
+        advance(woken);
+        woken = next;
+    }
 
-        *index++ = *uri++;
+    while (conn != NULL)
+    {
+        Conn *next = conn->next;
+        connect_resolved(conn);
+        advance(conn);
+        conn = next;
     }
 
-    *index = '\0';
-    /* Filling Uri_info with the hostname */
-    size_t hostname_len = strlen(buf) + 1;
-    if (hostname_len > MAX_HOSTNAME_LEN)
-        return -1;
+    while (loaded != NULL)
+    {
+        Conn *next = loaded->next;
+        finish_load(loaded);
+        advance(loaded);
+        loaded = next;
+    }
+}
 
-    memcpy(uri_info->hostname, buf, hostname_len);
-    /* Parsing a port value */
-    index = buf;
-    if (*uri == ':')
+/* Running the connection state machine until it would block */
+static void advance(Conn *conn)
+{
+    int progress = 1;
+    while (progress)
     {
-        uri++;
-        while (*uri != '/')
+        switch (conn->state)
         {
-            if (*uri == '\0')
-                return -1;
-
-            *index++ = *uri++;
+        case READ_REQUEST:
+            progress = read_request(conn);
+            break;
+        case CONNECTING:
+            progress = finish_connect(conn);
+            break;
+        case SEND_REQUEST:
+            progress = send_request(conn);
+            break;
+        case RELAY:
+            progress = relay(conn);
+            break;
+        case WRITE_HIT:
+            if ((progress = write_out(conn)) > 0)
+                end_response(conn);
+            break;
+        case WRITE_ERROR:
+            if (write_out(conn) > 0)
+                close_conn(conn);
+            progress = 0;
+            break;
+        case STREAM_FILL:
+            progress = stream_fill(conn);
+            break;
+        default:
+            /* RESOLVING, LOADING and CLOSED wait for nothing on the descriptors */
+            progress = 0;
         }
-
-        *index = '\0';
-        /* Filling Uri_info with the port value*/
-        size_t port_len = strlen(buf) + 1;
-        if (port_len > MAX_PORT_LEN)
-            return -1;
-
-        memcpy(uri_info->port, buf, port_len);
-    }
-    else
-    {
-        char *default_port = "80";
-        strcpy(uri_info->port, default_port);
     }
+}
 
-    uri++;
-    /* Omitting duplicated slashes*/
-    while (*uri == '/')
-        uri++;
+/* Reading from the client until the end of the headers, every read
+ * only parses the bytes it brings. Returns 1 once the request is handled,
+ * 0 if it would block. */
+static int read_request(Conn *conn)
+{
+    while (request_parse(&conn->req, conn->in, conn->in_len) < REQUEST_DONE)
+    {
+        if (conn->in_len == sizeof(conn->in) - 1)
+            return clienterror(conn, "", "413", "Entity is too large",
+                               "Maximum header count or maximum header length is exceeded");
 
-    /* Parsing a query */
-    uri--;
-    index = buf;
-    while (*uri != '\0')
-        *index++ = *uri++;
+        ssize_t n = read(conn->client.fd, conn->in + conn->in_len, sizeof(conn->in) - 1 - conn->in_len);
+        if (n > 0)
+        {
+            /* A later request on the connection starts with its first bytes */
+            if (conn->started == 0)
+                conn->started = metrics_now();
 
-    *index = '\0';
-    /* Filling Uri_info with query data */
-    size_t query_len = strlen(buf) + 1;
-    if (query_len > MAX_QUERY_LEN)
-        return -1;
+            conn->in_len += n;
+            conn->in[conn->in_len] = '\0';
+        }
+        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else
+        {
+            /* The client closed the connection or failed */
+            close_conn(conn);
+            return 0;
+        }
+    }
 
-    memcpy(uri_info->query, buf, query_len);
+    if (conn->req.state == REQUEST_ERROR && conn->req.error == 413)
+        return clienterror(conn, "", "413", "Entity is too large",
+                           "Maximum header count or maximum header length is exceeded");
+    else if (conn->req.state == REQUEST_ERROR)
+        return clienterror(conn, "", "400", "Bad request",
+                           "Request is empty");
 
-    return 0;
+    return handle_request(conn);
 }
 
-static int parse_headers(rio_t *rp, Headers *headers)
+/* Checking a parsed request and either serving it
+ * from the cache or sending it to the resolver pool */
+static int handle_request(Conn *conn)
 {
-    headers->cout = 0;
-    char buf[MAXLINE];
-    ssize_t line_len;
-    /* Reading first header line from the connected socket*/
-    if ((line_len = Rio_readlineb(rp, buf, MAXLINE)) < 0)
-        return -2;
-
-    /* Checking if the header line length is less than MAXLINE */
-    if (line_len == MAXLINE - 1)
-        if (buf[line_len - 1] != '\n')
-            return -1;
-
-    /* While the line is not the end of the request */
-    while (strcmp(buf, "\r\n"))
+    Request *req = &conn->req;
+    char cause[MAXLINE];
+    metrics_add(METRIC_REQUESTS, 1);
+    log_printf("%.*s", req->line.len, conn->in + req->line.off);
+    if (req->method.len != 3 || strncasecmp(conn->in + req->method.off, "GET", 3))
+        return clienterror(conn, http_span_copy(cause, MAXLINE, conn->in, req->method), "501",
+                           "Not implemented", "Proxy does not implement this method");
+
+    if (req->version.len != 8 || (strncasecmp(conn->in + req->version.off, "HTTP/1.0", 8) &&
+                                  strncasecmp(conn->in + req->version.off, "HTTP/1.1", 8)))
+        return clienterror(conn, http_span_copy(cause, MAXLINE, conn->in, req->version), "501",
+                           "Not implemented", "Proxy supports only HTTP/1.0(1.1) protocol versions");
+
+    /* The one local page, the counters for a scraper */
+    if (!req->absolute && req->uri.len == 8 && !strncmp(conn->in + req->uri.off, "/metrics", 8))
     {
-        if (headers->cout > MAX_HEADERS_NUMBER)
-            return -1;
+        conn->request_len = req->pos;
+        conn->keep_alive = req->keep_alive;
+        return serve_metrics(conn);
+    }
+
+    if (!req->absolute || req->host.len >= MAX_HOSTNAME_LEN || req->port.len >= MAX_PORT_LEN ||
+        req->path.len >= MAX_QUERY_LEN)
+        return clienterror(conn, http_span_copy(cause, MAXLINE, conn->in, req->uri), "400", "Bad request",
+                           "Invalid request URI. "
+                           "URI must have the following structure: "
+                           "http[s]://{hostname}[:{port}]/{location}");
+
+    /* The name lookup and the upstream pool need the origin as strings */
+    http_span_copy(conn->uri_info.hostname, MAX_HOSTNAME_LEN, conn->in, req->host);
+    if (req->port.len > 0)
+        http_span_copy(conn->uri_info.port, MAX_PORT_LEN, conn->in, req->port);
+    else
+        strcpy(conn->uri_info.port, "80");
 
-        /* Copying the header to the Headers struct*/
-        char *header;
-        if ((header = Malloc(line_len + 1)) == NULL)
-            return -2;
+    conn->request_len = req->pos;
+    conn->keep_alive = req->keep_alive;
 
-        memcpy(header, buf, line_len + 1);
-        headers->data[headers->cout++] = header;
+    /* A miss in the memory cache is looked up on disk by the disk loader,
+     * unless its queue is full */
+    int cacheable = build_cache_key(conn);
+    CacheNode *item = NULL;
+    if (cacheable)
+    {
+        conn->lookup_started = metrics_now();
+        if (cache_get(&cache, conn->key, &item) <= 0)
+            item = NULL;
 
-        /* Reading next line */
-        if ((line_len = Rio_readlineb(rp, buf, MAXLINE)) < 0)
-            return -2;
+        if (item == NULL && use_disk)
+        {
+            int status;
+            conn->state = LOADING;
+            if ((status = sbuf_tryinsert(&loads, conn)) < 0)
+                exit(1);
+            else if (status > 0)
+                return 0;
+
+            conn->state = READ_REQUEST;
+        }
 
-        /* Checking if the header line length is less than MAXLINE */
-        if (line_len == MAXLINE - 1)
-            if (buf[line_len - 1] != '\n')
-                return -1;
+        metrics_record(METRIC_LOOKUP_TIME, metrics_now() - conn->lookup_started);
     }
 
-    return 0;
+    return finish_lookup(conn, cacheable, item);
 }
 
-static void clienterror(int fd, char *cause, char *errnum,
-                        char *shortmsg, char *longmsg)
+/* Picking the entry up once the disk loader has moved it to the memory
+ * cache, it may have been evicted again in the meantime */
+static int finish_load(Conn *conn)
 {
-    jmp_buf fd_closed;
-    if (setjmp(fd_closed))
-        return;
+    CacheNode *item = NULL;
+    conn->state = READ_REQUEST;
+    if (cache_get(&cache, conn->key, &item) <= 0)
+        item = NULL;
 
-    char buf[MAXLINE];
-    /* Print the HTTP response headers */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf), fd_closed);
-    sprintf(buf, "Content-type: text/html\r\n\r\n");
-    Rio_writen(fd, buf, strlen(buf), fd_closed);
-
-    /* Print the HTTP response body */
-    sprintf(buf, "<html><title>Proxy Error</title>");
-    Rio_writen(fd, buf, strlen(buf), fd_closed);
-    sprintf(buf, "<body bgcolor="
-                 "ffffff"
-                 ">\r\n");
-    Rio_writen(fd, buf, strlen(buf), fd_closed);
-    sprintf(buf, "%s: %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf), fd_closed);
-    sprintf(buf, "<p>%s: %s\r\n", longmsg, cause);
-    Rio_writen(fd, buf, strlen(buf), fd_closed);
-    sprintf(buf, "<hr><em>The Proxy</em>\r\n");
-    Rio_writen(fd, buf, strlen(buf), fd_closed);
-}
-
-static void servererror(int fd)
-{
-    clienterror(fd, "", "500", "Internal server error",
-                "Something went wrong");
+    metrics_record(METRIC_LOOKUP_TIME, metrics_now() - conn->lookup_started);
+    return finish_lookup(conn, 1, item);
 }
 
-static void clear_headers(Headers *headers)
+/* Writing the cached entry in item straight to the client if it's still
+ * fresh. A stale one stays pinned until the origin tells whether it's
+ * still valid. Without an entry the response is fetched. */
+static int finish_lookup(Conn *conn, int cacheable, CacheNode *item)
+{
+    if (item != NULL)
+    {
+        if (time(NULL) < item->meta.expires)
+        {
+            conn->hit = item;
+            return serve_hit(conn);
+        }
+
+        conn->stale = item;
+    }
+
+    /* Streaming the response if another connection is fetching it already,
+     * otherwise this one fetches it for everyone asking in the meantime */
+    int created;
+    if (cacheable && (conn->fill = fill_start(&fills, conn->key, &created)) != NULL && !created)
+    {
+        if (conn->stale != NULL)
+        {
+            cache_release(conn->stale);
+            conn->stale = NULL;
+        }
+
+        conn->waiter.wake = wake_reader;
+        conn->fill_off = 0;
+        conn->state = STREAM_FILL;
+        return 1;
+    }
+
+    if (conn->stale != NULL)
+        metrics_add(METRIC_REVALIDATIONS, 1);
+
+    return fetch_response(conn);
+}
+
+/* Writing the cached entry in hit to the client */
+static int serve_hit(Conn *conn)
+{
+    /* The client connection stays open only if the response has a length */
+    char *payload = CACHE_PAYLOAD(conn->hit);
+    Response resp;
+    response_init(&resp);
+    response_head(&resp, payload, conn->hit->size);
+    if (resp.state == RESPONSE_UNTIL_CLOSE)
+        conn->keep_alive = 0;
+
+    queue_output(conn, payload, conn->hit->size, 1);
+    conn->state = WRITE_HIT;
+    return 1;
+}
+
+/* Writing the counters and histograms to the client, as a page in the
+ * Prometheus text format */
+static int serve_metrics(Conn *conn)
+{
+    char *body;
+    size_t length;
+    FILE *out;
+    if ((out = open_memstream(&body, &length)) == NULL)
+        return servererror(conn);
+
+    print_metrics(out);
+    fclose(out);
+
+    /* The page goes out as a single buffer, replacing the response buffer */
+    char head[MAXLINE];
+    int head_len = snprintf(head, MAXLINE,
+                            "HTTP/1.1 200 OK\r\n"
+                            "Content-Type: text/plain; version=0.0.4\r\n"
+                            "Content-Length: %zu\r\n\r\n",
+                            length);
+    free(conn->buf);
+    if ((conn->buf = Malloc(head_len + length)) == NULL)
+    {
+        free(body);
+        return servererror(conn);
+    }
+
+    memcpy(conn->buf, head, head_len);
+    memcpy(conn->buf + head_len, body, length);
+    free(body);
+    queue_output(conn, conn->buf, head_len + length, 1);
+    conn->state = WRITE_HIT;
+    return 1;
+}
+
+/* The thread counters and histograms, and the state of the shared parts */
+static void print_metrics(FILE *out)
+{
+    metrics_print(out, "proxy_");
+    metrics_print_value(out, "proxy_log_dropped_total", "counter",
+                        "Log lines dropped because the logger fell behind.", log_dropped());
+
+    size_t entries, bytes;
+    cache_usage(&cache, &entries, &bytes);
+    metrics_print_value(out, "proxy_cache_entries", "gauge", "Entries in the memory cache.", entries);
+    metrics_print_value(out, "proxy_cache_bytes", "gauge", "Payload bytes in the memory cache.", bytes);
+
+    metrics_print_value(out, "proxy_resolver_threads", "gauge", "Running resolver threads.",
+                        __atomic_load_n(&resolvers.threads, __ATOMIC_RELAXED));
+    metrics_print_value(out, "proxy_resolver_active", "gauge", "Resolvers busy with a lookup.",
+                        __atomic_load_n(&resolvers.active, __ATOMIC_RELAXED));
+    metrics_print_value(out, "proxy_resolver_queued", "gauge", "Lookups waiting in the resolver buffer.",
+                        sbuf_count(&sbuf));
+    metrics_print_value(out, "proxy_resolver_lookups_total", "counter", "Lookups done by the resolvers.",
+                        __atomic_load_n(&resolvers.lookups, __ATOMIC_RELAXED));
+    metrics_print_value(out, "proxy_resolver_blocked_seconds_total", "counter",
+                        "Time the resolvers spent in lookups.",
+                        __atomic_load_n(&resolvers.blocked_us, __ATOMIC_RELAXED) / 1e6);
+    metrics_print_value(out, "proxy_resolver_lookup_seconds", "gauge",
+                        "Moving average of the lookup time the pool is sized by.",
+                        __atomic_load_n(&resolvers.recent_us, __ATOMIC_RELAXED) / 1e6);
+    metrics_print_value(out, "proxy_resolver_grown_total", "counter", "Resolvers started above the minimum.",
+                        __atomic_load_n(&resolvers.grown, __ATOMIC_RELAXED));
+    metrics_print_value(out, "proxy_resolver_shrunk_total", "counter", "Resolvers that exited after idling.",
+                        __atomic_load_n(&resolvers.shrunk, __ATOMIC_RELAXED));
+
+    pthread_mutex_lock(&dns.lock);
+    long dns_counts[] = {dns.hits, dns.negative_hits, dns.misses, dns.lookups, dns.expired};
+    pthread_mutex_unlock(&dns.lock);
+    metrics_print_value(out, "proxy_dns_hits_total", "counter", "Name lookups answered from the DNS cache.",
+                        dns_counts[0]);
+    metrics_print_value(out, "proxy_dns_negative_hits_total", "counter",
+                        "DNS cache hits that were failed lookups.", dns_counts[1]);
+    metrics_print_value(out, "proxy_dns_misses_total", "counter", "Name lookups left to the resolvers.",
+                        dns_counts[2]);
+    metrics_print_value(out, "proxy_dns_lookups_total", "counter", "Calls of getaddrinfo.", dns_counts[3]);
+    metrics_print_value(out, "proxy_dns_expired_total", "counter", "DNS cache entries whose TTL ran out.",
+                        dns_counts[4]);
+
+    if (!use_disk)
+        return;
+
+    pthread_rwlock_rdlock(&disk.lock);
+    size_t disk_entries = disk.count;
+    size_t disk_bytes = disk.bytes;
+    pthread_rwlock_unlock(&disk.lock);
+    metrics_print_value(out, "proxy_disk_entries", "gauge", "Entries in the disk tier.", disk_entries);
+    metrics_print_value(out, "proxy_disk_bytes", "gauge", "Payload bytes in the disk tier.", disk_bytes);
+    metrics_print_value(out, "proxy_disk_hits_total", "counter", "Lookups that found a disk entry.",
+                        __atomic_load_n(&disk.hits, __ATOMIC_RELAXED));
+    metrics_print_value(out, "proxy_disk_misses_total", "counter", "Lookups that found no disk entry.",
+                        __atomic_load_n(&disk.misses, __ATOMIC_RELAXED));
+    metrics_print_value(out, "proxy_disk_writes_total", "counter", "Entries written to the disk tier.",
+                        __atomic_load_n(&disk.writes, __ATOMIC_RELAXED));
+    metrics_print_value(out, "proxy_disk_dropped_total", "counter", "Entries lost with a recycled segment.",
+                        __atomic_load_n(&disk.dropped, __ATOMIC_RELAXED));
+    metrics_print_value(out, "proxy_disk_corrupt_total", "counter", "Disk reads that failed the checksum.",
+                        __atomic_load_n(&disk.corrupt, __ATOMIC_RELAXED));
+    metrics_print_value(out, "proxy_disk_loads_queued", "gauge", "Memory cache misses waiting for the disk loader.",
+                        sbuf_count(&loads));
+    metrics_print_value(out, "proxy_disk_spills_queued", "gauge", "Evicted entries waiting for the disk writer.",
+                        sbuf_count(&spills));
+    metrics_print_value(out, "proxy_disk_spills_dropped_total", "counter",
+                        "Evicted entries not written because the disk writer fell behind.",
+                        __atomic_load_n(&spills_dropped, __ATOMIC_RELAXED));
+}
+
+/* Queuing an entry evicted from the memory cache for the disk writer.
+ * The loop never waits for a slot, with the queue full the entry is
+ * dropped like it would be without a disk tier. */
+static void spill_to_disk(void *arg, CacheNode *item)
+{
+    int status;
+    if ((status = sbuf_tryinsert(arg, item)) < 0)
+        exit(1);
+    else if (status == 0)
+    {
+        __atomic_add_fetch(&spills_dropped, 1, __ATOMIC_RELAXED);
+        cache_release(item);
+    }
+}
+
+/* Getting the response from the origin */
+static int fetch_response(Conn *conn)
+{
+    /* Reusing an idle connection to the origin, which also skips the name lookup */
+    conn->fetch_started = metrics_now();
+    if ((conn->upstream = pool_take(conn->loop, &conn->uri_info)) != NULL)
+    {
+        conn->upstream->endpoint.conn = conn;
+        conn->reused = 1;
+        return start_request(conn);
+    }
+
+    return resolve(conn);
+}
+
+/* Connecting right away if the origin address is in the DNS cache.
+ * Otherwise the name lookup goes to the resolver pool and the loop
+ * resumes the connection once it's done. */
+static int resolve(Conn *conn)
+{
+    if (dns_get(&dns, conn->uri_info.hostname, conn->uri_info.port, &conn->dns) > 0)
+        return connect_resolved(conn);
+
+    conn->state = RESOLVING;
+    queue_lookup(conn);
+    return 0;
+}
+
+/* Adding the name lookup to the resolver buffer. A full buffer must
+ * not block the loop, the lookup waits in the backlog instead. */
+static void queue_lookup(Conn *conn)
+{
+    Loop *loop = conn->loop;
+    int status;
+    if (loop->backlog == NULL && (status = sbuf_tryinsert(&sbuf, conn)) != 0)
+    {
+        if (status < 0)
+            exit(1);
+
+        grow_resolvers(loop);
+        return;
+    }
+
+    conn->next = NULL;
+    if (loop->backlog_tail != NULL)
+        loop->backlog_tail->next = conn;
+    else
+        loop->backlog = conn;
+
+    loop->backlog_tail = conn;
+    grow_resolvers(loop);
+}
+
+/* Moving the lookups from the backlog to the resolver buffer while it has room */
+static void flush_backlog(Loop *loop)
+{
+    while (loop->backlog != NULL)
+    {
+        int status;
+        if ((status = sbuf_tryinsert(&sbuf, loop->backlog)) < 0)
+            exit(1);
+        else if (status == 0)
+        {
+            grow_resolvers(loop);
+            return;
+        }
+
+        loop->backlog = loop->backlog->next;
+        if (loop->backlog == NULL)
+            loop->backlog_tail = NULL;
+    }
+}
+
+/* Starting the upstream connect once the name is resolved */
+static int connect_resolved(Conn *conn)
+{
+    if (conn->dns == NULL)
+        return servererror(conn);
+
+    if (conn->dns->status != 0)
+        return clienterror(conn, conn->uri_info.hostname, "400", "Host not found",
+                           "The DNS entry for the hostname was not resolved");
+
+    if (start_connect(conn) < 0)
+        return servererror(conn);
+
+    return 1;
+}
+
+/* Starting a non-blocking connect to the next upstream address.
+ * Returns -1 once all the addresses have failed. */
+static int start_connect(Conn *conn)
+{
+    if (conn->upstream == NULL)
+    {
+        if ((conn->upstream = Calloc(1, sizeof(Upstream))) == NULL)
+            return -1;
+
+        conn->upstream->endpoint.fd = -1;
+        conn->upstream->endpoint.conn = conn;
+    }
+
+    struct addrinfo *p = conn->addr == NULL ? conn->dns->addrs : conn->addr->ai_next;
+    for (; p != NULL; p = p->ai_next)
+    {
+        int fd;
+        if ((fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK, p->ai_protocol)) < 0)
+            continue;
+
+        /* A request is a single writev, so Nagle has nothing to coalesce.
+         * It could only hold the request back behind an unacked one on a
+         * pooled connection, and there's no reason to cork it either. */
+        int optval = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+
+        if (connect(fd, p->ai_addr, p->ai_addrlen) < 0 && errno != EINPROGRESS)
+        {
+            close(fd);
+            continue;
+        }
+
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = &conn->upstream->endpoint;
+        if (epoll_ctl(conn->loop->epfd, EPOLL_CTL_ADD, fd, &event) < 0)
+        {
+            close(fd);
+            continue;
+        }
+
+        conn->addr = p;
+        conn->upstream->endpoint.fd = fd;
+        conn->state = CONNECTING;
+        return 0;
+    }
+
+    return -1;
+}
+
+/* Checking if the upstream connect has completed */
+static int finish_connect(Conn *conn)
+{
+    Endpoint *upstream = &conn->upstream->endpoint;
+    struct pollfd pfd = {upstream->fd, POLLOUT, 0};
+    if (poll(&pfd, 1, 0) == 0)
+        return 0;
+
+    int error = 0;
+    socklen_t len = sizeof(error);
+    if (getsockopt(upstream->fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0)
+    {
+        /* Trying the next address */
+        Close(upstream->fd);
+        upstream->fd = -1;
+        if (start_connect(conn) < 0)
+            return servererror(conn);
+
+        return 1;
+    }
+
+    dns_release(&dns, conn->dns);
+    conn->dns = NULL;
+    conn->addr = NULL;
+    return start_request(conn);
+}
+
+/* Preparing the request for a connected upstream. The pieces are
+ * allocated once and kept for the requests that follow. */
+static int start_request(Conn *conn)
+{
+    if (conn->request == NULL &&
+        (conn->request = Malloc(REQUEST_PIECES * sizeof(struct iovec))) == NULL)
+        return servererror(conn);
+
+    CacheMeta *validators = conn->stale != NULL ? &conn->stale->meta : NULL;
+    conn->request_count = build_request(conn, validators, conn->request);
+    conn->request_next = 0;
+    conn->state = SEND_REQUEST;
+    return 1;
+}
+
+/* Writing the request to the upstream, all the pieces at once */
+static int send_request(Conn *conn)
+{
+    while (conn->request_next < conn->request_count)
+    {
+        struct iovec *iov = &conn->request[conn->request_next];
+        ssize_t n = writev(conn->upstream->endpoint.fd, iov, conn->request_count - conn->request_next);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        else if (n < 0 && conn->reused)
+            return retry_request(conn);
+        else if (n < 0 && errno != EINTR)
+            return servererror(conn);
+
+        /* Skipping the written pieces */
+        while (n > 0 && conn->request_next < conn->request_count)
+        {
+            if ((size_t)n < iov->iov_len)
+            {
+                iov->iov_base = (char *)iov->iov_base + n;
+                iov->iov_len -= n;
+                break;
+            }
+
+            n -= iov->iov_len;
+            iov++;
+            conn->request_next++;
+        }
+    }
+
+    if (conn->buf == NULL && (conn->buf = Malloc(MAXBUF)) == NULL)
+        return servererror(conn);
+
+    if (conn->response == NULL && (conn->response = Malloc(sizeof(Response))) == NULL)
+        return servererror(conn);
+
+    response_init(conn->response);
+    conn->received = 0;
+    conn->buf_len = 0;
+    conn->out_count = 0;
+    conn->state = RELAY;
+    return 1;
+}
+
+/* Transmitting the response from the upstream to the client, one buffer
+ * at a time. The upstream is not read while the client is not writable.
+ * The headers are collected first to replace the hop-by-hop ones. */
+static int relay(Conn *conn)
+{
+    Response *resp = conn->response;
+    while (1)
+    {
+        int status;
+        if ((status = write_out(conn)) <= 0 || (status = drain_pipe(conn)) <= 0)
+            return 0;
+
+        /* Going on with a pipelined request if the connection stays open */
+        if (resp->state == RESPONSE_DONE)
+        {
+            finish_response(conn);
+            return conn->state != CLOSED;
+        }
+
+        /* Body bytes that are not cached go through the pipe, so they are
+         * never copied to user space. Chunk size lines are still read. */
+        ssize_t n;
+        long raw = response_raw(resp);
+        if (raw != 0 && conn->fill == NULL && open_pipe(conn) == 0)
+        {
+            size_t length = raw > 0 && raw < SPLICE_PIPE_SIZE ? raw : SPLICE_PIPE_SIZE;
+            if ((n = splice_move(conn->upstream->endpoint.fd, conn->pipe[1], length)) > 0)
+            {
+                conn->received += n;
+                conn->piped = n;
+                response_skip(resp, n);
+                continue;
+            }
+        }
+        else if ((n = read(conn->upstream->endpoint.fd, conn->buf + conn->buf_len, MAXBUF - conn->buf_len)) > 0)
+        {
+            char *data = conn->buf + conn->buf_len;
+            size_t length;
+            conn->received += n;
+            if (resp->state <= RESPONSE_HEADERS)
+            {
+                /* Waiting for the rest of the headers */
+                size_t head_end = conn->buf_len + response_head(resp, data, n);
+                conn->buf_len += n;
+                if (resp->state <= RESPONSE_HEADERS)
+                {
+                    if (conn->buf_len == MAXBUF)
+                        return clienterror(conn, "", "502", "Bad gateway",
+                                           "The response headers are too large");
+                    continue;
+                }
+
+                /* Framing the first body bytes and dropping the hop-by-hop headers */
+                size_t body = response_frame(resp, conn->buf + head_end, conn->buf_len - head_end);
+                if (head_end + body < conn->buf_len)
+                    resp->keep_alive = 0;
+
+                /* The stale entry is still valid, its body is not sent again */
+                if (conn->stale != NULL && resp->status == 304)
+                {
+                    conn->buf_len = 0;
+                    return serve_revalidated(conn);
+                }
+
+                size_t head = strip_hop_headers(conn->buf, head_end);
+                memmove(conn->buf + head, conn->buf + head_end, body);
+                if (resp->state == RESPONSE_UNTIL_CLOSE)
+                    conn->keep_alive = 0;
+
+                /* A response that must not be cached or is known to be too large
+                 * is not shared at all, the readers fetch it themselves. One of
+                 * a known length that fits is streamed to them right away, any
+                 * other only once it's complete. The fill holds the head too. */
+                int too_large = resp->content_length >= 0 &&
+                                head + (size_t)resp->content_length > MAX_OBJECT_SIZE;
+                if (!response_cacheable(resp) || too_large)
+                    drop_fill(conn);
+                else if (conn->fill != NULL)
+                {
+                    set_meta(&conn->meta, resp);
+                    if (!resp->chunked && resp->content_length >= 0)
+                        fill_stream(conn->fill);
+                }
+
+                data = conn->buf;
+                length = head + body;
+                conn->buf_len = 0;
+                queue_output(conn, data, length, 1);
+            }
+            else
+            {
+                /* Bytes past the end of the response mean the upstream can't be reused */
+                if ((length = response_frame(resp, data, n)) < (size_t)n)
+                    resp->keep_alive = 0;
+
+                queue_output(conn, data, length, 0);
+            }
+
+            /* Streaming the chunk to the readers while it's cacheable */
+            if (conn->fill != NULL && fill_append(&fills, conn->fill, data, length) < 0)
+                drop_fill(conn);
+
+            continue;
+        }
+
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        else if (n < 0 && errno == EINTR)
+            continue;
+        else if (conn->reused && conn->received == 0)
+            /* The pooled connection was closed by the origin in the meantime */
+            return retry_request(conn);
+        else if (n == 0 && resp->state == RESPONSE_UNTIL_CLOSE)
+        {
+            resp->state = RESPONSE_DONE;
+            finish_response(conn);
+            return conn->state != CLOSED;
+        }
+        else
+        {
+            /* A truncated response is neither cached nor reused */
+            close_conn(conn);
+            return 0;
+        }
+    }
+}
+
+/* Sending the request again on a new connection after
+ * a pooled one turned out to be closed by the origin */
+static int retry_request(Conn *conn)
+{
+    drop_upstream(conn->loop, conn->upstream);
+    conn->upstream = NULL;
+    conn->reused = 0;
+    return resolve(conn);
+}
+
+/* Serving the stale entry once the origin confirmed it with a 304. The entry
+ * is added again with the freshness of the 304 and the readers of the fill
+ * get its bytes as if they came from the origin. */
+static int serve_revalidated(Conn *conn)
+{
+    CacheNode *item = conn->stale;
+    char *payload = CACHE_PAYLOAD(item);
+    conn->stale = NULL;
+    conn->hit = item;
+
+    /* Validators the 304 doesn't repeat are kept */
+    set_meta(&conn->meta, conn->response);
+    if (conn->meta.etag[0] == '\0')
+        strcpy(conn->meta.etag, item->meta.etag);
+
+    if (conn->meta.modified[0] == '\0')
+        strcpy(conn->meta.modified, item->meta.modified);
+
+    cache_add(&cache, conn->key, &conn->meta, payload, item->size);
+    if (conn->fill != NULL)
+    {
+        fill_stream(conn->fill);
+        if (fill_append(&fills, conn->fill, payload, item->size) < 0)
+            drop_fill(conn);
+        else
+        {
+            fill_finish(&fills, conn->fill, FILL_DONE);
+            fill_release(&fills, conn->fill);
+            conn->fill = NULL;
+        }
+    }
+
+    metrics_add(METRIC_NOT_MODIFIED, 1);
+    metrics_add(METRIC_BYTES_SAVED, item->size);
+    metrics_record(METRIC_FETCH_TIME, metrics_now() - conn->fetch_started);
+    log_printf("Not modified %s, %zu bytes saved", conn->key, item->size);
+
+    end_upstream(conn);
+    return serve_hit(conn);
+}
+
+/* Taking the freshness and the validators of a response head */
+static void set_meta(CacheMeta *meta, Response *resp)
+{
+    meta->expires = response_expires(resp, time(NULL));
+    snprintf(meta->etag, sizeof(meta->etag), "%s", resp->etag);
+    snprintf(meta->modified, sizeof(meta->modified), "%s", resp->modified);
+}
+
+/* Writing the response another connection is fetching to the client as far
+ * as it has arrived, then waiting for the filler to append more of it */
+static int stream_fill(Conn *conn)
+{
+    Fill *fill = conn->fill;
+    while (1)
+    {
+        if (write_out(conn) <= 0)
+            return 0;
+
+        /* The state is read first, a finished fill has all its bytes readable */
+        int state = fill_state(fill);
+        if (state == FILL_ABORTED)
+        {
+            /* Fetching the response separately, unless a part of it is sent already */
+            drop_fill(conn);
+            if (conn->fill_off == 0)
+                return fetch_response(conn);
+
+            close_conn(conn);
+            return 0;
+        }
+
+        char *data;
+        size_t n = 0;
+        if ((state == FILL_DONE || fill_streams(fill)) &&
+            (n = fill_read(fill, conn->fill_off, &data)) > 0)
+        {
+            /* The first bytes hold the whole head. The client connection
+             * stays open only if the response has a length. */
+            int head = conn->fill_off == 0;
+            if (head)
+            {
+                Response resp;
+                response_init(&resp);
+                response_head(&resp, data, n);
+                if (resp.state == RESPONSE_UNTIL_CLOSE)
+                    conn->keep_alive = 0;
+            }
+
+            queue_output(conn, data, n, head);
+            conn->fill_off += n;
+        }
+        else if (state == FILL_DONE)
+        {
+            drop_fill(conn);
+            end_response(conn);
+            return conn->state != CLOSED;
+        }
+        else if (fill_wait(&fills, fill, conn->fill_off, &conn->waiter))
+            return 0;
+    }
+}
+
+/* Letting go of the shared response. The filler aborts it if it's not
+ * finished, a reader makes sure no filler will wake it up anymore. */
+static void drop_fill(Conn *conn)
+{
+    if (conn->fill == NULL)
+        return;
+
+    if (conn->state == STREAM_FILL)
+    {
+        fill_cancel(&fills, conn->fill, &conn->waiter);
+        Loop *loop = conn->loop;
+        Sem_wait(&loop->pending_lock);
+        if (conn->woken)
+        {
+            Conn **link = &loop->woken;
+            while (*link != NULL && *link != conn)
+                link = &(*link)->next;
+
+            if (*link != NULL)
+                *link = conn->next;
+
+            conn->woken = 0;
+        }
+
+        Sem_post(&loop->pending_lock);
+    }
+    else
+        fill_finish(&fills, conn->fill, FILL_ABORTED);
+
+    fill_release(&fills, conn->fill);
+    conn->fill = NULL;
+}
+
+/* Writing the body bytes left in the pipe to the client. Returns 1 once
+ * the pipe is empty, 0 if it would block and -1 if the connection got closed. */
+static int drain_pipe(Conn *conn)
+{
+    while (conn->piped > 0)
+    {
+        ssize_t n = splice_move(conn->pipe[0], conn->client.fd, conn->piped);
+        if (n > 0)
+            conn->piped -= n;
+        else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        else if (n < 0 && errno != EINTR)
+        {
+            close_conn(conn);
+            return -1;
+        }
+    }
+
+    return 1;
+}
+
+/* Opening the pipe for the relayed bodies, once per connection.
+ * The bodies are copied through the buffer if it fails. */
+static int open_pipe(Conn *conn)
+{
+    if (conn->pipe[0] >= 0)
+        return 0;
+
+    if (splice_pipe(conn->pipe) < 0)
+    {
+        conn->pipe[0] = conn->pipe[1] = -1;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Writing the pending output to the client. Returns 1 once it's all
+ * written, 0 if it would block and -1 if the connection got closed. */
+static int write_out(Conn *conn)
+{
+    struct iovec *iov = conn->out;
+    while (conn->out_count > 0)
+    {
+        ssize_t n = writev(conn->client.fd, iov, conn->out_count);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        else if (n < 0 && errno != EINTR)
+        {
+            close_conn(conn);
+            return -1;
+        }
+
+        if (n > 0 && conn->started != 0)
+        {
+            metrics_record(METRIC_FIRST_BYTE, metrics_now() - conn->started);
+            conn->started = 0;
+        }
+
+        /* Skipping the written segments */
+        while (n > 0 && conn->out_count > 0)
+        {
+            if ((size_t)n < iov->iov_len)
+            {
+                iov->iov_base = (char *)iov->iov_base + n;
+                iov->iov_len -= n;
+                break;
+            }
+
+            n -= iov->iov_len;
+            iov++;
+            conn->out_count--;
+        }
+    }
+
+    /* Keeping the unwritten segments at the start */
+    if (iov != conn->out)
+        memmove(conn->out, iov, conn->out_count * sizeof(struct iovec));
+
+    return conn->out_count == 0;
+}
+
+/* Setting up the output of a response part. The Connection header
+ * for the client goes right after the status line of a head. */
+static void queue_output(Conn *conn, char *data, size_t length, int head)
+{
+    char *line_end;
+    conn->out_count = 0;
+    if (head && length > 5 && !strncmp(data, "HTTP/", 5) &&
+        (line_end = memchr(data, '\n', length)) != NULL)
+    {
+        size_t line_len = line_end - data + 1;
+        conn->out[0].iov_base = data;
+        conn->out[0].iov_len = line_len;
+        conn->out[1].iov_base = (char *)(conn->keep_alive ? keep_alive_hdr : connection_hdr);
+        conn->out[1].iov_len = strlen(conn->out[1].iov_base);
+        conn->out_count = 2;
+        data += line_len;
+        length -= line_len;
+    }
+
+    if (length > 0)
+    {
+        conn->out[conn->out_count].iov_base = data;
+        conn->out[conn->out_count].iov_len = length;
+        conn->out_count++;
+    }
+}
+
+/* Caching a complete response and handing the upstream back to the pool.
+ * The entry is added before the fill leaves the table, so the requests
+ * for the key find either of them. */
+static void finish_response(Conn *conn)
+{
+    if (conn->fill != NULL)
+    {
+        struct iovec iov[FILL_MAX_SEGMENTS];
+        cache_addv(&cache, conn->key, &conn->meta, iov, fill_segments(conn->fill, iov));
+        fill_finish(&fills, conn->fill, FILL_DONE);
+        fill_release(&fills, conn->fill);
+        conn->fill = NULL;
+    }
+
+    metrics_add(METRIC_FETCHES, 1);
+    metrics_add(METRIC_FETCH_BYTES, conn->received);
+    metrics_record(METRIC_FETCH_TIME, metrics_now() - conn->fetch_started);
+    end_upstream(conn);
+    end_response(conn);
+}
+
+/* Handing the upstream back to the pool once the response is complete */
+static void end_upstream(Conn *conn)
+{
+    if (conn->response->keep_alive && pool_max_idle > 0)
+        pool_put(conn->loop, &conn->uri_info, conn->upstream);
+    else
+        drop_upstream(conn->loop, conn->upstream);
+
+    conn->upstream = NULL;
+}
+
+/* Going on with the next request if the client connection is persistent */
+static void end_response(Conn *conn)
+{
+    if (conn->keep_alive)
+        next_request(conn);
+    else
+        close_conn(conn);
+}
+
+/* Releasing the state of the served request and moving the
+ * pipelined bytes that follow it to the start of the input */
+static void next_request(Conn *conn)
+{
+    if (conn->hit != NULL)
+        cache_release(conn->hit);
+
+    if (conn->stale != NULL)
+        cache_release(conn->stale);
+
+    drop_fill(conn);
+    free(conn->buf);
+    free(conn->response);
+    conn->hit = NULL;
+    conn->stale = NULL;
+    conn->buf = NULL;
+    conn->response = NULL;
+    conn->reused = 0;
+    conn->out_count = 0;
+    conn->in_len -= conn->request_len;
+    memmove(conn->in, conn->in + conn->request_len, conn->in_len + 1);
+    conn->request_len = 0;
+    conn->started = conn->in_len > 0 ? metrics_now() : 0;
+    request_init(&conn->req);
+    conn->state = READ_REQUEST;
+}
+
+/* Removing the hop-by-hop headers from a response head in place.
+ * Returns the new length of the head. */
+static size_t strip_hop_headers(char *head, size_t length)
+{
+    char *end = head + length;
+    char *line = memchr(head, '\n', length);
+    if (line == NULL)
+        return length;
+
+    /* The status line is kept */
+    char *dst = ++line;
+    while (line < end)
+    {
+        char *line_end = memchr(line, '\n', end - line);
+        size_t line_len = (line_end != NULL ? line_end + 1 : end) - line;
+        if (strncasecmp(line, "Connection:", 11) &&
+            strncasecmp(line, "Keep-Alive:", 11) &&
+            strncasecmp(line, "Proxy-Connection:", 17))
+        {
+            memmove(dst, line, line_len);
+            dst += line_len;
+        }
+
+        line += line_len;
+    }
+
+    return dst - head;
+}
+
+/* Closing both descriptors and releasing everything but the
+ * connection itself, which is freed at the end of the event batch */
+static void close_conn(Conn *conn)
+{
+    if (conn->state == CLOSED)
+        return;
+
+    Close(conn->client.fd);
+    if (conn->upstream != NULL)
+        drop_upstream(conn->loop, conn->upstream);
+
+    if (conn->pipe[0] >= 0)
+    {
+        Close(conn->pipe[0]);
+        Close(conn->pipe[1]);
+    }
+
+    if (conn->hit != NULL)
+        cache_release(conn->hit);
+
+    if (conn->stale != NULL)
+        cache_release(conn->stale);
+
+    if (conn->dns != NULL)
+        dns_release(&dns, conn->dns);
+
+    drop_fill(conn);
+    free(conn->request);
+    free(conn->buf);
+    free(conn->response);
+    conn->state = CLOSED;
+    conn->next = conn->loop->closed;
+    conn->loop->closed = conn;
+}
+
+/* Taking the most recently used idle connection to the origin of the request */
+static Upstream *pool_take(Loop *loop, Uri_info *uri_info)
+{
+    char name[MAX_ORIGIN_LEN];
+    sprintf(name, "%s:%s", uri_info->hostname, uri_info->port);
+    Origin *origin;
+    for (origin = loop->origins[origin_bucket(name)]; origin != NULL; origin = origin->next)
+        if (!strcmp(origin->name, name))
+            break;
+
+    if (origin == NULL)
+        return NULL;
+
+    Upstream *upstream = origin->head;
+    pool_remove(loop, upstream);
+    return upstream;
+}
+
+/* Parking a connection in the pool of its origin, it's closed if the pool is full */
+static void pool_put(Loop *loop, Uri_info *uri_info, Upstream *upstream)
+{
+    char name[MAX_ORIGIN_LEN];
+    sprintf(name, "%s:%s", uri_info->hostname, uri_info->port);
+    Origin **bucket = &loop->origins[origin_bucket(name)];
+    Origin *origin;
+    for (origin = *bucket; origin != NULL; origin = origin->next)
+        if (!strcmp(origin->name, name))
+            break;
+
+    if (origin == NULL)
+    {
+        if ((origin = Calloc(1, sizeof(Origin))) == NULL)
+        {
+            drop_upstream(loop, upstream);
+            return;
+        }
+
+        strcpy(origin->name, name);
+        origin->next = *bucket;
+        *bucket = origin;
+    }
+
+    if (origin->idle >= pool_max_idle)
+    {
+        drop_upstream(loop, upstream);
+        return;
+    }
+
+    upstream->endpoint.conn = NULL;
+    upstream->origin = origin;
+    upstream->idle_since = time(NULL);
+    upstream->prev = NULL;
+    upstream->next = origin->head;
+    if (origin->head != NULL)
+        origin->head->prev = upstream;
+    else
+        origin->tail = upstream;
+
+    origin->head = upstream;
+    origin->idle++;
+}
+
+/* Unlinking an idle connection from its origin, empty origins are freed */
+static void pool_remove(Loop *loop, Upstream *upstream)
+{
+    Origin *origin = upstream->origin;
+    if (upstream->prev != NULL)
+        upstream->prev->next = upstream->next;
+    else
+        origin->head = upstream->next;
+
+    if (upstream->next != NULL)
+        upstream->next->prev = upstream->prev;
+    else
+        origin->tail = upstream->prev;
+
+    upstream->origin = NULL;
+    if (--origin->idle > 0)
+        return;
+
+    Origin **link = &loop->origins[origin_bucket(origin->name)];
+    while (*link != origin)
+        link = &(*link)->next;
+
+    *link = origin->next;
+    free(origin);
+}
+
+/* Handling an event on an idle connection. The origin either
+ * closed it or sent something unexpected, so it's dropped. */
+static void pool_check(Loop *loop, Upstream *upstream)
+{
+    /* Dropped earlier in this batch */
+    if (upstream->origin == NULL)
+        return;
+
+    /* Events left over from the previous request */
+    char c;
+    if (recv(upstream->endpoint.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+        (errno == EAGAIN || errno == EWOULDBLOCK))
+        return;
+
+    pool_remove(loop, upstream);
+    drop_upstream(loop, upstream);
+}
+
+/* Closing the connections idle for longer than POOL_IDLE_TIMEOUT */
+static void pool_sweep(Loop *loop, time_t now)
 {
     int i;
-    for (i = 0; i < headers->cout; i++)
-        free(headers->data[i]);
+    for (i = 0; i < ORIGIN_BUCKETS; i++)
+    {
+        Origin *origin = loop->origins[i];
+        while (origin != NULL)
+        {
+            /* The origin is freed with its last connection */
+            Origin *next = origin->next;
+            int idle = origin->idle;
+            while (idle-- > 0 && now - origin->tail->idle_since >= POOL_IDLE_TIMEOUT)
+            {
+                Upstream *upstream = origin->tail;
+                pool_remove(loop, upstream);
+                drop_upstream(loop, upstream);
+            }
+
+            origin = next;
+        }
+    }
+}
+
+/* Hash of the origin name reduced to a bucket index */
+static unsigned int origin_bucket(const char *name)
+{
+    return hash_string(name) & (ORIGIN_BUCKETS - 1);
 }
 
-static int build_cache_key(char key[], size_t length, Uri_info *uri_info)
+/* Closing an upstream connection, it's freed at the end of the event batch */
+static void drop_upstream(Loop *loop, Upstream *upstream)
 {
-    size_t key_length = strlen(uri_info->hostname) +
-                        strlen(uri_info->port) +
-                        strlen(uri_info->query);
-    if (length < key_length + 1)
+    if (upstream->endpoint.fd >= 0)
+        Close(upstream->endpoint.fd);
+
+    upstream->endpoint.fd = -1;
+    upstream->endpoint.conn = NULL;
+    upstream->origin = NULL;
+    upstream->next = loop->dropped;
+    loop->dropped = upstream;
+}
+
+/* Gathering the request for the origin from the parsed one, the header
+ * lines of the client are sent from its buffer as they are. With
+ * validators it asks whether the cached entry they belong to is still
+ * valid, instead of any conditions of the client. Returns the number
+ * of pieces, at most REQUEST_PIECES. */
+static int build_request(Conn *conn, CacheMeta *validators, struct iovec *iov)
+{
+    /* The HTTP request line, HTTP/1.1 keeps the upstream connection open */
+    Request *req = &conn->req;
+    int count = add_piece(iov, 0, "GET ", 4);
+    count = add_piece(iov, count, conn->in + req->path.off, req->path.len);
+    count = add_piece(iov, count, pool_max_idle > 0 ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n", 11);
+    /* The HTTP headers from the request, but the ones the proxy replaces.
+     * Lines that end in CRLF are sent with it, so the lines kept in a row
+     * make up a single piece. */
+    int host_in_headers = 0;
+    int i;
+    for (i = 0; i < req->count; i++)
+    {
+        RequestHeader *header = &req->headers[i];
+        if (header->kind == HEADER_HOST)
+            host_in_headers = 1;
+        else if (header->kind == HEADER_USER_AGENT || HEADER_HOP_BY_HOP(header->kind))
+            continue;
+        else if (validators != NULL &&
+                 (header->kind == HEADER_IF_NONE_MATCH || header->kind == HEADER_IF_MODIFIED_SINCE))
+            continue;
+
+        char *line = conn->in + header->line.off;
+        size_t length = header->line.len;
+        if (line[length] == '\r')
+            count = add_piece(iov, count, line, length + 2);
+        else
+        {
+            count = add_piece(iov, count, line, length);
+            count = add_piece(iov, count, crlf, 2);
+        }
+    }
+
+    /* A Host header */
+    if (!host_in_headers)
+    {
+        count = add_piece(iov, count, "Host: ", 6);
+        count = add_piece(iov, count, conn->uri_info.hostname, strlen(conn->uri_info.hostname));
+        count = add_piece(iov, count, crlf, 2);
+    }
+
+    /* The conditions of a revalidation, the stale entry stays pinned
+     * until the response */
+    if (validators != NULL && validators->etag[0] != '\0')
+    {
+        count = add_piece(iov, count, "If-None-Match: ", 15);
+        count = add_piece(iov, count, validators->etag, strlen(validators->etag));
+        count = add_piece(iov, count, crlf, 2);
+    }
+
+    if (validators != NULL && validators->modified[0] != '\0')
+    {
+        count = add_piece(iov, count, "If-Modified-Since: ", 19);
+        count = add_piece(iov, count, validators->modified, strlen(validators->modified));
+        count = add_piece(iov, count, crlf, 2);
+    }
+
+    /* User-Agent, Connection and Proxy-Connection headers */
+    count = add_piece(iov, count, user_agent_hdr, strlen(user_agent_hdr));
+    if (pool_max_idle > 0)
+        count = add_piece(iov, count, keep_alive_hdr, strlen(keep_alive_hdr));
+    else
+    {
+        count = add_piece(iov, count, connection_hdr, strlen(connection_hdr));
+        count = add_piece(iov, count, proxy_connection_hdr, strlen(proxy_connection_hdr));
+    }
+
+    /* The end of the request */
+    return add_piece(iov, count, crlf, 2);
+}
+
+/* Appending a piece to the request, or growing the last one if the
+ * bytes follow right after it. Returns the new number of pieces. */
+static int add_piece(struct iovec *iov, int count, const char *data, size_t length)
+{
+    if (count > 0 && (char *)iov[count - 1].iov_base + iov[count - 1].iov_len == data)
+    {
+        iov[count - 1].iov_len += length;
+        return count;
+    }
+
+    iov[count].iov_base = (char *)data;
+    iov[count].iov_len = length;
+    return count + 1;
+}
+
+/* Queueing an error page for the client, the connection
+ * is closed once it's written. Always returns 1. */
+static int clienterror(Conn *conn, char *cause, char *errnum,
+                       char *shortmsg, char *longmsg)
+{
+    if (conn->buf == NULL && (conn->buf = Malloc(MAXBUF)) == NULL)
+    {
+        close_conn(conn);
         return 0;
+    }
 
-    memset(key, 0, length);
-    strcat(key, uri_info->hostname);
-    strcat(key, uri_info->port);
-    strcat(key, uri_info->query);
+    /* Print the HTTP response headers and body */
+    int length = snprintf(conn->buf, MAXBUF,
+                          "HTTP/1.0 %s %s\r\n"
+                          "Content-type: text/html\r\n\r\n"
+                          "<html><title>Proxy Error</title>"
+                          "<body bgcolor="
+                          "ffffff"
+                          ">\r\n"
+                          "%s: %s\r\n"
+                          "<p>%s: %.2048s\r\n"
+                          "<hr><em>The Proxy</em>\r\n",
+                          errnum, shortmsg, errnum, shortmsg, longmsg, cause);
+    metrics_add(METRIC_ERRORS, 1);
+    drop_fill(conn);
+    conn->keep_alive = 0;
+    queue_output(conn, conn->buf, length < MAXBUF ? length : MAXBUF - 1, 0);
+    conn->state = WRITE_ERROR;
     return 1;
-}
\ No newline at end of file
+}
+
+static int servererror(Conn *conn)
+{
+    return clienterror(conn, "", "500", "Internal server error",
+                       "Something went wrong");
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr, "usage: %s [-c lru|clock] [-l <event loops>] [-p <idle upstreams per origin>]\n"
+                    "       [-q <lookup buffer size>] [-r <min resolvers>:<max resolvers>]\n"
+                    "       [-d <disk cache dir> [-s <disk cache MB>]]\n"
+                    "       [-v] [-o <log file>] [-f <log flush ms>] <port>\n",
+            name);
+    exit(1);
+}
+
+/* Writing the cache key of the request to the conn, the hostname,
+ * the port and the path. Returns 0 if it's too long to cache. */
+static int build_cache_key(Conn *conn)
+{
+    Request *req = &conn->req;
+    int length = snprintf(conn->key, MAX_KEY_LEN, "%s%s%.*s", conn->uri_info.hostname,
+                          conn->uri_info.port, req->path.len, conn->in + req->path.off);
+    return length < MAX_KEY_LEN;
+}
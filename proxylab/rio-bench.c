@@ -0,0 +1,231 @@
+/*
+ * rio-bench.c - Line reading microbenchmark.
+ *     Reads header-heavy requests from a file line by line and reports
+ *     requests per second for the rio_readline_view scan over the read
+ *     buffer, for the rio_readlineb copy on top of it and, for
+ *     comparison, for the previous rio_readlineb that went through
+ *     rio_read one byte at a time. All of them must see the same lines.
+ *
+ *     usage: ./rio-bench [-n <requests>] [-H <headers per request>]
+ */
+#include <getopt.h>
+#include "csapp.h"
+
+#define DEFAULT_REQUESTS 200000
+#define DEFAULT_HEADERS 32
+
+/* Requests in the file, the runs read it over and over */
+#define FILE_REQUESTS 1000
+
+typedef struct result
+{
+    long lines;
+    long bytes;
+} Result;
+
+static const char *header_lines[] = {
+    "Host: www.example.com\r\n",
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:121.0) Gecko/20100101 Firefox/121.0\r\n",
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n",
+    "Accept-Language: en-US,en;q=0.5\r\n",
+    "Accept-Encoding: gzip, deflate\r\n",
+    "Referer: http://www.example.com/index.html\r\n",
+    "Cookie: session=4f1c2d3e4f5a6b7c8d9e0f1a2b3c4d5e; theme=dark; consent=1\r\n",
+    "DNT: 1\r\n",
+    "If-None-Match: \"5f3a-1c2b3d4e\"\r\n",
+    "If-Modified-Since: Mon, 01 Jan 2024 00:00:00 GMT\r\n",
+    "Cache-Control: max-age=0\r\n",
+    "X-Request-Id: 7d4c1e0a-8b2f-4f3e-9a61-2c5d8e7f9b10\r\n",
+};
+
+/* The previous rio_read, copying a byte at a time for the line reader */
+static ssize_t bytewise_read(rio_t *rp, char *usrbuf, size_t n)
+{
+    int cnt;
+
+    while (rp->rio_cnt <= 0)
+    {
+        rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+        if (rp->rio_cnt < 0)
+        {
+            if (errno != EINTR)
+                return -1;
+        }
+        else if (rp->rio_cnt == 0)
+            return 0;
+        else
+            rp->rio_bufptr = rp->rio_buf;
+    }
+
+    cnt = n;
+    if (rp->rio_cnt < n)
+        cnt = rp->rio_cnt;
+    memcpy(usrbuf, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+
+/* The previous rio_readlineb */
+static ssize_t bytewise_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+    int n, rc;
+    char c, *bufp = usrbuf;
+
+    for (n = 1; n < maxlen; n++)
+    {
+        if ((rc = bytewise_read(rp, &c, 1)) == 1)
+        {
+            *bufp++ = c;
+            if (c == '\n')
+            {
+                n++;
+                break;
+            }
+        }
+        else if (rc == 0)
+        {
+            if (n == 1)
+                return 0;
+            else
+                break;
+        }
+        else
+            return -1;
+    }
+    *bufp = 0;
+    return n - 1;
+}
+
+static void write_all(int fd, const char *buf, size_t n)
+{
+    if (rio_writen(fd, (void *)buf, n) < 0)
+    {
+        fprintf(stderr, "Can't write the request file: %s\n", strerror(errno));
+        exit(1);
+    }
+}
+
+/* Writing FILE_REQUESTS requests of headers header lines each */
+static void write_requests(int fd, int headers)
+{
+    char buf[MAXLINE];
+    int i, j;
+    for (i = 0; i < FILE_REQUESTS; i++)
+    {
+        int n = snprintf(buf, MAXLINE, "GET /static/js/app.%d.js?v=20240101 HTTP/1.1\r\n", i);
+        write_all(fd, buf, n);
+        for (j = 0; j < headers; j++)
+        {
+            const char *line = header_lines[j % (sizeof(header_lines) / sizeof(header_lines[0]))];
+            write_all(fd, line, strlen(line));
+        }
+
+        write_all(fd, "\r\n", 2);
+    }
+}
+
+/* Reading every line of the file with one of the readers, 0 is the view,
+ * 1 the copy and 2 the previous reader. The bytes are summed so the work
+ * on the line can't be left out. */
+static void read_requests(int fd, int reader, Result *result)
+{
+    char buf[MAXLINE], *line;
+    rio_t rio;
+    ssize_t n;
+
+    Lseek(fd, 0, SEEK_SET);
+    Rio_readinitb(&rio, fd);
+    while (1)
+    {
+        if (reader == 0)
+            n = rio_readline_view(&rio, &line, MAXLINE);
+        else if (reader == 1)
+            n = rio_readlineb(&rio, line = buf, MAXLINE);
+        else
+            n = bytewise_readlineb(&rio, line = buf, MAXLINE);
+
+        if (n <= 0)
+            break;
+
+        result->lines++;
+        result->bytes += n + line[n - 1];
+    }
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr, "usage: %s [-n <requests>] [-H <headers per request>]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    long requests = DEFAULT_REQUESTS;
+    int headers = DEFAULT_HEADERS;
+    int c;
+    while ((c = getopt(argc, argv, "n:H:")) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            requests = atol(optarg);
+            break;
+        case 'H':
+            headers = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc || requests < FILE_REQUESTS || headers < 0)
+        usage(argv[0]);
+
+    FILE *file;
+    if ((file = tmpfile()) == NULL)
+    {
+        fprintf(stderr, "Can't create the request file: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    int fd = fileno(file);
+    write_requests(fd, headers);
+    long size = Lseek(fd, 0, SEEK_END);
+    printf("%ld requests of %d headers, %ld bytes each\n", requests, headers, size / FILE_REQUESTS);
+
+    static const char *readers[] = {"view", "copy", "bytewise"};
+    Result results[3];
+    int reader;
+    for (reader = 0; reader < 3; reader++)
+    {
+        Result *result = &results[reader];
+        long runs = requests / FILE_REQUESTS;
+        long run;
+        memset(result, 0, sizeof(Result));
+        double start = now();
+        for (run = 0; run < runs; run++)
+            read_requests(fd, reader, result);
+
+        double elapsed = now() - start;
+        printf("%-9s %10.0f requests/s %8.1f MB/s %7.1f ns/line\n", readers[reader],
+               runs * FILE_REQUESTS / elapsed, runs * size / elapsed / 1e6,
+               elapsed * 1e9 / result->lines);
+    }
+
+    if (results[0].lines != results[2].lines || results[0].bytes != results[2].bytes ||
+        results[1].lines != results[2].lines || results[1].bytes != results[2].bytes)
+    {
+        fprintf(stderr, "The readers disagree\n");
+        exit(1);
+    }
+
+    return 0;
+}
@@ -0,0 +1,256 @@
+/*
+ * sbuf-bench.c - Handoff microbenchmark for sbuf.
+ *     Producers hand <ops> items over to consumers through one queue and
+ *     the handoff rate is reported for every combination of 1 up to
+ *     <max threads> producers and consumers. Runs the lock-free ring,
+ *     the per-worker queues with work stealing and, for comparison,
+ *     the semaphore-based queue sbuf used to be.
+ *
+ *     usage: ./sbuf-bench [-n <ops>] [-s <queue size>] [-t <max threads>]
+ */
+#include <getopt.h>
+#include "sbuf.h"
+
+#define DEFAULT_OPS 1000000
+#define DEFAULT_QUEUE_SIZE 16
+#define DEFAULT_MAX_THREADS 32
+
+/* Queue under test */
+#define QUEUE_SEM 0
+#define QUEUE_RING 1
+#define QUEUE_POOL 2
+
+/* Semaphore-based bounded buffer from CS:APP, the previous sbuf */
+typedef struct {
+    void **buf;
+    int n;
+    int front;
+    int rear;
+    sem_t mutex;
+    sem_t slots;
+    sem_t items;
+} sem_queue_t;
+
+typedef struct worker
+{
+    pthread_t tid;
+    int id;
+    long ops;
+} Worker;
+
+static int queue_kind;
+static sem_queue_t sem_queue;
+static sbuf_t ring;
+static sbuf_pool_t pool;
+
+static void sem_queue_init(sem_queue_t *sq, int n)
+{
+    sq->buf = Calloc(n, sizeof(void *));
+    sq->n = n;
+    sq->front = sq->rear = 0;
+    Sem_init(&sq->mutex, 0, 1);
+    Sem_init(&sq->slots, 0, n);
+    Sem_init(&sq->items, 0, 0);
+}
+
+static void sem_queue_insert(sem_queue_t *sq, void *item)
+{
+    Sem_wait(&sq->slots);
+    Sem_wait(&sq->mutex);
+    sq->buf[(++sq->rear) % (sq->n)] = item;
+    Sem_post(&sq->mutex);
+    Sem_post(&sq->items);
+}
+
+static void *sem_queue_remove(sem_queue_t *sq)
+{
+    Sem_wait(&sq->items);
+    Sem_wait(&sq->mutex);
+    void *item = sq->buf[(++sq->front) % (sq->n)];
+    Sem_post(&sq->mutex);
+    Sem_post(&sq->slots);
+    return item;
+}
+
+static void insert(int worker, void *item)
+{
+    switch (queue_kind)
+    {
+    case QUEUE_SEM:
+        sem_queue_insert(&sem_queue, item);
+        break;
+    case QUEUE_RING:
+        sbuf_insert(&ring, item);
+        break;
+    default:
+        sbuf_pool_insert(&pool, worker, item);
+    }
+}
+
+static void *remove_item(int worker)
+{
+    void *item;
+    switch (queue_kind)
+    {
+    case QUEUE_SEM:
+        return sem_queue_remove(&sem_queue);
+    case QUEUE_RING:
+        sbuf_remove(&ring, &item);
+        return item;
+    default:
+        sbuf_pool_remove(&pool, worker, &item);
+        return item;
+    }
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *producer(void *vargp)
+{
+    Worker *w = vargp;
+    long n;
+    for (n = 0; n < w->ops; n++)
+        insert(w->id, (void *)(n + 1));
+
+    return NULL;
+}
+
+/* Consumes items until it gets a NULL, every consumer gets one at the end */
+static void *consumer(void *vargp)
+{
+    Worker *w = vargp;
+    while (remove_item(w->id) != NULL)
+        w->ops++;
+
+    return NULL;
+}
+
+/* Returns the handoffs per second from the producers to the consumers */
+static double run(int nproducers, int nconsumers, long ops)
+{
+    Worker *producers = Calloc(nproducers, sizeof(Worker));
+    Worker *consumers = Calloc(nconsumers, sizeof(Worker));
+    double start = now_ns();
+    int i;
+    for (i = 0; i < nconsumers; i++)
+    {
+        consumers[i].id = i;
+        Pthread_create(&consumers[i].tid, NULL, consumer, &consumers[i]);
+    }
+
+    for (i = 0; i < nproducers; i++)
+    {
+        producers[i].id = i;
+        producers[i].ops = ops / nproducers + (i < ops % nproducers);
+        Pthread_create(&producers[i].tid, NULL, producer, &producers[i]);
+    }
+
+    for (i = 0; i < nproducers; i++)
+        Pthread_join(producers[i].tid, NULL);
+
+    /* A consumer may steal its NULL from another queue while its own still
+     * has items, so the pool is drained before the NULLs go in */
+    if (queue_kind == QUEUE_POOL)
+    {
+        for (i = 0; i < pool.count; i++)
+        {
+            sbuf_t *sp = &pool.queues[i];
+            while (__atomic_load_n(&sp->front, __ATOMIC_ACQUIRE) != __atomic_load_n(&sp->rear, __ATOMIC_ACQUIRE))
+                sched_yield();
+        }
+    }
+
+    for (i = 0; i < nconsumers; i++)
+        insert(i, NULL);
+
+    long done = 0;
+    for (i = 0; i < nconsumers; i++)
+    {
+        Pthread_join(consumers[i].tid, NULL);
+        done += consumers[i].ops;
+    }
+
+    double elapsed = now_ns() - start;
+    if (done != ops)
+    {
+        fprintf(stderr, "Lost items: %ld of %ld handed over\n", done, ops);
+        exit(1);
+    }
+
+    free(producers);
+    free(consumers);
+    return done / elapsed * 1e9;
+}
+
+static void usage(char *name)
+{
+    fprintf(stderr, "usage: %s [-n <ops>] [-s <queue size>] [-t <max threads>]\n", name);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    long ops = DEFAULT_OPS;
+    int queue_size = DEFAULT_QUEUE_SIZE;
+    int max_threads = DEFAULT_MAX_THREADS;
+    int c;
+    while ((c = getopt(argc, argv, "n:s:t:")) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            ops = atol(optarg);
+            break;
+        case 's':
+            queue_size = atoi(optarg);
+            break;
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc || ops <= 0 || queue_size <= 0 || max_threads <= 0)
+        usage(argv[0]);
+
+    char *names[] = {"sem", "ring", "pool"};
+    printf("%ld handoffs per run, queue size %d\n", ops, queue_size);
+    printf("queue producers consumers       ops/sec\n");
+    for (queue_kind = QUEUE_SEM; queue_kind <= QUEUE_POOL; queue_kind++)
+    {
+        int nproducers, nconsumers;
+        for (nproducers = 1; nproducers <= max_threads; nproducers *= 2)
+        {
+            for (nconsumers = 1; nconsumers <= max_threads; nconsumers *= 2)
+            {
+                /* Fresh queues for every run, the pool gets one per consumer */
+                if (queue_kind == QUEUE_SEM)
+                    sem_queue_init(&sem_queue, queue_size);
+                else if (queue_kind == QUEUE_RING && sbuf_init(&ring, queue_size) < 0)
+                    exit(1);
+                else if (queue_kind == QUEUE_POOL && sbuf_pool_init(&pool, nconsumers, queue_size) < 0)
+                    exit(1);
+
+                double rate = run(nproducers, nconsumers, ops);
+                printf("%-5s %9d %9d %13.0f\n", names[queue_kind], nproducers, nconsumers, rate);
+                fflush(stdout);
+
+                if (queue_kind == QUEUE_SEM)
+                    free(sem_queue.buf);
+                else if (queue_kind == QUEUE_RING)
+                    sbuf_free(&ring);
+                else
+                    sbuf_pool_free(&pool);
+            }
+        }
+    }
+
+    return 0;
+}
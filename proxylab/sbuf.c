@@ -1,19 +1,32 @@
 #include "sbuf.h"
 
+static int try_insert(sbuf_t *sp, void *item);
+static int try_remove(sbuf_t *sp, void **item);
+static int init_event(sbuf_event_t *ev);
+static void prepare_wait(sbuf_event_t *ev);
+static void cancel_wait(sbuf_event_t *ev);
+static void commit_wait(sbuf_event_t *ev);
+static int timed_wait(sbuf_event_t *ev, struct timespec *deadline);
+static void signal_event(sbuf_event_t *ev);
+
+/* Initializes a queue with room for at least n items, the number of
+ * slots is rounded up to a power of two */
 int sbuf_init(sbuf_t *sp, int n)
 {
-    if ((sp->buf = Calloc(n, sizeof(int))) < 0)
-        return -1;
+    size_t size = 2;
+    while (size < (size_t)n)
+        size <<= 1;
 
-    sp->n = n;
-    sp->front = sp->rear = 0;
-    if (Sem_init(&sp->mutex, 0, 1) < 0)
+    if ((sp->buf = Calloc(size, sizeof(sbuf_slot_t))) == NULL)
         return -1;
 
-    if (Sem_init(&sp->slots, 0, n) < 0)
-        return -1;
+    size_t i;
+    for (i = 0; i < size; i++)
+        sp->buf[i].seq = i;
 
-    if (Sem_init(&sp->items, 0, 0) < 0)
+    sp->mask = size - 1;
+    sp->front = sp->rear = 0;
+    if (init_event(&sp->items) < 0 || init_event(&sp->slots) < 0)
         return -1;
 
     return 0;
@@ -24,38 +37,325 @@ void sbuf_free(sbuf_t *sp)
     Free(sp->buf);
 }
 
-int sbuf_insert(sbuf_t *sp, int item)
+int sbuf_insert(sbuf_t *sp, void *item)
 {
-    if (Sem_wait(&sp->slots) < 0)
-        return -1;
+    int spins = 0;
+    while (!try_insert(sp, item))
+    {
+        if (++spins < SBUF_SPINS)
+            continue;
 
-    if (Sem_wait(&sp->mutex) < 0)
-        return -1;
+        /* Sleeping until a remove frees a slot */
+        prepare_wait(&sp->slots);
+        if (try_insert(sp, item))
+        {
+            cancel_wait(&sp->slots);
+            break;
+        }
 
-    sp->buf[(++sp->rear) % (sp->n)] = item;
-    if (Sem_post(&sp->mutex) < 0)
-        return -1;
+        commit_wait(&sp->slots);
+    }
 
-    if (Sem_post(&sp->items) < 0)
-        return -1;
+    signal_event(&sp->items);
+    return 0;
+}
+
+/* Same as sbuf_insert, but never waits for a slot. Returns 1 if the item
+ * is inserted, 0 if the buffer is full and -1 on error. */
+int sbuf_tryinsert(sbuf_t *sp, void *item)
+{
+    if (!try_insert(sp, item))
+        return 0;
+
+    signal_event(&sp->items);
+    return 1;
+}
 
+int sbuf_remove(sbuf_t *sp, void **item)
+{
+    int spins = 0;
+    while (!try_remove(sp, item))
+    {
+        if (++spins < SBUF_SPINS)
+            continue;
+
+        /* Sleeping until an insert brings an item */
+        prepare_wait(&sp->items);
+        if (try_remove(sp, item))
+        {
+            cancel_wait(&sp->items);
+            break;
+        }
+
+        commit_wait(&sp->items);
+    }
+
+    signal_event(&sp->slots);
     return 0;
 }
 
-int sbuf_remove(sbuf_t *sp, int *item)
+/* Same as sbuf_remove, but never waits for an item. Returns 1 if an item
+ * is removed, 0 if the buffer is empty. */
+int sbuf_tryremove(sbuf_t *sp, void **item)
 {
-    if (Sem_wait(&sp->items) < 0)
-        return -1;
+    if (!try_remove(sp, item))
+        return 0;
 
-    if (Sem_wait(&sp->mutex) < 0)
-        return -1;
+    signal_event(&sp->slots);
+    return 1;
+}
 
-    *item = sp->buf[(++sp->front) % (sp->n)];
-    if (Sem_post(&sp->mutex) < 0)
-        return -1;
+/* Same as sbuf_remove, but gives up once the queue has stayed empty for
+ * timeout_ms. Returns 1 if an item is removed, 0 on timeout. */
+int sbuf_timedremove(sbuf_t *sp, void **item, int timeout_ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    int spins = 0;
+    while (!try_remove(sp, item))
+    {
+        if (++spins < SBUF_SPINS)
+            continue;
+
+        prepare_wait(&sp->items);
+        if (try_remove(sp, item))
+        {
+            cancel_wait(&sp->items);
+            break;
+        }
+
+        /* One last look at the queue after the timeout */
+        if (!timed_wait(&sp->items, &deadline))
+            return sbuf_tryremove(sp, item);
+    }
+
+    signal_event(&sp->slots);
+    return 1;
+}
+
+/* Number of items in the queue, only a hint while others use it */
+int sbuf_count(sbuf_t *sp)
+{
+    size_t front = __atomic_load_n(&sp->front, __ATOMIC_RELAXED);
+    size_t rear = __atomic_load_n(&sp->rear, __ATOMIC_RELAXED);
+    return rear > front ? (int)(rear - front) : 0;
+}
 
-    if (Sem_post(&sp->slots) < 0)
+/* Initializes count queues with room for at least n items each */
+int sbuf_pool_init(sbuf_pool_t *pp, int count, int n)
+{
+    if ((pp->queues = Calloc(count, sizeof(sbuf_t))) == NULL)
         return -1;
 
-    return 0;
-}
\ No newline at end of file
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        if (sbuf_init(&pp->queues[i], n) < 0)
+            return -1;
+    }
+
+    pp->count = count;
+    return init_event(&pp->items);
+}
+
+void sbuf_pool_free(sbuf_pool_t *pp)
+{
+    int i;
+    for (i = 0; i < pp->count; i++)
+        sbuf_free(&pp->queues[i]);
+
+    Free(pp->queues);
+}
+
+/* Inserts the item into the queue of the worker, or into the next one
+ * with a free slot if it's full. Only sleeps if all the queues are full. */
+int sbuf_pool_insert(sbuf_pool_t *pp, int worker, void *item)
+{
+    sbuf_t *own = &pp->queues[worker % pp->count];
+    while (1)
+    {
+        int i;
+        for (i = 0; i < pp->count; i++)
+        {
+            if (try_insert(&pp->queues[(worker + i) % pp->count], item))
+            {
+                signal_event(&pp->items);
+                return 0;
+            }
+        }
+
+        /* Sleeping until a remove frees a slot in the worker's queue */
+        prepare_wait(&own->slots);
+        if (try_insert(own, item))
+        {
+            cancel_wait(&own->slots);
+            signal_event(&pp->items);
+            return 0;
+        }
+
+        commit_wait(&own->slots);
+    }
+}
+
+/* Removes an item from the queue of the worker, or steals one from
+ * the other queues if it's empty. Only sleeps if all the queues are empty. */
+int sbuf_pool_remove(sbuf_pool_t *pp, int worker, void **item)
+{
+    while (1)
+    {
+        int pass;
+        for (pass = 0; pass < 2; pass++)
+        {
+            int i;
+            for (i = 0; i < pp->count; i++)
+            {
+                sbuf_t *sp = &pp->queues[(worker + i) % pp->count];
+                if (try_remove(sp, item))
+                {
+                    if (pass > 0)
+                        cancel_wait(&pp->items);
+
+                    signal_event(&sp->slots);
+                    return 0;
+                }
+            }
+
+            /* Checking all the queues again once registered as a sleeper */
+            if (pass == 0)
+                prepare_wait(&pp->items);
+        }
+
+        commit_wait(&pp->items);
+    }
+}
+
+/* Claims the slot at the rear if it's free. Returns 0 if the queue is full. */
+static int try_insert(sbuf_t *sp, void *item)
+{
+    size_t pos = __atomic_load_n(&sp->rear, __ATOMIC_RELAXED);
+    while (1)
+    {
+        sbuf_slot_t *slot = &sp->buf[pos & sp->mask];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)(seq - pos);
+        if (diff == 0)
+        {
+            /* A failed exchange reloads pos */
+            if (__atomic_compare_exchange_n(&sp->rear, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                slot->item = item;
+                __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+        else if (diff < 0)
+            return 0; /* The slot still holds the item from a lap ago */
+        else
+            pos = __atomic_load_n(&sp->rear, __ATOMIC_RELAXED);
+    }
+}
+
+/* Takes the item at the front if it's there. Returns 0 if the queue is empty. */
+static int try_remove(sbuf_t *sp, void **item)
+{
+    size_t pos = __atomic_load_n(&sp->front, __ATOMIC_RELAXED);
+    while (1)
+    {
+        sbuf_slot_t *slot = &sp->buf[pos & sp->mask];
+        size_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        long diff = (long)(seq - (pos + 1));
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&sp->front, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                *item = slot->item;
+                __atomic_store_n(&slot->seq, pos + sp->mask + 1, __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+        else if (diff < 0)
+            return 0; /* The insert for this position hasn't happened yet */
+        else
+            pos = __atomic_load_n(&sp->front, __ATOMIC_RELAXED);
+    }
+}
+
+static int init_event(sbuf_event_t *ev)
+{
+    ev->waiters = 0;
+    return Sem_init(&ev->sleep, 0, 0);
+}
+
+/* Registers a sleeper before its last check of the queue. Any insert or
+ * remove the check misses then sees the sleeper and wakes it up. */
+static void prepare_wait(sbuf_event_t *ev)
+{
+    __atomic_add_fetch(&ev->waiters, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+/* Takes a sleeper back off waiters. If a wakeup got to it first,
+ * the post it made is taken instead. */
+static void cancel_wait(sbuf_event_t *ev)
+{
+    int waiters = __atomic_load_n(&ev->waiters, __ATOMIC_SEQ_CST);
+    while (waiters > 0)
+    {
+        if (__atomic_compare_exchange_n(&ev->waiters, &waiters, waiters - 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            return;
+    }
+
+    Sem_wait(&ev->sleep);
+}
+
+static void commit_wait(sbuf_event_t *ev)
+{
+    Sem_wait(&ev->sleep);
+}
+
+/* Same as commit_wait, but takes the sleeper back off waiters at the
+ * deadline. Returns 0 on timeout. */
+static int timed_wait(sbuf_event_t *ev, struct timespec *deadline)
+{
+    while (sem_timedwait(&ev->sleep, deadline) < 0)
+    {
+        if (errno == EINTR)
+            continue;
+
+        if (errno != ETIMEDOUT)
+            unix_error("sem_timedwait error");
+
+        cancel_wait(ev);
+        return 0;
+    }
+
+    return 1;
+}
+
+/* Wakes up one sleeper. Without any, which is the common case,
+ * it's a single load. */
+static void signal_event(sbuf_event_t *ev)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    int waiters = __atomic_load_n(&ev->waiters, __ATOMIC_SEQ_CST);
+    while (waiters > 0)
+    {
+        if (__atomic_compare_exchange_n(&ev->waiters, &waiters, waiters - 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        {
+            Sem_post(&ev->sleep);
+            return;
+        }
+    }
+}
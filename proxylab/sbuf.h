@@ -1,16 +1,57 @@
 #include "csapp.h"
 
+/* Bounded multi-producer/multi-consumer queue of pointers. Inserts and
+ * removes claim a slot with a single compare-and-swap, a thread only
+ * touches a semaphore when the queue is full or empty. */
+
+/* Size of a cache line, the positions and events each get their own */
+#define SBUF_LINE 64
+
+/* Attempts made before a blocking insert or remove goes to sleep */
+#define SBUF_SPINS 64
+
+/* Slot of the ring, seq tells whether it's free for the insert or the
+ * remove at a given position */
+typedef struct {
+    size_t seq;
+    void *item;
+} sbuf_slot_t;
+
+/* Threads about to sleep until the queue changes. A wakeup takes one of
+ * them off waiters and posts sleep for it. */
 typedef struct {
-    int *buf;
-    int n;
-    int front;
-    int rear;
-    sem_t mutex;
-    sem_t slots;
-    sem_t items;
+    int waiters;
+    sem_t sleep;
+} sbuf_event_t;
+
+typedef struct {
+    sbuf_slot_t *buf;
+    size_t mask; /* Number of slots minus one, a power of two */
+    size_t front __attribute__((aligned(SBUF_LINE))); /* Next position to remove */
+    size_t rear __attribute__((aligned(SBUF_LINE)));  /* Next position to insert */
+    sbuf_event_t items __attribute__((aligned(SBUF_LINE)));
+    sbuf_event_t slots;
 } sbuf_t;
 
+/* One queue per worker. Items are inserted into the queue of a given
+ * worker, a worker whose queue is empty steals from the others before
+ * it goes to sleep. */
+typedef struct {
+    sbuf_t *queues;
+    int count;
+    sbuf_event_t items __attribute__((aligned(SBUF_LINE)));
+} sbuf_pool_t;
+
 int sbuf_init(sbuf_t *sp, int n);
 void sbuf_free(sbuf_t *sp);
-int sbuf_insert(sbuf_t *sp, int item);
-int sbuf_remove(sbuf_t *sp, int *item);
\ No newline at end of file
+int sbuf_insert(sbuf_t *sp, void *item);
+int sbuf_tryinsert(sbuf_t *sp, void *item);
+int sbuf_remove(sbuf_t *sp, void **item);
+int sbuf_tryremove(sbuf_t *sp, void **item);
+int sbuf_timedremove(sbuf_t *sp, void **item, int timeout_ms);
+int sbuf_count(sbuf_t *sp);
+
+int sbuf_pool_init(sbuf_pool_t *pp, int count, int n);
+void sbuf_pool_free(sbuf_pool_t *pp);
+int sbuf_pool_insert(sbuf_pool_t *pp, int worker, void *item);
+int sbuf_pool_remove(sbuf_pool_t *pp, int worker, void **item);
@@ -0,0 +1,20 @@
+/* splice is a Linux extension, it's declared only with _GNU_SOURCE,
+ * which conflicts with csapp.h, so this file doesn't include it */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include "splice.h"
+
+/* Opens a non-blocking pipe for moving bytes between two sockets */
+int splice_pipe(int fds[2])
+{
+    return pipe2(fds, O_NONBLOCK);
+}
+
+/* Moves up to length bytes from one descriptor to the other, one of them
+ * must be a pipe. The bytes never get copied to user space. Returns the
+ * number of bytes moved, 0 at the end of the input or -1 with errno set. */
+ssize_t splice_move(int from, int to, size_t length)
+{
+    return splice(from, NULL, to, NULL, length, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+}
@@ -0,0 +1,7 @@
+#include <sys/types.h>
+
+/* Bytes moved per splice call, the default capacity of a pipe */
+#define SPLICE_PIPE_SIZE 65536
+
+int splice_pipe(int fds[2]);
+ssize_t splice_move(int from, int to, size_t length);
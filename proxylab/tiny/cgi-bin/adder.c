@@ -1,37 +1,58 @@
 /*
  * adder.c - a minimal CGI program that adds two numbers together
+ *
+ * Started by tiny -w with CGI_WORKER set, it's a persistent worker that
+ * answers requests on stdin and stdout instead, see workers.h.
  */
 /* $begin adder */
 #include "csapp.h"
 
-int main(void) {
-    char *buf, *p;
-    char arg1[MAXLINE], arg2[MAXLINE], content[MAXLINE];
+/* Make the output for a query string, returns its length */
+static int add(char *query, char *output) {
+    char *p;
+    char content[MAXLINE];
     int n1=0, n2=0;
 
     /* Extract the two arguments */
-    if ((buf = getenv("QUERY_STRING")) != NULL) {
-	p = strchr(buf, '&');
-	*p = '\0';
-	strcpy(arg1, buf);
-	strcpy(arg2, p+1);
-	n1 = atoi(arg1);
-	n2 = atoi(arg2);
+    if (query != NULL) {
+	n1 = atoi(query);
+	if ((p = strchr(query, '&')) != NULL)
+	    n2 = atoi(p+1);
     }
 
     /* Make the response body */
-    sprintf(content, "Welcome to add.com: ");
-    sprintf(content, "%sTHE Internet addition portal.\r\n<p>", content);
-    sprintf(content, "%sThe answer is: %d + %d = %d\r\n<p>", 
-	    content, n1, n2, n1 + n2);
-    sprintf(content, "%sThanks for visiting!\r\n", content);
-  
+    sprintf(content, "Welcome to add.com: THE Internet addition portal.\r\n<p>"
+	    "The answer is: %d + %d = %d\r\n<p>"
+	    "Thanks for visiting!\r\n", n1, n2, n1 + n2);
+
     /* Generate the HTTP response */
-    printf("Connection: close\r\n");
-    printf("Content-length: %d\r\n", (int)strlen(content));
-    printf("Content-type: text/html\r\n\r\n");
-    printf("%s", content);
-    fflush(stdout);
+    return sprintf(output, "Connection: close\r\n"
+		   "Content-length: %d\r\n"
+		   "Content-type: text/html\r\n\r\n%s", (int)strlen(content), content);
+}
+
+int main(void) {
+    char query[MAXLINE], output[MAXBUF];
+    size_t length;
+    int n;
+
+    if (getenv("CGI_WORKER") == NULL) {
+	n = add(getenv("QUERY_STRING"), output);
+	fwrite(output, 1, n, stdout);
+	fflush(stdout);
+	exit(0);
+    }
+
+    /* One framed request after the other, until tiny closes the socket */
+    while (scanf("%zu", &length) == 1 && getchar() == '\n' && length < MAXLINE) {
+	if (fread(query, 1, length, stdin) != length)
+	    break;
+	query[length] = '\0';
+	n = add(query, output);
+	printf("%d\n", n);
+	fwrite(output, 1, n, stdout);
+	fflush(stdout);
+    }
 
     exit(0);
 }
@@ -880,37 +880,94 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 /* $end rio_readnb */
 
 /*
- * rio_readlineb - Robustly read a text line (buffered)
+ * rio_readline_view - Find the next text line in the internal buffer (buffered)
+ *     Sets *line to the line where it lies in the internal buffer, without
+ *     copying it, and returns its length with the newline. The line stays
+ *     valid until the next read from rp. A line longer than maxlen - 1
+ *     bytes, or than the buffer, comes in several parts. Returns 0 on EOF
+ *     and -1 on error, like rio_readlineb.
  */
-/* $begin rio_readlineb */
-ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+/* $begin rio_readline_view */
+ssize_t rio_readline_view(rio_t *rp, char **line, size_t maxlen)
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
+    size_t limit, cnt, scanned = 0;
+    ssize_t nread;
+    char *end;
+
+    if (maxlen <= 1)
+        return 0;
+    limit = maxlen - 1 < sizeof(rp->rio_buf) ? maxlen - 1 : sizeof(rp->rio_buf);
 
-    for (n = 1; n < maxlen; n++)
+    while (1)
     {
-        if ((rc = rio_read(rp, &c, 1)) == 1)
+        /* memchr scans a word or a vector at a time, each byte only once */
+        cnt = (size_t)rp->rio_cnt < limit ? (size_t)rp->rio_cnt : limit;
+        if ((end = memchr(rp->rio_bufptr + scanned, '\n', cnt - scanned)) != NULL)
         {
-            *bufp++ = c;
-            if (c == '\n')
-            {
-                n++;
-                break;
-            }
+            cnt = end - rp->rio_bufptr + 1;
+            break;
         }
-        else if (rc == 0)
+        if (cnt == limit) /* A part of a longer line */
+            break;
+        scanned = cnt;
+
+        /* Moving the start of the line to the front to read the rest after it */
+        if (rp->rio_bufptr != rp->rio_buf)
         {
-            if (n == 1)
-                return 0; /* EOF, no data read */
-            else
-                break; /* EOF, some data was read */
+            memmove(rp->rio_buf, rp->rio_bufptr, rp->rio_cnt);
+            rp->rio_bufptr = rp->rio_buf;
+        }
+        nread = read(rp->rio_fd, rp->rio_buf + rp->rio_cnt, sizeof(rp->rio_buf) - rp->rio_cnt);
+        if (nread < 0)
+        {
+            if (errno != EINTR) /* Interrupted by sig handler return */
+                return -1;
+        }
+        else if (nread == 0) /* EOF, the last line has no newline */
+        {
+            if (rp->rio_cnt == 0)
+                return 0;
+            cnt = rp->rio_cnt;
+            break;
         }
         else
+            rp->rio_cnt += nread;
+    }
+
+    *line = rp->rio_bufptr;
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+/* $end rio_readline_view */
+
+/*
+ * rio_readlineb - Robustly read a text line (buffered)
+ *     A copy of the lines from rio_readline_view, NUL terminated.
+ */
+/* $begin rio_readlineb */
+ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
+{
+    size_t n = 0;
+    ssize_t cnt;
+    char *line, *bufp = usrbuf;
+
+    if (maxlen == 0)
+        return 0;
+
+    while (n + 1 < maxlen)
+    {
+        if ((cnt = rio_readline_view(rp, &line, maxlen - n)) < 0)
             return -1; /* Error */
+        else if (cnt == 0)
+            break; /* EOF */
+        memcpy(bufp + n, line, cnt);
+        n += cnt;
+        if (line[cnt - 1] == '\n')
+            break;
     }
-    *bufp = 0;
-    return n - 1;
+    bufp[n] = 0;
+    return n;
 }
 /* $end rio_readlineb */
 
@@ -930,9 +987,10 @@ void Rio_writen(int fd, void *usrbuf, size_t n, jmp_buf jmp)
 {
     if (rio_writen(fd, usrbuf, n) < 0)
     {
-        unix_error("Rio_writen error");
-        if (errno == EPIPE)
+        /* unix_error exits, a client going away is not an error of the server */
+        if (errno == EPIPE || errno == ECONNRESET)
             longjmp(jmp, 1);
+        unix_error("Rio_writen error");
     }
 }
 
@@ -959,6 +1017,15 @@ ssize_t Rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen)
     return rc;
 }
 
+ssize_t Rio_readline_view(rio_t *rp, char **line, size_t maxlen)
+{
+    ssize_t rc;
+
+    if ((rc = rio_readline_view(rp, line, maxlen)) < 0)
+        fprintf(stderr, "%s: %s\n", "Rio_readline_view error", strerror(errno));
+    return rc;
+}
+
 /********************************
  * Client/server helper functions
  ********************************/
@@ -0,0 +1,202 @@
+#include "filecache.h"
+#include "hash.h"
+
+static FileEntry *open_file(const char *path, unsigned int hash);
+static int unchanged(FileEntry *entry, struct stat *st);
+static FileEntry *find_entry(FileCache *files, const char *path, unsigned int hash);
+static void remove_entry(FileCache *files, FileEntry *entry);
+static void append_lru(FileCache *files, FileEntry *entry);
+static void remove_lru(FileCache *files, FileEntry *entry);
+static void unpin(FileEntry *entry);
+
+int file_init(FileCache *files)
+{
+    files->count = 0;
+    files->hits = 0;
+    files->misses = 0;
+    files->changed = 0;
+    files->evicted = 0;
+    memset(files->buckets, 0, sizeof(files->buckets));
+    files->lru_head = NULL;
+    files->lru_tail = NULL;
+    if (pthread_mutex_init(&files->lock, NULL) != 0)
+        return -1;
+
+    return 0;
+}
+
+/* Open file at path, st is a stat of the path taken by the caller. An
+ * entry opened before the file changed is replaced. Returns the pinned
+ * entry, which must be given back with file_release, or NULL if the file
+ * can't be opened. */
+FileEntry *file_get(FileCache *files, const char *path, struct stat *st)
+{
+    unsigned int hash = hash_string(path);
+    pthread_mutex_lock(&files->lock);
+    FileEntry *entry = find_entry(files, path, hash);
+    if (entry != NULL && unchanged(entry, st))
+    {
+        entry->refs++;
+        files->hits++;
+        remove_lru(files, entry);
+        append_lru(files, entry);
+        pthread_mutex_unlock(&files->lock);
+        return entry;
+    }
+
+    if (entry != NULL)
+    {
+        remove_entry(files, entry);
+        files->changed++;
+    }
+
+    files->misses++;
+    pthread_mutex_unlock(&files->lock);
+
+    /* Opening outside the lock, the hits of other files go on meanwhile */
+    if ((entry = open_file(path, hash)) == NULL)
+        return NULL;
+
+    /* Unless another thread added the file first, the entry stays for the
+     * next requests. An evicted entry still in use is closed by its last
+     * file_release. */
+    pthread_mutex_lock(&files->lock);
+    if (find_entry(files, path, hash) == NULL)
+    {
+        if (files->count >= FILE_ENTRIES)
+        {
+            remove_entry(files, files->lru_head);
+            files->evicted++;
+        }
+
+        FileEntry **bucket = &files->buckets[hash & (FILE_BUCKETS - 1)];
+        entry->next = *bucket;
+        *bucket = entry;
+        append_lru(files, entry);
+        entry->refs++;
+        files->count++;
+    }
+
+    pthread_mutex_unlock(&files->lock);
+    return entry;
+}
+
+/* Dropping a reference to an entry, the last one closes the file */
+void file_release(FileCache *files, FileEntry *entry)
+{
+    pthread_mutex_lock(&files->lock);
+    unpin(entry);
+    pthread_mutex_unlock(&files->lock);
+}
+
+/* Dropping the entry of a path whose stat failed, so that the descriptor
+ * of a deleted file isn't kept open */
+void file_forget(FileCache *files, const char *path)
+{
+    unsigned int hash = hash_string(path);
+    pthread_mutex_lock(&files->lock);
+    FileEntry *entry = find_entry(files, path, hash);
+    if (entry != NULL)
+    {
+        remove_entry(files, entry);
+        files->changed++;
+    }
+
+    pthread_mutex_unlock(&files->lock);
+}
+
+/* New entry with a single reference. Its identity comes from the open
+ * descriptor, so a file replaced after the caller's stat is seen as
+ * changed on the next request. */
+static FileEntry *open_file(const char *path, unsigned int hash)
+{
+    int fd;
+    struct stat st;
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return NULL;
+
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    size_t path_size = strlen(path) + 1;
+    FileEntry *entry = Calloc(1, sizeof(FileEntry) + path_size);
+    entry->path = (char *)(entry + 1);
+    memcpy(entry->path, path, path_size);
+    entry->hash = hash;
+    entry->refs = 1;
+    entry->fd = fd;
+    entry->size = st.st_size;
+    entry->dev = st.st_dev;
+    entry->ino = st.st_ino;
+    entry->mtime = st.st_mtim;
+    return entry;
+}
+
+static int unchanged(FileEntry *entry, struct stat *st)
+{
+    return entry->dev == st->st_dev && entry->ino == st->st_ino &&
+           entry->size == (size_t)st->st_size &&
+           entry->mtime.tv_sec == st->st_mtim.tv_sec && entry->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static FileEntry *find_entry(FileCache *files, const char *path, unsigned int hash)
+{
+    FileEntry *entry;
+    for (entry = files->buckets[hash & (FILE_BUCKETS - 1)]; entry != NULL; entry = entry->next)
+        if (entry->hash == hash && !strcmp(entry->path, path))
+            return entry;
+
+    return NULL;
+}
+
+/* Unlinking an entry and dropping the cache reference, called with the lock held */
+static void remove_entry(FileCache *files, FileEntry *entry)
+{
+    FileEntry **link = &files->buckets[entry->hash & (FILE_BUCKETS - 1)];
+    while (*link != entry)
+        link = &(*link)->next;
+
+    *link = entry->next;
+    remove_lru(files, entry);
+    files->count--;
+    unpin(entry);
+}
+
+/* Appending an entry to the end of the LRU list */
+static void append_lru(FileCache *files, FileEntry *entry)
+{
+    entry->lru_next = NULL;
+    entry->lru_prev = files->lru_tail;
+    if (files->lru_tail != NULL)
+        files->lru_tail->lru_next = entry;
+    else
+        files->lru_head = entry;
+
+    files->lru_tail = entry;
+}
+
+/* Removing an entry from the LRU list */
+static void remove_lru(FileCache *files, FileEntry *entry)
+{
+    if (entry->lru_prev != NULL)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        files->lru_head = entry->lru_next;
+
+    if (entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        files->lru_tail = entry->lru_prev;
+}
+
+static void unpin(FileEntry *entry)
+{
+    if (--entry->refs > 0)
+        return;
+
+    close(entry->fd);
+    free(entry);
+}
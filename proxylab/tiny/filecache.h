@@ -0,0 +1,55 @@
+#include "csapp.h"
+
+/* Open static files, shared by the server threads. An entry keeps the
+ * descriptor, so a hit costs no open, and the file is sent from it with
+ * sendfile at explicit offsets. The stat every request does anyway tells
+ * whether the file changed since, a changed entry is replaced, and a
+ * path whose stat fails is forgotten. Once FILE_ENTRIES files are open,
+ * a new one takes the place of the least recently used. */
+
+/* Number of hash buckets, a power of two */
+#define FILE_BUCKETS 64
+
+/* Files kept open at most by the cache */
+#define FILE_ENTRIES 256
+
+typedef struct file_cache FileCache;
+typedef struct file_entry FileEntry;
+
+/* An open file. The cache holds one reference while the entry is
+ * resident, every caller of file_get holds another one. */
+struct file_entry
+{
+    char *path;
+    unsigned int hash;
+    int refs;
+    int fd;
+    size_t size;
+    /* Identity of the file when it was opened */
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    FileEntry *next;
+    /* Position in the LRU list of the resident entries */
+    FileEntry *lru_prev;
+    FileEntry *lru_next;
+};
+
+struct file_cache
+{
+    pthread_mutex_t lock;
+    int count;
+    /* Counters, read under the lock */
+    long hits;    /* file_get calls answered from the cache */
+    long misses;  /* Calls that opened the file */
+    long changed; /* Entries dropped because their file changed or went away */
+    long evicted; /* Entries dropped to make room for another file */
+    FileEntry *buckets[FILE_BUCKETS];
+    FileEntry *lru_head; /* Least recently used */
+    FileEntry *lru_tail;
+};
+
+int file_init(FileCache *files);
+FileEntry *file_get(FileCache *files, const char *path, struct stat *st);
+void file_release(FileCache *files, FileEntry *entry);
+void file_forget(FileCache *files, const char *path);
@@ -1,49 +1,200 @@
 /* $begin tinymain */
 /*
- * tiny.c - A simple, iterative HTTP/1.0 Web server that uses the
- *     GET method to serve static and dynamic content.
+ * tiny.c - A simple HTTP/1.0 Web server that uses the GET method to
+ *     serve static and dynamic content, and HEAD for static content.
+ *     Iterative unless -t is given.
  *
  * Updated 11/2019 droh
  *   - Fixed sprintf() aliasing issue in serve_static(), and clienterror().
+ *
+ * Connections and request lines are logged through the asynchronous log
+ * of the proxy, to stdout unless -o names a file. -q turns it off.
+ *
+ * With -t, a pool of that many threads accepts and serves the
+ * connections concurrently. Static files are sent with sendfile from a
+ * cache of open files either way, see filecache.h. A Range header of a
+ * single byte range gets a 206 with that part of the file.
+ *
+ * With -w, CGI programs run as that many persistent workers per program
+ * instead of a fork and exec per request, see workers.h.
+ *
+ * While logging, the counters of the file cache are logged every
+ * REPORT_SECONDS in which there were requests for static files.
+ *
+ * usage: tiny [-q] [-t <threads>] [-w <workers>] [-o <log file>] [-f <log flush ms>] <port>
  */
+#include <getopt.h>
+#include <limits.h>
+#include <sys/sendfile.h>
 #include "csapp.h"
+#include "filecache.h"
+#include "log.h"
+#include "workers.h"
+
+/* Time between two reports of the file cache */
+#define REPORT_SECONDS 60
 
+void serve_connection(int listenfd);
+void *worker(void *vargp);
+void *report(void *vargp);
 void doit(int fd);
-void read_requesthdrs(rio_t *rp);
+void read_requesthdrs(rio_t *rp, char *range);
 int parse_uri(char *uri, char *filename, char *cgiargs);
-void serve_static(int fd, char *filename, int filesize);
+void serve_static(int fd, char *filename, struct stat *sbuf, int head, char *range);
+int parse_range(char *range, size_t size, size_t *first, size_t *last);
+void send_file(int fd, FileEntry *file, size_t offset, size_t count);
 void get_filetype(char *filename, char *filetype);
 void serve_dynamic(int fd, char *filename, char *cgiargs);
+void serve_worker(int fd, char *filename, WorkerPool *pool, char *cgiargs);
 void clienterror(int fd, char *cause, char *errnum,
-                 char *shortmsg, char *longmsg);
+                 char *shortmsg, char *longmsg, int head);
+
+/* Rio_writen jumps here when the client closes the connection */
+static __thread jmp_buf conn_closed;
+
+/* File the thread is sending, released if the client closes early */
+static __thread FileEntry *sending;
+
+/* Output of a CGI worker the thread is sending */
+static __thread char *output;
+
+static FileCache files;
+static WorkerPools workers;
 
 int main(int argc, char **argv)
 {
-    int listenfd, connfd;
-    char hostname[MAXLINE], port[MAXLINE];
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
+    int listenfd;
 
     /* Check command line args */
-    if (argc != 2)
+    int quiet = 0;
+    int threads = 0;
+    int worker_count = 0;
+    char *log_path = NULL;
+    int flush_ms = LOG_FLUSH_MS;
+    int c;
+    while ((c = getopt(argc, argv, "qt:w:o:f:")) != -1)
     {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+        switch (c)
+        {
+        case 'q':
+            quiet = 1;
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'w':
+            worker_count = atoi(optarg);
+            break;
+        case 'o':
+            log_path = optarg;
+            break;
+        case 'f':
+            flush_ms = atoi(optarg);
+            break;
+        default:
+            optind = argc;
+        }
+    }
+
+    if (optind != argc - 1 || flush_ms <= 0 || threads < 0 || worker_count < 0)
+    {
+        fprintf(stderr, "usage: %s [-q] [-t <threads>] [-w <workers>] [-o <log file>] [-f <log flush ms>] <port>\n", argv[0]);
+        exit(1);
+    }
+
+    if (!quiet && log_start(log_path, flush_ms) < 0)
+        exit(1);
+
+    if (file_init(&files) < 0 || workers_init(&workers, worker_count) < 0)
+    {
+        fprintf(stderr, "Can't set up the file cache and the CGI workers\n");
         exit(1);
     }
 
-    listenfd = Open_listenfd(argv[1]);
+    /* A client closing early must not take the server down */
+    Signal(SIGPIPE, SIG_IGN);
+
+    listenfd = Open_listenfd(argv[optind]);
+    int i;
+    pthread_t tid;
+    if (log_on())
+        Pthread_create(&tid, NULL, report, NULL);
+    for (i = 0; i < threads; i++)
+        Pthread_create(&tid, NULL, worker, &listenfd);
+
     while (1)
+        serve_connection(listenfd);
+}
+/* $end tinymain */
+
+/*
+ * serve_connection - accept a connection and answer its request
+ */
+void serve_connection(int listenfd)
+{
+    int connfd;
+    char hostname[MAXLINE], port[MAXLINE];
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+
+    clientlen = sizeof(clientaddr);
+    connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen); // line:netp:tiny:accept
+    if (log_on())
     {
-        clientlen = sizeof(clientaddr);
-        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen); // line:netp:tiny:accept
+        /* Numeric, a reverse lookup would block the server */
         Getnameinfo((SA *)&clientaddr, clientlen, hostname, MAXLINE,
-                    port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
-        doit(connfd);  // line:netp:tiny:doit
-        Close(connfd); // line:netp:tiny:close
+                    port, MAXLINE, NI_NUMERICHOST | NI_NUMERICSERV);
+        log_printf("Accepted connection from (%s, %s)", hostname, port);
     }
+    if (!setjmp(conn_closed))
+        doit(connfd); // line:netp:tiny:doit
+    if (sending != NULL)
+    {
+        file_release(&files, sending);
+        sending = NULL;
+    }
+    free(output);
+    output = NULL;
+    Close(connfd); // line:netp:tiny:close
+}
+
+/*
+ * worker - thread of the pool, all of them accept on the listening socket
+ */
+void *worker(void *vargp)
+{
+    int listenfd = *(int *)vargp;
+    Pthread_detach(pthread_self());
+    while (1)
+        serve_connection(listenfd);
+    return NULL;
+}
+
+/*
+ * report - log the counters of the file cache, unless nothing was asked
+ *     of it since the last report
+ */
+void *report(void *vargp)
+{
+    long requests = 0;
+    Pthread_detach(pthread_self());
+    while (1)
+    {
+        sleep(REPORT_SECONDS);
+        pthread_mutex_lock(&files.lock);
+        int count = files.count;
+        long hits = files.hits, misses = files.misses, changed = files.changed;
+        long evicted = files.evicted;
+        pthread_mutex_unlock(&files.lock);
+        if (hits + misses == requests)
+            continue;
+
+        requests = hits + misses;
+        log_printf("File cache: %d files open, %ld hits, %ld misses, %ld changed, %ld evicted",
+                   count, hits, misses, changed, evicted);
+    }
+    return NULL;
 }
-/* $end tinymain */
 
 /*
  * doit - handle one HTTP request/response transaction
@@ -54,29 +205,31 @@ void doit(int fd)
     int is_static;
     struct stat sbuf;
     char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char filename[MAXLINE], cgiargs[MAXLINE];
+    char filename[MAXLINE], cgiargs[MAXLINE], range[MAXLINE];
     rio_t rio;
 
     /* Read request line and headers */
     Rio_readinitb(&rio, fd);
     if (!Rio_readlineb(&rio, buf, MAXLINE)) // line:netp:doit:readrequest
         return;
-    printf("%s", buf);
+    log_printf("%.*s", (int)strcspn(buf, "\r\n"), buf);
     sscanf(buf, "%s %s %s", method, uri, version); // line:netp:doit:parserequest
-    if (strcasecmp(method, "GET"))
+    int head = !strcasecmp(method, "HEAD");
+    if (strcasecmp(method, "GET") && !head)
     { // line:netp:doit:beginrequesterr
         clienterror(fd, method, "501", "Not Implemented",
-                    "Tiny does not implement this method");
+                    "Tiny does not implement this method", head);
         return;
-    }                       // line:netp:doit:endrequesterr
-    read_requesthdrs(&rio); // line:netp:doit:readrequesthdrs
+    }                              // line:netp:doit:endrequesterr
+    read_requesthdrs(&rio, range); // line:netp:doit:readrequesthdrs
 
     /* Parse URI from GET request */
     is_static = parse_uri(uri, filename, cgiargs); // line:netp:doit:staticcheck
     if (stat(filename, &sbuf) < 0)
     { // line:netp:doit:beginnotfound
+        file_forget(&files, filename);
         clienterror(fd, filename, "404", "Not found",
-                    "Tiny couldn't find this file");
+                    "Tiny couldn't find this file", head);
         return;
     } // line:netp:doit:endnotfound
 
@@ -85,17 +238,23 @@ void doit(int fd)
         if (!(S_ISREG(sbuf.st_mode)) || !(S_IRUSR & sbuf.st_mode))
         { // line:netp:doit:readable
             clienterror(fd, filename, "403", "Forbidden",
-                        "Tiny couldn't read the file");
+                        "Tiny couldn't read the file", head);
             return;
         }
-        serve_static(fd, filename, sbuf.st_size); // line:netp:doit:servestatic
+        serve_static(fd, filename, &sbuf, head, range); // line:netp:doit:servestatic
     }
     else
     { /* Serve dynamic content */
+        if (head)
+        {
+            clienterror(fd, method, "501", "Not Implemented",
+                        "Tiny does not implement HEAD for CGI programs", head);
+            return;
+        }
         if (!(S_ISREG(sbuf.st_mode)) || !(S_IXUSR & sbuf.st_mode))
         { // line:netp:doit:executable
             clienterror(fd, filename, "403", "Forbidden",
-                        "Tiny couldn't run the CGI program");
+                        "Tiny couldn't run the CGI program", head);
             return;
         }
         serve_dynamic(fd, filename, cgiargs); // line:netp:doit:servedynamic
@@ -104,19 +263,31 @@ void doit(int fd)
 /* $end doit */
 
 /*
- * read_requesthdrs - read HTTP request headers
+ * read_requesthdrs - read HTTP request headers, keeping the value
+ *                    of a Range header in range
  */
 /* $begin read_requesthdrs */
-void read_requesthdrs(rio_t *rp)
+void read_requesthdrs(rio_t *rp, char *range)
 {
-    char buf[MAXLINE];
+    char *line;
+    ssize_t n;
 
-    Rio_readlineb(rp, buf, MAXLINE);
-    printf("%s", buf);
-    while (strcmp(buf, "\r\n"))
+    range[0] = '\0';
+    /* The lines are looked at in the read buffer, not copied. A client
+     * closing early ends the headers too. */
+    while ((n = Rio_readline_view(rp, &line, MAXLINE)) > 0 &&
+           !(n == 2 && !memcmp(line, "\r\n", 2)))
     { // line:netp:readhdrs:checkterm
-        Rio_readlineb(rp, buf, MAXLINE);
-        printf("%s", buf);
+        if (n > 6 && !strncasecmp(line, "Range:", 6))
+        { /* The first word of the value, the view isn't NUL terminated */
+            char *end = line + n;
+            line += 6;
+            while (line < end && isspace((unsigned char)*line))
+                line++;
+            for (n = 0; line + n < end && !isspace((unsigned char)line[n]); n++)
+                range[n] = line[n];
+            range[n] = '\0';
+        }
     }
     return;
 }
@@ -158,31 +329,137 @@ int parse_uri(char *uri, char *filename, char *cgiargs)
 /* $end parse_uri */
 
 /*
- * serve_static - copy a file back to the client
+ * serve_static - send a file, or the range of it the client asked for,
+ *                back to the client
  */
 /* $begin serve_static */
-void serve_static(int fd, char *filename, int filesize)
+void serve_static(int fd, char *filename, struct stat *sbuf, int head, char *range)
 {
-    int srcfd;
-    char *srcp, filetype[MAXLINE], buf[MAXBUF];
+    char filetype[MAXLINE], buf[MAXBUF];
+    size_t first, last;
+    int n, partial;
 
-    /* Send response headers to client */
-    get_filetype(filename, filetype);    // line:netp:servestatic:getfiletype
-    sprintf(buf, "HTTP/1.0 200 OK\r\n"); // line:netp:servestatic:beginserve
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n", filesize);
-    Rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: %s\r\n\r\n", filetype);
-    Rio_writen(fd, buf, strlen(buf)); // line:netp:servestatic:endserve
-
-    /* Send response body to client */
-    srcfd = Open(filename, O_RDONLY, 0);                        // line:netp:servestatic:open
-    srcp = Mmap(0, filesize, PROT_READ, MAP_PRIVATE, srcfd, 0); // line:netp:servestatic:mmap
-    Close(srcfd);                                               // line:netp:servestatic:close
-    Rio_writen(fd, srcp, filesize);                             // line:netp:servestatic:write
-    Munmap(srcp, filesize);                                     // line:netp:servestatic:munmap
+    if ((sending = file_get(&files, filename, sbuf)) == NULL)
+    {
+        clienterror(fd, filename, "403", "Forbidden",
+                    "Tiny couldn't read the file", head);
+        return;
+    }
+
+    /* Send response headers to client, in a single write */
+    first = 0;
+    last = sending->size - 1;
+    if ((partial = parse_range(range, sending->size, &first, &last)) < 0)
+    {
+        n = snprintf(buf, MAXBUF, "HTTP/1.0 416 Range Not Satisfiable\r\n"
+                                  "Server: Tiny Web Server\r\n"
+                                  "Content-range: bytes */%zu\r\n"
+                                  "Content-length: 0\r\n\r\n",
+                     sending->size);
+        Rio_writen(fd, buf, n, conn_closed);
+        file_release(&files, sending);
+        sending = NULL;
+        return;
+    }
+
+    get_filetype(filename, filetype); // line:netp:servestatic:getfiletype
+    if (partial)
+        n = snprintf(buf, MAXBUF, "HTTP/1.0 206 Partial Content\r\n"
+                                  "Content-range: bytes %zu-%zu/%zu\r\n",
+                     first, last, sending->size);
+    else
+        n = snprintf(buf, MAXBUF, "HTTP/1.0 200 OK\r\n"); // line:netp:servestatic:beginserve
+    n += snprintf(buf + n, MAXBUF - n, "Server: Tiny Web Server\r\n"
+                                       "Accept-ranges: bytes\r\n"
+                                       "Content-length: %zu\r\n"
+                                       "Content-type: %.*s\r\n\r\n",
+                  sending->size > 0 ? last - first + 1 : 0, 64, filetype);
+    Rio_writen(fd, buf, n, conn_closed); // line:netp:servestatic:endserve
+
+    /* Send response body to client, straight from the cached descriptor */
+    if (!head && sending->size > 0)
+        send_file(fd, sending, first, last - first + 1); // line:netp:servestatic:write
+    file_release(&files, sending);
+    sending = NULL;
+}
+
+/*
+ * parse_range - parse the value of a Range header against a file of size
+ *     bytes. Only a single byte range is honored, anything else gets the
+ *     whole file as the standard allows. Returns 1 with the first and last
+ *     byte of the range set, 0 for the whole file, -1 if the range lies
+ *     past the end of the file.
+ */
+int parse_range(char *range, size_t size, size_t *first, size_t *last)
+{
+    char *end;
+    unsigned long long from, to;
+
+    if (strncasecmp(range, "bytes=", 6) || strchr(range, ','))
+        return 0;
+
+    range += 6;
+    if (*range == '-')
+    { /* The last bytes of the file */
+        if (!isdigit((unsigned char)range[1]))
+            return 0;
+        to = strtoull(range + 1, &end, 10);
+        if (*end != '\0')
+            return 0;
+        if (to == 0 || size == 0)
+            return -1;
+        *first = to < size ? size - to : 0;
+        *last = size - 1;
+        return 1;
+    }
+
+    if (!isdigit((unsigned char)*range))
+        return 0;
+    from = strtoull(range, &end, 10);
+    if (*end++ != '-')
+        return 0;
+    to = ULLONG_MAX;
+    if (*end != '\0')
+    {
+        if (!isdigit((unsigned char)*end))
+            return 0;
+        to = strtoull(end, &end, 10);
+        if (*end != '\0' || to < from)
+            return 0;
+    }
+    if (from >= size)
+        return -1;
+    *first = from;
+    *last = to < size ? to : size - 1;
+    return 1;
+}
+
+/*
+ * send_file - send count bytes of a cached file from offset with sendfile,
+ *     the bytes go from the page cache to the socket without a copy
+ *     through the server. Jumps to conn_closed like Rio_writen if the
+ *     client goes away.
+ */
+void send_file(int fd, FileEntry *file, size_t offset, size_t count)
+{
+    off_t pos = offset;
+    ssize_t n;
+
+    while (count > 0)
+    {
+        /* The offset is passed in, so the threads share the descriptor */
+        if ((n = sendfile(fd, file->fd, &pos, count)) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EPIPE || errno == ECONNRESET)
+                longjmp(conn_closed, 1);
+            unix_error("sendfile error");
+        }
+        if (n == 0) /* The file shrank since it was opened */
+            return;
+        count -= n;
+    }
 }
 
 /*
@@ -209,52 +486,95 @@ void get_filetype(char *filename, char *filetype)
 /* $begin serve_dynamic */
 void serve_dynamic(int fd, char *filename, char *cgiargs)
 {
-    char buf[MAXLINE], *emptylist[] = {NULL};
+    char buf[MAXLINE], *emptylist[] = {NULL}, **envp;
+    pid_t pid;
+    WorkerPool *pool;
+
+    if (workers.size > 0 && (pool = workers_pool(&workers, filename)) != NULL)
+    {
+        serve_worker(fd, filename, pool, cgiargs);
+        return;
+    }
 
     /* Return first part of HTTP response */
     sprintf(buf, "HTTP/1.0 200 OK\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    Rio_writen(fd, buf, strlen(buf), conn_closed);
     sprintf(buf, "Server: Tiny Web Server\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    Rio_writen(fd, buf, strlen(buf), conn_closed);
 
-    if (Fork() == 0)
+    /* Real server would set all CGI vars here. The environment is built
+     * before the fork, the child of a threaded server calls no setenv. */
+    envp = cgi_environment("QUERY_STRING", cgiargs); // line:netp:servedynamic:setenv
+    if ((pid = Fork()) == 0)
     { /* Child */ // line:netp:servedynamic:fork
-        /* Real server would set all CGI vars here */
-        setenv("QUERY_STRING", cgiargs, 1);                         // line:netp:servedynamic:setenv
-        Dup2(fd, STDOUT_FILENO); /* Redirect stdout to client */    // line:netp:servedynamic:dup2
-        Execve(filename, emptylist, environ); /* Run CGI program */ // line:netp:servedynamic:execve
+        dup2(fd, STDOUT_FILENO); /* Redirect stdout to client */ // line:netp:servedynamic:dup2
+        /* Nor does it keep the descriptors of the other threads */
+        cgi_close_fds();
+        execve(filename, emptylist, envp); /* Run CGI program */ // line:netp:servedynamic:execve
+        _exit(127);
     }
-    Wait(NULL); /* Parent waits for and reaps child */ // line:netp:servedynamic:wait
+    free(envp);
+    /* Parent waits for and reaps its own child, not one of another thread */
+    Waitpid(pid, NULL, 0); // line:netp:servedynamic:wait
 }
 /* $end serve_dynamic */
 
 /*
- * clienterror - returns an error message to the client
+ * serve_worker - run a request of a CGI program on one of its workers
+ */
+void serve_worker(int fd, char *filename, WorkerPool *pool, char *cgiargs)
+{
+    char buf[MAXLINE];
+    size_t length;
+    int n;
+
+    if ((output = workers_run(&workers, pool, cgiargs, &length)) == NULL)
+    {
+        clienterror(fd, filename, "502", "Bad Gateway",
+                    "Tiny couldn't get an answer from the CGI program", 0);
+        return;
+    }
+
+    /* The worker printed the rest of the head and the body */
+    n = snprintf(buf, MAXLINE, "HTTP/1.0 200 OK\r\nServer: Tiny Web Server\r\n");
+    Rio_writen(fd, buf, n, conn_closed);
+    Rio_writen(fd, output, length, conn_closed);
+    free(output);
+    output = NULL;
+}
+
+/*
+ * clienterror - returns an error message to the client, only its
+ *               headers if the request is a HEAD
  */
 /* $begin clienterror */
 void clienterror(int fd, char *cause, char *errnum,
-                 char *shortmsg, char *longmsg)
+                 char *shortmsg, char *longmsg, int head)
 {
     char buf[MAXLINE];
 
     /* Print the HTTP response headers */
     sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
+    Rio_writen(fd, buf, strlen(buf), conn_closed);
     sprintf(buf, "Content-type: text/html\r\n\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    Rio_writen(fd, buf, strlen(buf), conn_closed);
+
+    /* The answer to a HEAD request has no body */
+    if (head)
+        return;
 
     /* Print the HTTP response body */
     sprintf(buf, "<html><title>Tiny Error</title>");
-    Rio_writen(fd, buf, strlen(buf));
+    Rio_writen(fd, buf, strlen(buf), conn_closed);
     sprintf(buf, "<body bgcolor="
                  "ffffff"
                  ">\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    Rio_writen(fd, buf, strlen(buf), conn_closed);
     sprintf(buf, "%s: %s\r\n", errnum, shortmsg);
-    Rio_writen(fd, buf, strlen(buf));
+    Rio_writen(fd, buf, strlen(buf), conn_closed);
     sprintf(buf, "<p>%s: %s\r\n", longmsg, cause);
-    Rio_writen(fd, buf, strlen(buf));
+    Rio_writen(fd, buf, strlen(buf), conn_closed);
     sprintf(buf, "<hr><em>The Tiny Web server</em>\r\n");
-    Rio_writen(fd, buf, strlen(buf));
+    Rio_writen(fd, buf, strlen(buf), conn_closed);
 }
 /* $end clienterror */
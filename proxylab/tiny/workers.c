@@ -0,0 +1,208 @@
+#include <sys/syscall.h>
+#include "workers.h"
+
+static int start_worker(WorkerPool *pool, Worker *worker);
+static void stop_worker(Worker *worker);
+static char *exchange(Worker *worker, const char *query, size_t *length);
+
+int workers_init(WorkerPools *pools, int size)
+{
+    pools->size = size;
+    pools->count = 0;
+    if (pthread_mutex_init(&pools->lock, NULL) != 0)
+        return -1;
+
+    return 0;
+}
+
+/* Pool of the program at path, set up on its first call. Returns NULL
+ * if there are WORKER_PROGRAMS pools already. */
+WorkerPool *workers_pool(WorkerPools *pools, const char *path)
+{
+    WorkerPool *pool = NULL;
+    int i;
+    pthread_mutex_lock(&pools->lock);
+    for (i = 0; i < pools->count; i++)
+        if (!strcmp(pools->pools[i].path, path))
+        {
+            pool = &pools->pools[i];
+            break;
+        }
+
+    if (pool == NULL && pools->count < WORKER_PROGRAMS && strlen(path) < MAXLINE)
+    {
+        /* The workers start on their first request, so a new pool is cheap */
+        pool = &pools->pools[pools->count++];
+        strcpy(pool->path, path);
+        pool->workers = Calloc(pools->size, sizeof(Worker));
+        pool->idle = NULL;
+        pthread_cond_init(&pool->available, NULL);
+        for (i = 0; i < pools->size; i++)
+        {
+            pool->workers[i].fd = -1;
+            pool->workers[i].next = pool->idle;
+            pool->idle = &pool->workers[i];
+        }
+    }
+
+    pthread_mutex_unlock(&pools->lock);
+    return pool;
+}
+
+/* Running a request on an idle worker of the pool, waiting for one if
+ * they are all busy. Returns the output in a buffer to be freed by the
+ * caller, or NULL if the worker failed. A failed worker is stopped and
+ * started again on the next request. */
+char *workers_run(WorkerPools *pools, WorkerPool *pool, const char *query, size_t *length)
+{
+    pthread_mutex_lock(&pools->lock);
+    while (pool->idle == NULL)
+        pthread_cond_wait(&pool->available, &pools->lock);
+
+    Worker *worker = pool->idle;
+    pool->idle = worker->next;
+    pthread_mutex_unlock(&pools->lock);
+
+    /* A worker that died since its last request gets restarted once. One
+     * that ran out of time isn't given the same request again. */
+    int tries = worker->fd >= 0 ? 2 : 1;
+    char *output = NULL;
+    while (output == NULL && tries-- > 0 && (worker->fd >= 0 || start_worker(pool, worker) == 0))
+        if ((output = exchange(worker, query, length)) == NULL)
+        {
+            int timed_out = errno == EAGAIN || errno == EWOULDBLOCK;
+            stop_worker(worker);
+            if (timed_out)
+                break;
+        }
+
+    pthread_mutex_lock(&pools->lock);
+    worker->next = pool->idle;
+    pool->idle = worker;
+    pthread_cond_signal(&pool->available);
+    pthread_mutex_unlock(&pools->lock);
+    return output;
+}
+
+/* Forking and executing the program with its end of a new socket pair
+ * as stdin and stdout */
+static int start_worker(WorkerPool *pool, Worker *worker)
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+        return -1;
+
+    /* The reads and writes of the exchanges fail once they wait too long */
+    struct timeval timeout = {WORKER_TIMEOUT, 0};
+    if (setsockopt(fds[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+        setsockopt(fds[0], SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    /* Another thread may hold the malloc or the environ lock at the fork,
+     * so the child doesn't call setenv, it gets a ready environment */
+    char **envp = cgi_environment("CGI_WORKER", "1");
+    pid_t pid;
+    if ((pid = fork()) < 0)
+    {
+        free(envp);
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0)
+    {
+        char *argv[] = {pool->path, NULL};
+        dup2(fds[1], STDIN_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        /* The worker outlives the request, it must not keep the client
+         * sockets and files of the other threads open */
+        cgi_close_fds();
+        execve(pool->path, argv, envp);
+        _exit(127);
+    }
+
+    free(envp);
+    close(fds[1]);
+    worker->pid = pid;
+    worker->fd = fds[0];
+    rio_readinitb(&worker->rio, fds[0]);
+    return 0;
+}
+
+/* Closing the socket ends the worker's loop, the kill takes care of a
+ * worker that stopped making sense */
+static void stop_worker(Worker *worker)
+{
+    close(worker->fd);
+    kill(worker->pid, SIGKILL);
+    waitpid(worker->pid, NULL, 0);
+    worker->fd = -1;
+}
+
+/* Returns NULL if the worker failed, with errno EAGAIN if it ran out of time */
+static char *exchange(Worker *worker, const char *query, size_t *length)
+{
+    char line[MAXLINE];
+    errno = 0;
+    size_t query_length = strlen(query);
+    int n = snprintf(line, MAXLINE, "%zu\n", query_length);
+    if (rio_writen(worker->fd, line, n) < 0 || rio_writen(worker->fd, (void *)query, query_length) < 0)
+        return NULL;
+
+    if (rio_readlineb(&worker->rio, line, MAXLINE) <= 0)
+        return NULL;
+
+    char *end;
+    *length = strtoul(line, &end, 10);
+    if (end == line || *end != '\n' || *length > WORKER_MAX_OUTPUT)
+        return NULL;
+
+    char *output = Malloc(*length + 1);
+    if (rio_readnb(&worker->rio, output, *length) != (ssize_t)*length)
+    {
+        free(output);
+        return NULL;
+    }
+
+    return output;
+}
+
+/* The server's environment with name set to value, for the execve of a
+ * forked child. Built before the fork, another thread may hold the malloc
+ * or the environ lock then. A single block, the caller frees it. */
+char **cgi_environment(const char *name, const char *value)
+{
+    size_t count = 0, i, n = 0;
+    while (environ[count] != NULL)
+        count++;
+
+    size_t name_len = strlen(name);
+    size_t var_size = name_len + strlen(value) + 2;
+    char **envp = Malloc((count + 2) * sizeof(char *) + var_size);
+    char *var = (char *)(envp + count + 2);
+    snprintf(var, var_size, "%s=%s", name, value);
+    for (i = 0; i < count; i++)
+        if (strncmp(environ[i], var, name_len + 1))
+            envp[n++] = environ[i];
+
+    envp[n++] = var;
+    envp[n] = NULL;
+    return envp;
+}
+
+/* Closing every descriptor above stderr in a forked child, the client
+ * sockets and files of the other threads among them */
+void cgi_close_fds(void)
+{
+    if (syscall(SYS_close_range, 3, ~0U, 0) < 0)
+    {
+        long fd, max = sysconf(_SC_OPEN_MAX);
+        for (fd = 3; fd < max; fd++)
+            close(fd);
+    }
+}
@@ -0,0 +1,53 @@
+#include "csapp.h"
+
+/* Persistent CGI programs, in the spirit of FastCGI. A program started
+ * with CGI_WORKER in its environment doesn't answer one request and
+ * exit, it answers requests on its stdin and stdout, both one end of a
+ * socket pair, until the server closes it. A request is the decimal
+ * length of the query string, a newline and the query string. The
+ * response is the length of the output, a newline and the output, the
+ * same headers and body the program prints as a plain CGI program. */
+
+/* Programs with a pool at most, the others are forked per request */
+#define WORKER_PROGRAMS 16
+
+/* Longest output of a request */
+#define WORKER_MAX_OUTPUT (1 << 20)
+
+/* Seconds a worker may go without reading or answering a request, it's
+ * killed then and started again on the next one */
+#define WORKER_TIMEOUT 10
+
+typedef struct worker Worker;
+typedef struct worker_pool WorkerPool;
+
+struct worker
+{
+    pid_t pid;
+    int fd; /* The server's end of the socket pair, -1 until started */
+    rio_t rio;
+    Worker *next; /* Next idle worker of the pool */
+};
+
+/* Workers of a program, started on its first request */
+struct worker_pool
+{
+    char path[MAXLINE];
+    Worker *workers;
+    Worker *idle;
+    pthread_cond_t available; /* Signaled whenever a worker goes back idle */
+};
+
+typedef struct worker_pools
+{
+    pthread_mutex_t lock;
+    int size; /* Workers per program */
+    int count;
+    WorkerPool pools[WORKER_PROGRAMS];
+} WorkerPools;
+
+int workers_init(WorkerPools *pools, int size);
+WorkerPool *workers_pool(WorkerPools *pools, const char *path);
+char *workers_run(WorkerPools *pools, WorkerPool *pool, const char *query, size_t *length);
+char **cgi_environment(const char *name, const char *value);
+void cgi_close_fds(void);